@@ -0,0 +1,75 @@
+//
+// Read-only tables in their own flash partition, mapped into the address space through the
+// flash cache: keyboard layouts per locale, keymaps, macro libraries. Lookups return pointers
+// into flash, so a table costs no RAM however large it is. The image is built on the host
+// with host/pack_assets.py.
+//
+
+#ifndef BLACK_BRICKS_ESP_BASE_ASSETS_H
+#define BLACK_BRICKS_ESP_BASE_ASSETS_H
+
+//MARK: Import common headers
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+//MARK: Macros and constants
+// Data partition holding the image, see partition_table.csv
+#define ASSETS_PARTITION_LABEL "assets"
+#define ASSETS_PARTITION_SUBTYPE 0x42
+
+// Image format, all little endian: header, index sorted by type then id, table data. Keep in
+// step with host/pack_assets.py.
+#define ASSETS_MAGIC 0x31545341u      // "AST1"
+#define ASSETS_FORMAT_VERSION 1
+#define ASSETS_ALIGN 4                  // Every table starts at a multiple of this
+
+//MARK: Types
+typedef enum {
+    ASSET_TYPE_LAYOUT = 1,              // id: config_data_t.locale
+    ASSET_TYPE_KEYMAP = 2,
+    ASSET_TYPE_MACROS = 3,
+} asset_type_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;                     // Index entries
+    uint32_t size;                      // Whole image
+    uint32_t crc;                       // esp_rom_crc32_le over the index
+} assets_header_t;
+
+typedef struct {
+    uint16_t type;
+    uint16_t id;
+    uint32_t offset;                    // From the start of the image
+    uint32_t length;
+    uint32_t crc;                       // esp_rom_crc32_le over the table, see assets_verify
+} assets_entry_t;
+
+//MARK: Global variables
+
+//MARK: Function prototypes
+/**
+ * Map the partition and check the header and index. Nothing is copied and the tables are not
+ * read, so this costs the same for any image size. ESP_ERR_NOT_FOUND without the partition or
+ * an image in it, other errors for an image that is damaged or of another format version;
+ * lookups fail with ESP_ERR_INVALID_STATE then.
+ */
+extern esp_err_t assets_init();
+extern esp_err_t assets_deinit();
+
+/**
+ * Find a table by binary search of the index. *data points into mapped flash and stays valid
+ * until assets_deinit; it is read through the cache like const data in the app.
+ */
+extern esp_err_t assets_get(asset_type_t type, uint16_t id, const void **data, size_t *length);
+
+/**
+ * Check every table against its CRC, which reads the whole image. For diagnostics and after
+ * writing a new image, not needed at boot.
+ */
+extern esp_err_t assets_verify();
+
+#endif //BLACK_BRICKS_ESP_BASE_ASSETS_H
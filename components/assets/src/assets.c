@@ -0,0 +1,164 @@
+//
+// The whole partition is mapped once at init. Header and index are checked then, the tables
+// only on assets_verify.
+//
+
+//MARK: Import common headers
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_spi_flash.h"
+
+//MARK: Import component header
+#include "assets.h"
+
+//MARK: Private macros and constants
+#define TAG "ASSETS"
+
+//MARK: Private types
+typedef struct {
+    const uint8_t *image;               // NULL until a valid image is mapped
+    spi_flash_mmap_handle_t handle;
+    const assets_header_t *header;
+    const assets_entry_t *index;
+} component_t;
+
+//MARK: Declaration of the private opaque structs
+
+//MARK: Public global variables
+
+//MARK: Private global variables
+static component_t component = {
+        .image = NULL,
+};
+
+//MARK: Private functions
+static int assets_compare(const assets_entry_t *entry, uint16_t type, uint16_t id) {
+    if (entry->type != type) {
+        return entry->type < type ? -1 : 1;
+    }
+    if (entry->id != id) {
+        return entry->id < id ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Header and index of a mapped image, against the partition size.
+ */
+static esp_err_t assets_check(const uint8_t *image, size_t partition_size) {
+    const assets_header_t *header = (const assets_header_t *) image;
+    if (header->magic != ASSETS_MAGIC) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (header->version != ASSETS_FORMAT_VERSION) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    size_t index_size = (size_t) header->count * sizeof(assets_entry_t);
+    if (header->size > partition_size || sizeof(assets_header_t) + index_size > header->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const assets_entry_t *index = (const assets_entry_t *) (image + sizeof(assets_header_t));
+    if (esp_rom_crc32_le(0, (const uint8_t *) index, index_size) != header->crc) {
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    for (size_t i = 0; i < header->count; i++) {
+        if (index[i].offset > header->size || index[i].length > header->size - index[i].offset ||
+            index[i].offset % ASSETS_ALIGN != 0 ||
+            (i > 0 && assets_compare(&index[i - 1], index[i].type, index[i].id) >= 0)) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+    return ESP_OK;
+}
+
+//MARK: Public functions
+esp_err_t assets_init() {
+    if (component.image != NULL) {
+        return ESP_OK;
+    }
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                (esp_partition_subtype_t) ASSETS_PARTITION_SUBTYPE,
+                                                                ASSETS_PARTITION_LABEL);
+    if (partition == NULL) {
+        ESP_LOGW(TAG, "No %s partition", ASSETS_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (partition->size < sizeof(assets_header_t)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    const void *image;
+    spi_flash_mmap_handle_t handle;
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &image, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = assets_check(image, partition->size);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No usable image in %s: %s", ASSETS_PARTITION_LABEL, esp_err_to_name(err));
+        spi_flash_munmap(handle);
+        return err;
+    }
+
+    component.image = image;
+    component.handle = handle;
+    component.header = image;
+    component.index = (const assets_entry_t *) (component.image + sizeof(assets_header_t));
+    ESP_LOGI(TAG, "%u tables, %u bytes", component.header->count, component.header->size);
+    return ESP_OK;
+}
+
+esp_err_t assets_deinit() {
+    if (component.image == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    spi_flash_munmap(component.handle);
+    component.image = NULL;
+    return ESP_OK;
+}
+
+esp_err_t assets_get(asset_type_t type, uint16_t id, const void **data, size_t *length) {
+    if (data == NULL || length == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (component.image == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t low = 0;
+    size_t high = component.header->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        int order = assets_compare(&component.index[middle], type, id);
+        if (order == 0) {
+            *data = component.image + component.index[middle].offset;
+            *length = component.index[middle].length;
+            return ESP_OK;
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t assets_verify() {
+    if (component.image == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (size_t i = 0; i < component.header->count; i++) {
+        const assets_entry_t *entry = &component.index[i];
+        if (esp_rom_crc32_le(0, component.image + entry->offset, entry->length) != entry->crc) {
+            ESP_LOGE(TAG, "Table %u/%u is corrupt", entry->type, entry->id);
+            return ESP_ERR_INVALID_CRC;
+        }
+    }
+    return ESP_OK;
+}
@@ -10,7 +10,7 @@
 #include "esp_hidd_prf_api.h"
 
 //MARK: Macros and constants
-#define BT_DEVICE_NAME "BLE_KEYBOARD"
+#define BT_DEVICE_NAME "BLE_KEYBOARD" // Default, the stored config record can override it
 #define MAX_BT_DEVICENAME_LENGTH 40
 
 //MARK: Types
@@ -20,18 +20,30 @@ typedef struct config_data {
 } config_data_t;
 
 //MARK: Types (Core)
+// bda is the address of the peer that connected or disconnected
+typedef void (*ble_connection_cb_t)(bool connected, const uint8_t *bda);
+typedef void (*ble_report_cb_t)(void);
+// Every scan result. name points into the advertising data, is not NUL terminated and is NULL
+// when the advertisement carries none.
+typedef void (*ble_scan_cb_t)(const uint8_t *bda, const uint8_t *name, uint8_t name_length, int rssi);
 
 //MARK: Global variables
 
 //MARK: Function prototypes
-esp_err_t ble_init();
+esp_err_t ble_init(const config_data_t *config_data);
+void ble_set_connection_cb(ble_connection_cb_t connection_cb);
+// Called right before every key report, from the sending task
+void ble_set_report_cb(ble_report_cb_t report_cb);
 
 //MARK: Function prototypes (Config)
 
 //MARK: Function prototypes (Scan)
+// Called from the BLE stack task, must not block
+void ble_set_scan_cb(ble_scan_cb_t scan_cb);
 
 //MARK: Function prototypes (Client)
 void ble_hid_keyboard_send_report(key_mask_t special_key, uint8_t *keyboard_cmd, uint8_t num_key);
+void ble_hid_consumer_send_report(uint8_t key_cmd, bool key_pressed);
 
 //MARK: Function prototypes (Server)
 
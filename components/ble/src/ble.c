@@ -71,6 +71,10 @@ static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *
 
 static config_data_t config;
 
+static ble_connection_cb_t connection_cb = NULL;
+static ble_report_cb_t report_cb = NULL;
+static ble_scan_cb_t scan_cb = NULL;
+
 //a list of active HID connections.
 //index is the hid_conn_id.
 esp_bd_addr_t active_connections[CONFIG_BT_ACL_CONNECTIONS] = {0};
@@ -211,6 +215,9 @@ static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *
         //to allow more connections, we simply restart the adv process.
         esp_ble_gap_start_advertising(&hidd_adv_params);
         //xEventGroupClearBits(eventgroup_system, SYSTEM_CURRENTLY_ADVERTISING);
+
+        if (connection_cb != NULL)
+            connection_cb(true, param->connect.remote_bda);
         break;
     }
     case ESP_HIDD_EVENT_BLE_DISCONNECT:
@@ -238,6 +245,9 @@ static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *
         ESP_LOGI(TAG, "ESP_HIDD_EVENT_BLE_DISCONNECT");
         esp_ble_gap_start_advertising(&hidd_adv_params);
         xEventGroupSetBits(eventgroup_system, SYSTEM_CURRENTLY_ADVERTISING);
+
+        if (connection_cb != NULL)
+            connection_cb(false, param->disconnect.remote_bda);
         break;
     }
     case ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT:
@@ -335,16 +345,13 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
             adv_name = esp_ble_resolve_adv_data(scan_result->scan_rst.ble_adv, ESP_BLE_AD_TYPE_NAME_CMPL, &adv_name_len);
             if (adv_name_len == 0)
                 adv_name = esp_ble_resolve_adv_data(scan_result->scan_rst.ble_adv, ESP_BLE_AD_TYPE_NAME_SHORT, &adv_name_len);
+            //adv_name points into ble_adv and is not NUL terminated
             if (adv_name != NULL)
-            {
-                //store name to BT addr...
-                esp_log_buffer_hex(TAG, scan_result->scan_rst.bda, 6);
-                esp_log_buffer_char(TAG, adv_name, adv_name_len);
-                adv_name[adv_name_len] = '\0';
-                char key[13];
-                sprintf(key, "%02X%02X%02X%02X%02X%02X", scan_result->scan_rst.bda[0], scan_result->scan_rst.bda[1],
-                        scan_result->scan_rst.bda[2], scan_result->scan_rst.bda[3], scan_result->scan_rst.bda[4], scan_result->scan_rst.bda[5]);
-            }
+                ESP_LOGD(TAG, "%02x:%02x:%02x:%02x:%02x:%02x %.*s", scan_result->scan_rst.bda[0], scan_result->scan_rst.bda[1],
+                         scan_result->scan_rst.bda[2], scan_result->scan_rst.bda[3], scan_result->scan_rst.bda[4],
+                         scan_result->scan_rst.bda[5], adv_name_len, (const char *)adv_name);
+            if (scan_cb != NULL)
+                scan_cb(scan_result->scan_rst.bda, adv_name, adv_name_len, scan_result->scan_rst.rssi);
             break;
         case ESP_GAP_SEARCH_INQ_CMPL_EVT:
             break;
@@ -369,11 +376,31 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
     }
 }
 
+void ble_set_connection_cb(ble_connection_cb_t cb) {
+    connection_cb = cb;
+}
+
+void ble_set_report_cb(ble_report_cb_t cb) {
+    report_cb = cb;
+}
+
+void ble_set_scan_cb(ble_scan_cb_t cb) {
+    scan_cb = cb;
+}
+
 void ble_hid_keyboard_send_report(key_mask_t special_key, uint8_t *keyboard_cmd, uint8_t num_key) {
+    if (report_cb != NULL)
+        report_cb();
     esp_hidd_send_keyboard_value(hid_conn_id, special_key, keyboard_cmd, num_key);
 }
 
-esp_err_t ble_init() {
+void ble_hid_consumer_send_report(uint8_t key_cmd, bool key_pressed) {
+    if (report_cb != NULL)
+        report_cb();
+    esp_hidd_send_consumer_value(hid_conn_id, key_cmd, key_pressed);
+}
+
+esp_err_t ble_init(const config_data_t *config_data) {
 
     esp_err_t ret;
 
@@ -420,7 +447,7 @@ esp_err_t ble_init() {
         ESP_LOGE(TAG, "%s init bluedroid failed\n", __func__);
     }
 
-    strcpy(config.bt_device_name, BT_DEVICE_NAME);
+    config = *config_data;
 
     ///register the callback function to the gap module
     esp_ble_gap_register_callback(gap_event_handler);
@@ -6,21 +6,211 @@
 #define BLACK_BRICKS_ESP_BASE_BUTTON_H
 
 //MARK: Import common headers
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include "esp_err.h"
 #include "driver/gpio.h"
 
 //MARK: Macros and constants
+#define BUTTON_PIN_BIT(x) (1ULL << (x))
+
+// All keys share one 64-bit space: GPIO buttons use their GPIO number, matrix keys follow them
+#define BUTTON_KEY_MAX 64
+#define BUTTON_MATRIX_KEY_BASE GPIO_NUM_MAX
+#define BUTTON_MATRIX_MAX_KEYS (BUTTON_KEY_MAX - BUTTON_MATRIX_KEY_BASE)
+#define BUTTON_MATRIX_MAX_LINES 8
+#define BUTTON_MATRIX_KEY(row, col, col_count) ((gpio_num_t) (BUTTON_MATRIX_KEY_BASE + (row) * (col_count) + (col)))
+
+// Depth of the ISR-to-task event rings, must be a power of two
+#ifndef BUTTON_RING_LENGTH
+#define BUTTON_RING_LENGTH 32
+#endif
+
+// Most events handed to on_button_batch_cb_t in one call
+#ifndef BUTTON_BATCH_LENGTH
+#define BUTTON_BATCH_LENGTH BUTTON_RING_LENGTH
+#endif
+
+#define BUTTON_DEBOUNCE_SAMPLE_PERIOD_DEFAULT_US 1000
+#define BUTTON_DEBOUNCE_WINDOW_DEFAULT_US 5000
+#define BUTTON_LONG_PRESS_DEFAULT_MS 1500
+#define BUTTON_LONG_LONG_PRESS_DEFAULT_MS 10000
+#define BUTTON_CHORD_WINDOW_DEFAULT_MS 50
+#define BUTTON_TAP_WINDOW_DEFAULT_MS 250
+#define BUTTON_TAP_MAX 3
+#define BUTTON_MATRIX_SCAN_PERIOD_DEFAULT_US 2000
+#define BUTTON_ENCODER_STEPS_PER_DETENT_DEFAULT 4
+#define BUTTON_ENCODER_REPORT_PERIOD_DEFAULT_US 7500
+#define BUTTON_ENCODER_NO_PCNT (-1)
 
 //MARK: Types
 typedef enum {
     BUTTON_DOWN = 0,
-    BUTTON_UP = 1
+    BUTTON_UP = 1,
+    BUTTON_LONG_PRESS = 2,
+    BUTTON_LONG_LONG_PRESS = 3,
+    BUTTON_CHORD = 4,
+    BUTTON_CHORD_UP = 5,
+    BUTTON_TAP = 6,
+    BUTTON_TAP_CORRECTION = 7,
+    BUTTON_REPEAT = 8,
+    BUTTON_ENCODER = 9,
 } button_event_type_t;
 
-typedef esp_err_t (*on_button_event_cb_t)(gpio_num_t pin, button_event_type_t event);
+/**
+ * Button event record.
+ * Captured in the GPIO ISR, so the timestamp and level snapshot describe the edge itself
+ * rather than the moment gpio_task got around to handling it.
+ */
+typedef struct {
+    gpio_num_t pin;         // GPIO number, or BUTTON_MATRIX_KEY() for matrix keys
+    button_event_type_t type;
+    int64_t timestamp;      // esp_timer_get_time() at the edge (or deadline for long presses), microseconds
+    uint64_t levels;        // Snapshot of GPIO input levels at the edge, bit N = GPIO N (active-high buttons inverted)
+    uint64_t pins;          // Chord events only: pins of the chord, pin is the one pressed first
+    uint16_t count;         // Tap events: taps in the sequence, repeat events: repeats since the press
+    int32_t delta;          // Encoder events only: detents turned since the last report, clockwise positive
+} button_event_t;
+
+typedef esp_err_t (*on_button_event_cb_t)(const button_event_t *event);
+
+/**
+ * Receives every event gpio_task produced in one wakeup, oldest first.
+ * The array is only valid for the duration of the call.
+ */
+typedef esp_err_t (*on_button_batch_cb_t)(const button_event_t *events, size_t count);
+
+typedef struct {
+    uint32_t enqueued;      // Events handed to gpio_task
+    uint32_t dropped;       // Events lost because the ring was full
+    uint32_t high_water;    // Highest number of events waiting at once
+} button_queue_stats_t;
+
+/**
+ * Typematic repeat settings of one button.
+ * After delay_ms of holding, BUTTON_REPEAT is reported every interval_ms. Each repeat then
+ * shortens the interval by accel_percent, down to min_interval_ms.
+ */
+typedef struct {
+    uint32_t delay_ms;
+    uint32_t interval_ms;
+    uint32_t min_interval_ms;
+    uint8_t accel_percent;
+} button_repeat_config_t;
+
+/**
+ * Per-pin options for button_init_set, one bit per GPIO.
+ * Buttons are active low with the internal pull-up by default. Active-high buttons get the
+ * internal pull-down instead, and pins with external_pull set get neither (GPIO 34..39 have no
+ * internal pulls). Inside the component an active-high pin reads like an active-low one, so
+ * event levels always read 1 for a released button.
+ */
+typedef struct {
+    uint64_t active_high;
+    uint64_t external_pull;
+} button_pin_options_t;
+
+/**
+ * Sampling debounce settings.
+ * A pin change is reported once the new level has been read on window_us / sample_period_us
+ * consecutive samples (at most 15).
+ */
+typedef struct {
+    uint32_t sample_period_us;
+    uint32_t window_us;
+} button_debounce_config_t;
+
+/**
+ * Key matrix settings.
+ * Rows are driven low one at a time (open drain), columns are read with pull-ups. A change is
+ * reported after debounce_scans consecutive scans agree (1..15). At most
+ * BUTTON_MATRIX_MAX_KEYS keys, numbered row by row.
+ */
+typedef struct {
+    gpio_num_t rows[BUTTON_MATRIX_MAX_LINES];
+    gpio_num_t cols[BUTTON_MATRIX_MAX_LINES];
+    uint8_t row_count;
+    uint8_t col_count;
+    uint32_t scan_period_us;
+    uint8_t debounce_scans;
+} button_matrix_config_t;
+
+/**
+ * Rotary encoder settings.
+ * Quadrature is decoded by the given PCNT unit, or by a table-driven GPIO ISR with
+ * BUTTON_ENCODER_NO_PCNT. Turned detents are summed and reported as one BUTTON_ENCODER event
+ * per report_period_us at most, which should match the BLE connection interval.
+ * Both pins get the internal pull-up. GPIO 34..39 have none, an encoder on them needs external
+ * pull-ups.
+ */
+typedef struct {
+    gpio_num_t pin_a;
+    gpio_num_t pin_b;
+    int pcnt_unit;
+    uint8_t steps_per_detent;
+    uint32_t report_period_us;
+} button_encoder_config_t;
 
 //MARK: Function prototypes
 extern esp_err_t button_component_init(on_button_event_cb_t on_button_event_cb);
 extern esp_err_t button_init(gpio_num_t pin);
 
+/**
+ * Set up all buttons in pins at once: one gpio_config per pull mode, one register snapshot for
+ * the initial levels, and the ISR service installed once. options may be NULL.
+ */
+extern esp_err_t button_init_set(uint64_t pins, const button_pin_options_t *options);
+
+/**
+ * Register a batch callback. It is called in addition to the on_button_event_cb passed to
+ * button_component_init, which may be NULL when only batches are wanted.
+ */
+extern esp_err_t button_set_batch_cb(on_button_batch_cb_t on_button_batch_cb);
+extern esp_err_t button_debounce_enable(const button_debounce_config_t *config);
+
+/**
+ * Scan a key matrix next to the direct GPIO buttons. Its keys go through the same event
+ * pipeline and callbacks. The matrix is only scanned while a key is down, the rest of the
+ * time all rows are driven low and any column interrupt wakes the scanner.
+ */
+extern esp_err_t button_matrix_init(const button_matrix_config_t *config);
+extern esp_err_t button_encoder_init(const button_encoder_config_t *config);
+extern esp_err_t button_set_long_press(uint32_t long_press_ms, uint32_t long_long_press_ms);
+
+/**
+ * Report presses of two or more of the given pins that start within window_ms of each other
+ * as a single BUTTON_CHORD event, and their release as a single BUTTON_CHORD_UP.
+ * A lone press of one of these pins is reported once the window closes or the pin is released.
+ * A zero window disables chord detection.
+ */
+extern esp_err_t button_set_chord(uint64_t pins, uint32_t window_ms);
+
+/**
+ * Recognize tap sequences on the given pins. A tap is a press released before the long press
+ * deadline; taps closer than window_ms to each other form one sequence of up to BUTTON_TAP_MAX
+ * taps, reported as BUTTON_TAP with its count once the window after the last tap expires.
+ * In eager mode the first tap is reported as a single BUTTON_TAP right away, and a
+ * BUTTON_TAP_CORRECTION with the final count follows if more taps came.
+ * A zero window disables tap detection.
+ */
+extern esp_err_t button_set_multi_tap(uint64_t pins, uint32_t window_ms, bool eager);
+
+/**
+ * Enable typematic repeat on a pin, or disable it with a NULL config.
+ */
+extern esp_err_t button_set_repeat(gpio_num_t pin, const button_repeat_config_t *config);
+
+/**
+ * Stop all running repeats, e.g. when the host disconnects. A held button starts repeating
+ * again only after it has been released. Safe to call from any task.
+ */
+extern esp_err_t button_repeat_stop(void);
+
+/**
+ * Pressed buttons, bit N = GPIO N. Safe to call from any task.
+ */
+extern uint64_t button_get_state_mask(void);
+extern esp_err_t button_get_queue_stats(button_queue_stats_t *stats);
+
 #endif //BLACK_BRICKS_ESP_BASE_BUTTON_H
\ No newline at end of file
@@ -3,6 +3,7 @@
 //
 
 //MARK: Import common headers
+#include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
@@ -11,8 +12,11 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h"
 #include "driver/gpio.h"
+#include "driver/pcnt.h"
+#include "soc/gpio_reg.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
 #include "esp_log.h"
 
 //MARK: Import component header
@@ -21,15 +25,175 @@
 //MARK: Private macros and constants
 #define TAG "BUTTON"
 
-#define BUTTON_PIN_BIT(x) (1ULL<<x)
 #define ESP_INTR_FLAG_DEFAULT 0
+#define BUTTON_RING_MASK (BUTTON_RING_LENGTH - 1)
+
+_Static_assert((BUTTON_RING_LENGTH & BUTTON_RING_MASK) == 0, "BUTTON_RING_LENGTH must be a power of two");
+
+// Bit planes of the vertical debounce counters, limits the window to 2^N - 1 samples
+#define BUTTON_DEBOUNCE_COUNTER_BITS 4
+#define BUTTON_DEBOUNCE_MAX_SAMPLES ((1 << BUTTON_DEBOUNCE_COUNTER_BITS) - 1)
+
+// gpio_task notification bits
+#define BUTTON_NOTIFY_EVENT (1 << 0)       // Events waiting in one of the rings
+#define BUTTON_NOTIFY_EDGE (1 << 1)        // Edge on a pin owned by the debouncer
+#define BUTTON_NOTIFY_DEADLINE (1 << 2)    // Deadline timer expired
+#define BUTTON_NOTIFY_REPEAT_STOP (1 << 3) // button_repeat_stop() was called
+#define BUTTON_NOTIFY_MATRIX (1 << 4)      // Column edge on an idle matrix
+#define BUTTON_NOTIFY_ENCODER (1 << 5)     // Encoder moved while idle
+#define BUTTON_NOTIFY_ALL (BUTTON_NOTIFY_EVENT | BUTTON_NOTIFY_EDGE | BUTTON_NOTIFY_DEADLINE)
+
+// Time for a column to follow its row after the row is driven
+#define BUTTON_MATRIX_SETTLE_US 5
+
+// Report periods without movement before the encoder poller stops
+#define BUTTON_ENCODER_IDLE_POLLS 8
+// PCNT glitch filter, in APB clock cycles
+#define BUTTON_ENCODER_PCNT_FILTER 1000
+// The PCNT counter is re-centred once it drifts this far from zero
+#define BUTTON_ENCODER_PCNT_RECENTER 16384
+
+#define BUTTON_DEADLINE_IDLE INT64_MAX
 
 //MARK: Private types
+/**
+ * Single-producer single-consumer event ring.
+ * head is only written by the producer and tail only by the consumer, so no locking is needed
+ * between the ISR and gpio_task; the counters are also producer-owned.
+ */
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile bool overflow;
+    uint32_t enqueued;
+    uint32_t dropped;
+    uint32_t high_water;
+    button_event_t events[BUTTON_RING_LENGTH];
+} ring_t;
+
+/**
+ * Vertical counter.
+ * counter[i] holds bit i of a per-pin counter for all 64 pins at once, so one update costs the
+ * same handful of bitwise operations whatever the number of buttons.
+ */
+typedef struct {
+    uint64_t state;
+    uint64_t counter[BUTTON_DEBOUNCE_COUNTER_BITS];
+} vcounter_t;
+
+typedef struct {
+    bool enabled;
+    volatile bool running;
+    esp_timer_handle_t timer;
+    uint32_t period_us;
+    uint8_t samples;
+    uint8_t quiet;
+    vcounter_t filter;      // Debounced levels of the GPIO buttons
+} debounce_t;
+
 typedef struct {
-    xQueueHandle queue;
+    bool enabled;
+    volatile bool running;
+    esp_timer_handle_t timer;
+    button_matrix_config_t config;
+    uint8_t quiet;
+    bool ghosting;
+    uint64_t sample;        // Last scan without ghosting, bit N = key N
+    vcounter_t filter;      // Debounced keys, set while pressed
+} matrix_t;
+
+typedef struct {
+    bool enabled;
+    volatile bool running;
+    esp_timer_handle_t timer;
+    button_encoder_config_t config;
+    portMUX_TYPE lock;
+    volatile int32_t steps;     // ISR decoder: steps since the last poll
+    uint8_t state;              // ISR decoder: last A/B levels
+    int16_t count;              // PCNT decoder: counter value at the last poll
+    int32_t residual;           // Steps not yet making up a whole detent
+    uint8_t idle;
+} encoder_t;
+
+typedef enum {
+    DEADLINE_LONG_PRESS = 0,
+    DEADLINE_CHORD,
+    DEADLINE_TAP,
+    DEADLINE_REPEAT,
+    DEADLINE_MAX,
+} deadline_kind_t;
+
+/**
+ * Deadlines of all pins, served by a single one-shot esp_timer.
+ * Arming is O(1): the slot is written and the timer is only reprogrammed when the new
+ * deadline is the earliest one. Disarming just clears the pin bit, a stale expiry is harmless.
+ */
+typedef struct {
+    esp_timer_handle_t timer;
+    int64_t next;
+    uint64_t armed[DEADLINE_MAX];
+    int64_t at[DEADLINE_MAX][BUTTON_KEY_MAX];
+} deadlines_t;
+
+typedef struct {
+    int64_t long_press_us;
+    int64_t long_long_press_us;
+    uint64_t long_pressed;
+    int64_t pressed_at[BUTTON_KEY_MAX];
+} long_press_t;
+
+typedef struct {
+    uint64_t pins;
+    int64_t window_us;
+    uint64_t pending;       // Chord pins pressed since the window opened
+    uint64_t held;          // Pins of the last reported chord that are still down
+    uint64_t active;        // Pins of the last reported chord
+    button_event_t first;   // Press that opened the window
+} chord_t;
+
+typedef struct {
+    uint8_t count;
+    int64_t last_up;
+} tap_state_t;
+
+typedef struct {
+    uint64_t pins;
+    int64_t window_us;
+    bool eager;
+    tap_state_t state[BUTTON_KEY_MAX];
+} multi_tap_t;
+
+typedef struct {
+    uint64_t pins;
+    uint64_t stopped;       // Held pins whose repeat was stopped, re-enabled on release
+    button_repeat_config_t config[BUTTON_KEY_MAX];
+    int64_t interval_us[BUTTON_KEY_MAX];
+    uint16_t count[BUTTON_KEY_MAX];
+} repeat_t;
+
+typedef struct {
+    ring_t isr_ring;        // Produced by gpio_isr_handler
+    ring_t timer_ring;      // Produced by the esp_timer task (debounce and matrix scans)
     xTaskHandle task;
     on_button_event_cb_t on_button_event_cb;
-    int levels[GPIO_NUM_MAX];
+    on_button_batch_cb_t on_button_batch_cb;
+    size_t batch_count;
+    button_event_t batch[BUTTON_BATCH_LENGTH];
+    uint64_t pins;          // Direct GPIO buttons
+    uint64_t inverted;      // Active-high buttons, flipped on read so that 1 always means released
+    bool isr_service;
+    uint64_t levels;
+    uint64_t isr_levels;    // Last level reported by gpio_isr_handler per pin, owned by the ISR
+    uint64_t pressed;
+    portMUX_TYPE pressed_lock;
+    debounce_t debounce;
+    matrix_t matrix;
+    encoder_t encoder;
+    deadlines_t deadlines;
+    long_press_t long_press;
+    chord_t chord;
+    multi_tap_t multi_tap;
+    repeat_t repeat;
 } component_t;
 
 //MARK: Declaration of the private opaque structs
@@ -37,78 +201,1234 @@ typedef struct {
 //MARK: Public global variables
 
 //MARK: Private global variables
-static component_t component = {
-        .queue = NULL,
+static DRAM_ATTR component_t component = {
+        .task = NULL,
+        .pressed_lock = portMUX_INITIALIZER_UNLOCKED,
+        .encoder = {
+                .lock = portMUX_INITIALIZER_UNLOCKED,
+        },
+        .deadlines = {
+                .next = BUTTON_DEADLINE_IDLE,
+        },
+        .long_press = {
+                .long_press_us = BUTTON_LONG_PRESS_DEFAULT_MS * 1000LL,
+                .long_long_press_us = BUTTON_LONG_LONG_PRESS_DEFAULT_MS * 1000LL,
+        },
+        .chord = {
+                .window_us = BUTTON_CHORD_WINDOW_DEFAULT_MS * 1000LL,
+        },
+        .multi_tap = {
+                .window_us = BUTTON_TAP_WINDOW_DEFAULT_MS * 1000LL,
+        },
 };
 
 //MARK: Private functions
+/**
+ * Read the input levels of all GPIOs.
+ * GPIO 0..31 live in GPIO_IN_REG and GPIO 32..39 in GPIO_IN1_REG, so the snapshot is two
+ * back-to-back register reads with no driver calls in between. Active-high buttons are inverted.
+ */
+static inline uint64_t IRAM_ATTR button_read_levels(void) {
+    uint32_t low = REG_READ(GPIO_IN_REG);
+    uint32_t high = REG_READ(GPIO_IN1_REG) & GPIO_IN1_DATA;
+    return (((uint64_t) high << 32) | low) ^ component.inverted;
+}
+
+/**
+ * The GPIO driver logs an error on every repeated install, so install once for all sources.
+ */
+static void button_install_isr_service(void) {
+    if (!component.isr_service) {
+        gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
+        component.isr_service = true;
+    }
+}
+
+static bool IRAM_ATTR button_ring_push(ring_t *ring, const button_event_t *event) {
+    uint32_t head = ring->head;
+    uint32_t used = head - ring->tail;
+
+    if (used >= BUTTON_RING_LENGTH) {
+        ring->dropped++;
+        ring->overflow = true;
+        return false;
+    }
+
+    ring->events[head & BUTTON_RING_MASK] = *event;
+    // Publish the slot before the new head becomes visible to the consumer
+    __sync_synchronize();
+    ring->head = head + 1;
+
+    ring->enqueued++;
+    if (used + 1 > ring->high_water) {
+        ring->high_water = used + 1;
+    }
+    return true;
+}
+
+static bool button_ring_pop(ring_t *ring, button_event_t *event) {
+    uint32_t tail = ring->tail;
+
+    if (tail == ring->head) {
+        return false;
+    }
+
+    __sync_synchronize();
+    *event = ring->events[tail & BUTTON_RING_MASK];
+    // Finish reading the slot before handing it back to the producer
+    __sync_synchronize();
+    ring->tail = tail + 1;
+    return true;
+}
+
+static void button_notify(uint32_t bits) {
+    if (component.task != NULL) {
+        xTaskNotify(component.task, bits, eSetBits);
+    }
+}
+
+/**
+ * Arm the level interrupt for the next change of a pin, level being its current
+ * (polarity-corrected) level.
+ */
+static void IRAM_ATTR button_arm(gpio_num_t pin, bool level) {
+    if (component.inverted & BUTTON_PIN_BIT(pin)) {
+        level = !level;
+    }
+    if (level) {
+        gpio_set_intr_type(pin, GPIO_INTR_LOW_LEVEL);
+        gpio_wakeup_enable(pin, GPIO_INTR_LOW_LEVEL);
+    } else {
+        gpio_set_intr_type(pin, GPIO_INTR_HIGH_LEVEL);
+        gpio_wakeup_enable(pin, GPIO_INTR_HIGH_LEVEL);
+    }
+}
+
 static void IRAM_ATTR gpio_isr_handler(void *arg) {
-    uint32_t gpio_num = (uint32_t) arg;
+    uint32_t gpio_num = (uint32_t) (uintptr_t) arg;
+    BaseType_t task_woken = pdFALSE;
+    uint32_t bits = BUTTON_NOTIFY_EDGE;
 
-    gpio_set_intr_type(gpio_num, GPIO_INTR_DISABLE);
-    gpio_wakeup_disable(gpio_num);
+    button_event_t event = {
+            .pin = (gpio_num_t) gpio_num,
+            .timestamp = esp_timer_get_time(),
+            .levels = button_read_levels(),
+    };
 
-    xQueueSendFromISR(component.queue, &gpio_num, NULL);
+    if (component.debounce.enabled) {
+        // The sampling timer follows the pin from here until it is quiet again
+        gpio_set_intr_type(gpio_num, GPIO_INTR_DISABLE);
+        gpio_wakeup_disable(gpio_num);
+    } else {
+        // Re-armed right here for the opposite level, so every change of a burst reaches the
+        // ring and only a full ring loses one
+        uint64_t bit = BUTTON_PIN_BIT(gpio_num);
+        bool released = event.levels & bit;
+        button_arm((gpio_num_t) gpio_num, released);
+        if (released == ((component.isr_levels & bit) != 0)) {
+            // Changed and back again before the handler ran, nothing to report
+            return;
+        }
+        component.isr_levels ^= bit;
+        event.type = released ? BUTTON_UP : BUTTON_DOWN;
+        button_ring_push(&component.isr_ring, &event);
+        bits = BUTTON_NOTIFY_EVENT;
+    }
+
+    if (component.task != NULL) {
+        xTaskNotifyFromISR(component.task, bits, eSetBits, &task_woken);
+        if (task_woken == pdTRUE) {
+            portYIELD_FROM_ISR();
+        }
+    }
 }
 
-static void gpio_task(void *arg) {
-    uint32_t io_num;
-    bool inf_loop = true;
-    while (inf_loop) {
-        if (xQueueReceive(component.queue, &io_num, portMAX_DELAY)) {
-            int new_level = gpio_get_level(io_num);
-            component.levels[io_num] = new_level;
+/**
+ * Feed one sample to a vertical counter. Every bit that differs from the filtered state counts
+ * up, every other bit is reset. Bits whose counter reaches samples flip their state and are
+ * returned.
+ */
+static uint64_t button_vcounter_update(vcounter_t *vcounter, uint64_t sample, uint8_t samples) {
+    uint64_t delta = sample ^ vcounter->state;
+    uint64_t carry = delta;
+    uint64_t reached = delta;
 
-            button_event_type_t event = new_level ? BUTTON_UP : BUTTON_DOWN;
+    for (int i = 0; i < BUTTON_DEBOUNCE_COUNTER_BITS; i++) {
+        uint64_t bit = vcounter->counter[i] & delta;
+        vcounter->counter[i] = bit ^ carry;
+        carry &= bit;
+        reached &= (samples & (1 << i)) ? vcounter->counter[i] : ~vcounter->counter[i];
+    }
 
-            if (event == BUTTON_UP) {
-                ESP_LOGI(TAG, "%d UP", io_num);
-                gpio_set_intr_type(io_num, GPIO_INTR_LOW_LEVEL);
-                gpio_wakeup_enable(io_num, GPIO_INTR_LOW_LEVEL);
-            } else {
-                ESP_LOGI(TAG, "%d DOWN", io_num);
-                gpio_set_intr_type(io_num, GPIO_INTR_HIGH_LEVEL);
-                gpio_wakeup_enable(io_num, GPIO_INTR_HIGH_LEVEL);
+    if (reached) {
+        for (int i = 0; i < BUTTON_DEBOUNCE_COUNTER_BITS; i++) {
+            vcounter->counter[i] &= ~reached;
+        }
+        vcounter->state ^= reached;
+    }
+    return reached;
+}
+
+/**
+ * Sampling timer callback, runs in the esp_timer task.
+ * A pin whose level has been stable for the whole window flips its debounced state and is
+ * reported. Once no pin has been in transition for a full window the timer stops and the level
+ * interrupts are re-armed, so an idle keyboard costs no more than in interrupt mode.
+ */
+static void button_debounce_tick(void *arg) {
+    debounce_t *debounce = &component.debounce;
+    int64_t now = esp_timer_get_time();
+    uint64_t levels = button_read_levels();
+    uint64_t sample = levels & component.pins;
+    uint64_t reached = button_vcounter_update(&debounce->filter, sample, debounce->samples);
+
+    if (reached) {
+        button_event_t event = {
+                .timestamp = now - (int64_t) (debounce->samples - 1) * debounce->period_us,
+                .levels = levels,
+        };
+        while (reached) {
+            int pin = __builtin_ctzll(reached);
+            reached &= reached - 1;
+            event.pin = (gpio_num_t) pin;
+            event.type = (debounce->filter.state & BUTTON_PIN_BIT(pin)) ? BUTTON_UP : BUTTON_DOWN;
+            button_ring_push(&component.timer_ring, &event);
+        }
+        button_notify(BUTTON_NOTIFY_EVENT);
+        debounce->quiet = 0;
+    } else if (sample != debounce->filter.state) {
+        debounce->quiet = 0;
+    } else if (++debounce->quiet >= debounce->samples) {
+        // Stop the timer, then clear running, then re-arm: an edge caught by the ISR from here on
+        // finds both the flag and the timer stopped and starts it again
+        esp_timer_stop(debounce->timer);
+        debounce->running = false;
+        uint64_t pins = component.pins;
+        while (pins) {
+            int pin = __builtin_ctzll(pins);
+            pins &= pins - 1;
+            button_arm((gpio_num_t) pin, debounce->filter.state & BUTTON_PIN_BIT(pin));
+        }
+    }
+}
+
+static void button_debounce_start(void) {
+    debounce_t *debounce = &component.debounce;
+    if (!debounce->enabled || debounce->running) {
+        return;
+    }
+    debounce->quiet = 0;
+    debounce->running = true;
+    esp_err_t err = esp_timer_start_periodic(debounce->timer, debounce->period_us);
+    if (err != ESP_OK) {
+        // Left set, no later edge would ever start the timer again
+        debounce->running = false;
+        ESP_LOGE(TAG, "Cannot start debounce timer: %s", esp_err_to_name(err));
+    }
+}
+
+static void IRAM_ATTR button_matrix_isr_handler(void *arg) {
+    BaseType_t task_woken = pdFALSE;
+    const button_matrix_config_t *config = &component.matrix.config;
+
+    for (int i = 0; i < config->col_count; i++) {
+        gpio_set_intr_type(config->cols[i], GPIO_INTR_DISABLE);
+        gpio_wakeup_disable(config->cols[i]);
+    }
+
+    if (component.task != NULL) {
+        xTaskNotifyFromISR(component.task, BUTTON_NOTIFY_MATRIX, eSetBits, &task_woken);
+        if (task_woken == pdTRUE) {
+            portYIELD_FROM_ISR();
+        }
+    }
+}
+
+/**
+ * Idle the matrix: all rows driven low so that pressing any key pulls its column low and
+ * wakes the scanner through the column interrupt.
+ */
+static void button_matrix_idle(void) {
+    const button_matrix_config_t *config = &component.matrix.config;
+
+    for (int i = 0; i < config->row_count; i++) {
+        gpio_set_level(config->rows[i], 0);
+    }
+    for (int i = 0; i < config->col_count; i++) {
+        gpio_set_intr_type(config->cols[i], GPIO_INTR_LOW_LEVEL);
+        gpio_wakeup_enable(config->cols[i], GPIO_INTR_LOW_LEVEL);
+    }
+}
+
+/**
+ * Scan all rows into a key bitmap. Returns false if the scan is ambiguous: when two rows share
+ * two pressed columns, the fourth corner of the rectangle reads as pressed whether it is or not.
+ */
+static bool button_matrix_scan(uint64_t *keys, uint64_t *levels) {
+    const button_matrix_config_t *config = &component.matrix.config;
+    uint8_t row_bits[BUTTON_MATRIX_MAX_LINES];
+
+    *keys = 0;
+    for (int row = 0; row < config->row_count; row++) {
+        gpio_set_level(config->rows[row], 0);
+        esp_rom_delay_us(BUTTON_MATRIX_SETTLE_US);
+        *levels = button_read_levels();
+        gpio_set_level(config->rows[row], 1);
+
+        row_bits[row] = 0;
+        for (int col = 0; col < config->col_count; col++) {
+            if (!(*levels & BUTTON_PIN_BIT(config->cols[col]))) {
+                row_bits[row] |= 1 << col;
+            }
+        }
+        *keys |= (uint64_t) row_bits[row] << (row * config->col_count);
+    }
+
+    for (int row = 0; row < config->row_count; row++) {
+        for (int other = row + 1; other < config->row_count; other++) {
+            uint8_t common = row_bits[row] & row_bits[other];
+            if (common & (common - 1)) {
+                return false;
             }
+        }
+    }
+    return true;
+}
+
+/**
+ * Matrix scan timer callback, runs in the esp_timer task like the debouncer, which keeps the
+ * timer ring single-producer. A ghosted scan is ignored and the previous clean one is used.
+ */
+static void button_matrix_tick(void *arg) {
+    matrix_t *matrix = &component.matrix;
+    int64_t now = esp_timer_get_time();
+    uint64_t keys;
+    uint64_t levels;
+
+    bool clean = button_matrix_scan(&keys, &levels);
+    if (clean) {
+        matrix->sample = keys;
+    } else if (!matrix->ghosting) {
+        ESP_LOGW(TAG, "Matrix ghosting, holding keys %" PRIx64, matrix->sample);
+    }
+    matrix->ghosting = !clean;
+
+    uint8_t samples = matrix->config.debounce_scans;
+    uint64_t reached = button_vcounter_update(&matrix->filter, matrix->sample, samples);
+    if (reached) {
+        button_event_t event = {
+                .timestamp = now - (int64_t) (samples - 1) * matrix->config.scan_period_us,
+                .levels = levels,
+        };
+        while (reached) {
+            int key = __builtin_ctzll(reached);
+            reached &= reached - 1;
+            event.pin = (gpio_num_t) (BUTTON_MATRIX_KEY_BASE + key);
+            event.type = (matrix->filter.state & BUTTON_PIN_BIT(key)) ? BUTTON_DOWN : BUTTON_UP;
+            button_ring_push(&component.timer_ring, &event);
+        }
+        button_notify(BUTTON_NOTIFY_EVENT);
+        matrix->quiet = 0;
+    } else if (matrix->filter.state != 0 || matrix->sample != 0) {
+        matrix->quiet = 0;
+    } else if (++matrix->quiet >= samples) {
+        // Same ordering as the debouncer: stop the timer, clear running, then let the columns wake us
+        esp_timer_stop(matrix->timer);
+        matrix->running = false;
+        button_matrix_idle();
+    }
+}
+
+static void button_matrix_start(void) {
+    matrix_t *matrix = &component.matrix;
+    if (!matrix->enabled || matrix->running) {
+        return;
+    }
+    for (int i = 0; i < matrix->config.row_count; i++) {
+        gpio_set_level(matrix->config.rows[i], 1);
+    }
+    matrix->quiet = 0;
+    matrix->running = true;
+    esp_err_t err = esp_timer_start_periodic(matrix->timer, matrix->config.scan_period_us);
+    if (err != ESP_OK) {
+        matrix->running = false;
+        ESP_LOGE(TAG, "Cannot start matrix scan: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * Quadrature decoding table, indexed by the previous and current A/B levels. Invalid
+ * transitions (both lines changed) count as no movement.
+ */
+static const DRAM_ATTR int8_t encoder_table[16] = {
+        0, -1, 1, 0,
+        1, 0, 0, -1,
+        -1, 0, 0, 1,
+        0, 1, -1, 0,
+};
+
+static void IRAM_ATTR button_encoder_isr_handler(void *arg) {
+    encoder_t *encoder = &component.encoder;
+    BaseType_t task_woken = pdFALSE;
+    uint64_t levels = button_read_levels();
+
+    if (encoder->config.pcnt_unit != BUTTON_ENCODER_NO_PCNT) {
+        // PCNT does the counting, this edge only wakes the poller
+        gpio_set_intr_type(encoder->config.pin_a, GPIO_INTR_DISABLE);
+    } else {
+        uint8_t state = ((levels & BUTTON_PIN_BIT(encoder->config.pin_a)) ? 2 : 0) |
+                        ((levels & BUTTON_PIN_BIT(encoder->config.pin_b)) ? 1 : 0);
+        portENTER_CRITICAL_ISR(&encoder->lock);
+        encoder->steps += encoder_table[(encoder->state << 2) | state];
+        portEXIT_CRITICAL_ISR(&encoder->lock);
+        encoder->state = state;
+        if (encoder->running) {
+            return;
+        }
+    }
+
+    if (component.task != NULL) {
+        xTaskNotifyFromISR(component.task, BUTTON_NOTIFY_ENCODER, eSetBits, &task_woken);
+        if (task_woken == pdTRUE) {
+            portYIELD_FROM_ISR();
+        }
+    }
+}
+
+static int32_t button_encoder_take_steps(void) {
+    encoder_t *encoder = &component.encoder;
+    int32_t steps;
+
+    if (encoder->config.pcnt_unit != BUTTON_ENCODER_NO_PCNT) {
+        int16_t count = 0;
+        pcnt_get_counter_value(encoder->config.pcnt_unit, &count);
+        steps = count - encoder->count;
+        encoder->count = count;
+        if (count > BUTTON_ENCODER_PCNT_RECENTER || count < -BUTTON_ENCODER_PCNT_RECENTER) {
+            pcnt_counter_clear(encoder->config.pcnt_unit);
+            encoder->count = 0;
+        }
+    } else {
+        portENTER_CRITICAL(&encoder->lock);
+        steps = encoder->steps;
+        encoder->steps = 0;
+        portEXIT_CRITICAL(&encoder->lock);
+    }
+    return steps;
+}
+
+/**
+ * Encoder poll timer callback, runs in the esp_timer task.
+ * Whatever was turned during the last period becomes a single event, so a fast spin costs
+ * one report per period instead of one per detent.
+ */
+static void button_encoder_tick(void *arg) {
+    encoder_t *encoder = &component.encoder;
+    int32_t steps = button_encoder_take_steps();
+
+    if (steps != 0) {
+        encoder->idle = 0;
+        encoder->residual += steps;
+        int32_t detents = encoder->residual / encoder->config.steps_per_detent;
+        if (detents != 0) {
+            button_event_t event = {
+                    .pin = encoder->config.pin_a,
+                    .type = BUTTON_ENCODER,
+                    .timestamp = esp_timer_get_time(),
+                    .levels = button_read_levels(),
+                    .delta = detents,
+            };
+            // Detents of a dropped event stay in residual and go out with the next one
+            if (button_ring_push(&component.timer_ring, &event)) {
+                encoder->residual -= detents * encoder->config.steps_per_detent;
+            }
+            button_notify(BUTTON_NOTIFY_EVENT);
+        }
+    } else if (++encoder->idle >= BUTTON_ENCODER_IDLE_POLLS) {
+        // Same ordering as the debouncer: stop the timer, clear running, then re-arm
+        esp_timer_stop(encoder->timer);
+        encoder->running = false;
+        if (encoder->config.pcnt_unit != BUTTON_ENCODER_NO_PCNT) {
+            gpio_set_intr_type(encoder->config.pin_a, GPIO_INTR_ANYEDGE);
+        }
+        // Catch movement that slipped in between the last poll and going idle
+        if (button_encoder_take_steps() != 0) {
+            button_notify(BUTTON_NOTIFY_ENCODER);
+        }
+    }
+}
+
+static void button_encoder_start(void) {
+    encoder_t *encoder = &component.encoder;
+    if (!encoder->enabled || encoder->running) {
+        return;
+    }
+    encoder->idle = 0;
+    encoder->running = true;
+    esp_err_t err = esp_timer_start_periodic(encoder->timer, encoder->config.report_period_us);
+    if (err != ESP_OK) {
+        encoder->running = false;
+        ESP_LOGE(TAG, "Cannot start encoder timer: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * Deadline timer callback, runs in the esp_timer task.
+ * Expired deadlines are handled by gpio_task so that all button state has a single owner.
+ */
+static void button_deadline_expired(void *arg) {
+    button_notify(BUTTON_NOTIFY_DEADLINE);
+}
+
+static void button_deadline_schedule(int64_t at) {
+    deadlines_t *deadlines = &component.deadlines;
+    if (at >= deadlines->next) {
+        return;
+    }
+    deadlines->next = at;
+    int64_t timeout = at - esp_timer_get_time();
+    esp_timer_stop(deadlines->timer);
+    esp_timer_start_once(deadlines->timer, timeout > 0 ? timeout : 0);
+}
+
+static void button_deadline_arm(deadline_kind_t kind, gpio_num_t pin, int64_t at) {
+    component.deadlines.at[kind][pin] = at;
+    component.deadlines.armed[kind] |= BUTTON_PIN_BIT(pin);
+    button_deadline_schedule(at);
+}
+
+static void button_deadline_disarm(deadline_kind_t kind, gpio_num_t pin) {
+    component.deadlines.armed[kind] &= ~BUTTON_PIN_BIT(pin);
+}
+
+static void button_batch_flush(void) {
+    if (component.batch_count == 0) {
+        return;
+    }
+    if (component.on_button_batch_cb != NULL) {
+        component.on_button_batch_cb(component.batch, component.batch_count);
+    }
+    component.batch_count = 0;
+}
+
+static void button_dispatch(const button_event_t *event) {
+    static const char *names[] = {"DOWN", "UP", "LONG_PRESS", "LONG_LONG_PRESS", "CHORD", "CHORD_UP", "TAP",
+                                  "TAP_CORRECTION", "REPEAT", "ENCODER"};
+    ESP_LOGI(TAG, "%d %s, latency %" PRId64 " us", event->pin, names[event->type],
+             esp_timer_get_time() - event->timestamp);
+
+    if (component.on_button_event_cb != NULL) {
+        component.on_button_event_cb(event);
+    }
+
+    if (component.on_button_batch_cb != NULL) {
+        if (component.batch_count == BUTTON_BATCH_LENGTH) {
+            button_batch_flush();
+        }
+        component.batch[component.batch_count++] = *event;
+    }
+}
+
+/**
+ * End the tap sequence of a pin. In eager mode a single tap has already been reported.
+ */
+static void button_tap_finish(gpio_num_t pin) {
+    multi_tap_t *multi_tap = &component.multi_tap;
+    tap_state_t *state = &multi_tap->state[pin];
+
+    button_deadline_disarm(DEADLINE_TAP, pin);
+    if (state->count > 0 && !(multi_tap->eager && state->count == 1)) {
+        button_event_t event = {
+                .pin = pin,
+                .type = multi_tap->eager ? BUTTON_TAP_CORRECTION : BUTTON_TAP,
+                .timestamp = state->last_up,
+                .levels = component.levels,
+                .count = state->count,
+        };
+        button_dispatch(&event);
+    }
+    state->count = 0;
+}
+
+static void button_tap_update(const button_event_t *event, bool long_pressed) {
+    multi_tap_t *multi_tap = &component.multi_tap;
+    tap_state_t *state = &multi_tap->state[event->pin];
+
+    if (multi_tap->window_us == 0 || !(multi_tap->pins & BUTTON_PIN_BIT(event->pin))) {
+        return;
+    }
+
+    if (event->type == BUTTON_DOWN) {
+        // Wait for the release, the press may still turn into a long press
+        button_deadline_disarm(DEADLINE_TAP, event->pin);
+        return;
+    }
+
+    if (long_pressed) {
+        return;
+    }
+
+    state->count++;
+    state->last_up = event->timestamp;
+    if (multi_tap->eager && state->count == 1) {
+        button_event_t tap = *event;
+        tap.type = BUTTON_TAP;
+        tap.count = 1;
+        button_dispatch(&tap);
+    }
+
+    if (state->count >= BUTTON_TAP_MAX) {
+        button_tap_finish(event->pin);
+    } else {
+        button_deadline_arm(DEADLINE_TAP, event->pin, event->timestamp + multi_tap->window_us);
+    }
+}
+
+/**
+ * Report a repeat and schedule the next one. The schedule follows the deadlines rather than
+ * the time this runs, unless it has fallen more than an interval behind.
+ */
+static void button_repeat_expired(gpio_num_t pin, int64_t at) {
+    repeat_t *repeat = &component.repeat;
+    const button_repeat_config_t *config = &repeat->config[pin];
+
+    if (!(repeat->pins & BUTTON_PIN_BIT(pin))) {
+        return;
+    }
+    if (repeat->count[pin] < UINT16_MAX) {
+        repeat->count[pin]++;
+    }
+    button_event_t event = {
+            .pin = pin,
+            .type = BUTTON_REPEAT,
+            .timestamp = at,
+            .levels = component.levels,
+            .count = repeat->count[pin],
+    };
 
-            if (component.on_button_event_cb != NULL) {
-                component.on_button_event_cb(io_num, event);
+    int64_t interval = repeat->interval_us[pin];
+    int64_t min_interval = config->min_interval_ms * 1000LL;
+    int64_t next = interval - interval * config->accel_percent / 100;
+    repeat->interval_us[pin] = next > min_interval ? next : min_interval;
+
+    int64_t now = esp_timer_get_time();
+    button_deadline_arm(DEADLINE_REPEAT, pin, (at + interval > now) ? at + interval : now + interval);
+
+    button_dispatch(&event);
+}
+
+static void button_repeat_update(const button_event_t *event) {
+    repeat_t *repeat = &component.repeat;
+    uint64_t bit = BUTTON_PIN_BIT(event->pin);
+
+    if (event->type == BUTTON_UP) {
+        button_deadline_disarm(DEADLINE_REPEAT, event->pin);
+        repeat->stopped &= ~bit;
+        return;
+    }
+
+    if ((repeat->pins & bit) && !(repeat->stopped & bit)) {
+        const button_repeat_config_t *config = &repeat->config[event->pin];
+        repeat->count[event->pin] = 0;
+        repeat->interval_us[event->pin] = config->interval_ms * 1000LL;
+        button_deadline_arm(DEADLINE_REPEAT, event->pin, event->timestamp + config->delay_ms * 1000LL);
+    }
+}
+
+static void button_repeat_stop_all(void) {
+    repeat_t *repeat = &component.repeat;
+    repeat->stopped |= component.deadlines.armed[DEADLINE_REPEAT];
+    component.deadlines.armed[DEADLINE_REPEAT] = 0;
+}
+
+static void button_long_press_expired(gpio_num_t pin, int64_t at) {
+    long_press_t *long_press = &component.long_press;
+    button_event_t event = {
+            .pin = pin,
+            .timestamp = at,
+            .levels = component.levels,
+    };
+
+    if (long_press->long_pressed & BUTTON_PIN_BIT(pin)) {
+        event.type = BUTTON_LONG_LONG_PRESS;
+    } else {
+        event.type = BUTTON_LONG_PRESS;
+        long_press->long_pressed |= BUTTON_PIN_BIT(pin);
+        button_tap_finish(pin);
+        int64_t long_long_at = long_press->pressed_at[pin] + long_press->long_long_press_us;
+        if (long_press->long_long_press_us > long_press->long_press_us) {
+            button_deadline_arm(DEADLINE_LONG_PRESS, pin, long_long_at);
+        }
+    }
+
+    button_dispatch(&event);
+}
+
+static void button_long_press_update(const button_event_t *event) {
+    long_press_t *long_press = &component.long_press;
+
+    if (event->type == BUTTON_DOWN) {
+        long_press->pressed_at[event->pin] = event->timestamp;
+        if (long_press->long_press_us > 0) {
+            button_deadline_arm(DEADLINE_LONG_PRESS, event->pin, event->timestamp + long_press->long_press_us);
+        }
+    } else {
+        button_deadline_disarm(DEADLINE_LONG_PRESS, event->pin);
+        long_press->long_pressed &= ~BUTTON_PIN_BIT(event->pin);
+    }
+}
+
+static void button_process(const button_event_t *event) {
+    bool long_pressed = component.long_press.long_pressed & BUTTON_PIN_BIT(event->pin);
+    button_long_press_update(event);
+    button_repeat_update(event);
+    button_dispatch(event);
+    button_tap_update(event, long_pressed);
+}
+
+static void button_pressed_update(const button_event_t *event) {
+    portENTER_CRITICAL(&component.pressed_lock);
+    if (event->type == BUTTON_DOWN) {
+        component.pressed |= BUTTON_PIN_BIT(event->pin);
+    } else {
+        component.pressed &= ~BUTTON_PIN_BIT(event->pin);
+    }
+    portEXIT_CRITICAL(&component.pressed_lock);
+}
+
+/**
+ * Close the chord window: two or more pending pins make a chord, a single one is passed on
+ * as the plain press that opened the window.
+ */
+static void button_chord_close(void) {
+    chord_t *chord = &component.chord;
+
+    button_deadline_disarm(DEADLINE_CHORD, chord->first.pin);
+    if (chord->pending & (chord->pending - 1)) {
+        button_event_t event = chord->first;
+        event.type = BUTTON_CHORD;
+        event.pins = chord->pending;
+        chord->active = chord->pending;
+        chord->held = chord->pending;
+        button_dispatch(&event);
+    } else {
+        button_process(&chord->first);
+    }
+    chord->pending = 0;
+}
+
+static void button_chord_update(const button_event_t *event) {
+    chord_t *chord = &component.chord;
+    uint64_t bit = BUTTON_PIN_BIT(event->pin);
+
+    if (chord->window_us == 0 || !(chord->pins & bit)) {
+        button_process(event);
+        return;
+    }
+
+    if (event->type == BUTTON_DOWN) {
+        if (chord->pending == 0) {
+            chord->first = *event;
+            button_deadline_arm(DEADLINE_CHORD, event->pin, event->timestamp + chord->window_us);
+        }
+        chord->pending |= bit;
+        return;
+    }
+
+    if (chord->pending & bit) {
+        button_chord_close();
+    }
+
+    if (chord->held & bit) {
+        chord->held &= ~bit;
+        if (chord->held == 0) {
+            button_event_t chord_up = *event;
+            chord_up.type = BUTTON_CHORD_UP;
+            chord_up.pins = chord->active;
+            button_dispatch(&chord_up);
+        }
+        return;
+    }
+
+    button_process(event);
+}
+
+static void button_deadline_run(deadline_kind_t kind, gpio_num_t pin, int64_t at) {
+    switch (kind) {
+        case DEADLINE_LONG_PRESS:
+            button_long_press_expired(pin, at);
+            break;
+        case DEADLINE_CHORD:
+            button_chord_close();
+            break;
+        case DEADLINE_TAP:
+            button_tap_finish(pin);
+            break;
+        case DEADLINE_REPEAT:
+            button_repeat_expired(pin, at);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Serve every expired deadline and reprogram the timer for the earliest remaining one.
+ * Cost is proportional to the number of armed pins, not to the number of registered ones.
+ */
+static void button_deadlines_process(void) {
+    deadlines_t *deadlines = &component.deadlines;
+    int64_t now = esp_timer_get_time();
+
+    deadlines->next = BUTTON_DEADLINE_IDLE;
+    esp_timer_stop(deadlines->timer);
+
+    for (int kind = 0; kind < DEADLINE_MAX; kind++) {
+        uint64_t armed = deadlines->armed[kind];
+        while (armed) {
+            int pin = __builtin_ctzll(armed);
+            armed &= armed - 1;
+            int64_t at = deadlines->at[kind][pin];
+            if (at <= now) {
+                deadlines->armed[kind] &= ~BUTTON_PIN_BIT(pin);
+                button_deadline_run((deadline_kind_t) kind, (gpio_num_t) pin, at);
+            } else {
+                button_deadline_schedule(at);
             }
         }
     }
 }
 
+static void button_handle_event(const button_event_t *event) {
+    component.levels = event->levels;
+
+    if (event->type == BUTTON_ENCODER) {
+        button_dispatch(event);
+        return;
+    }
+
+    button_pressed_update(event);
+    button_chord_update(event);
+}
+
+/**
+ * Recover from a full ring. A dropped event leaves the reported state behind, so once the
+ * rings are drained every GPIO button and matrix key whose reported state disagrees with its
+ * current one gets a synthesized event. The ISR keeps its pins armed through an overflow, and
+ * the encoder keeps the detents it could not report for its next event.
+ */
+static void button_resync(void) {
+    ESP_LOGW(TAG, "Event ring overflow, resyncing");
+
+    uint64_t levels = button_read_levels();
+    uint64_t released = component.debounce.enabled ? component.debounce.filter.state : levels;
+    uint64_t keys = component.pins;
+    uint64_t pressed = ~released & component.pins;
+    if (component.matrix.enabled) {
+        const button_matrix_config_t *config = &component.matrix.config;
+        uint64_t matrix_keys = BUTTON_PIN_BIT(config->row_count * config->col_count) - 1;
+        keys |= matrix_keys << BUTTON_MATRIX_KEY_BASE;
+        pressed |= (component.matrix.filter.state & matrix_keys) << BUTTON_MATRIX_KEY_BASE;
+    }
+    uint64_t changed = (pressed ^ component.pressed) & keys;
+
+    button_event_t event = {
+            .timestamp = esp_timer_get_time(),
+            .levels = levels,
+    };
+    while (changed) {
+        int pin = __builtin_ctzll(changed);
+        changed &= changed - 1;
+        event.pin = (gpio_num_t) pin;
+        event.type = (pressed & BUTTON_PIN_BIT(pin)) ? BUTTON_DOWN : BUTTON_UP;
+        button_handle_event(&event);
+    }
+}
+
+static void button_drain(void) {
+    button_event_t event;
+
+    while (button_ring_pop(&component.isr_ring, &event)) {
+        button_handle_event(&event);
+    }
+    while (button_ring_pop(&component.timer_ring, &event)) {
+        button_handle_event(&event);
+    }
+
+    if (component.isr_ring.overflow || component.timer_ring.overflow) {
+        component.isr_ring.overflow = false;
+        component.timer_ring.overflow = false;
+        button_resync();
+    }
+}
+
+static void gpio_task(void *arg) {
+    // Serve anything that arrived before the task was running
+    uint32_t notified = BUTTON_NOTIFY_ALL;
+    bool inf_loop = true;
+    while (inf_loop) {
+        if (notified & BUTTON_NOTIFY_EDGE) {
+            button_debounce_start();
+        }
+        if (notified & BUTTON_NOTIFY_MATRIX) {
+            button_matrix_start();
+        }
+        if (notified & BUTTON_NOTIFY_ENCODER) {
+            button_encoder_start();
+        }
+        if (notified & BUTTON_NOTIFY_EVENT) {
+            button_drain();
+        }
+        if (notified & BUTTON_NOTIFY_REPEAT_STOP) {
+            button_repeat_stop_all();
+        }
+        if (notified & BUTTON_NOTIFY_DEADLINE) {
+            button_deadlines_process();
+        }
+        button_batch_flush();
+        xTaskNotifyWait(0, UINT32_MAX, &notified, portMAX_DELAY);
+    }
+}
+
 //MARK: Implementation of the public functions
 extern esp_err_t button_component_init(on_button_event_cb_t on_button_event_cb) {
     component.on_button_event_cb = on_button_event_cb;
-    component.queue = xQueueCreate(10, sizeof(uint32_t));
+
+    const esp_timer_create_args_t timer_args = {
+            .callback = &button_deadline_expired,
+            .name = "button_deadline"
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &component.deadlines.timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+
     xTaskCreate(&gpio_task, "gpio_task", 4096, NULL, 10, &component.task);
     esp_sleep_enable_gpio_wakeup();
     return ESP_OK;
 }
 
 extern esp_err_t button_init(gpio_num_t pin) {
+    return button_init_set(BUTTON_PIN_BIT(pin), NULL);
+}
+
+extern esp_err_t button_init_set(uint64_t pins, const button_pin_options_t *options) {
+    button_pin_options_t defaults = {0};
+    if (options == NULL) {
+        options = &defaults;
+    }
+    if (pins == 0 || (pins >> GPIO_NUM_MAX) != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // One gpio_config per pull mode, normally just the pull-up one
+    const uint64_t internal = pins & ~options->external_pull;
+    const uint64_t groups[] = {
+            internal & ~options->active_high,
+            internal & options->active_high,
+            pins & options->external_pull,
+    };
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+        if (groups[i] == 0) {
+            continue;
+        }
+        gpio_config_t io_conf = {
+                .intr_type = GPIO_INTR_DISABLE,
+                .mode = GPIO_MODE_INPUT,
+                .pin_bit_mask = groups[i],
+                .pull_up_en = i == 0,
+                .pull_down_en = i == 1,
+        };
+        esp_err_t err = gpio_config(&io_conf);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    component.inverted = (component.inverted & ~pins) | (pins & options->active_high);
+    button_install_isr_service();
+
+    uint64_t remaining = pins;
+    while (remaining) {
+        int pin = __builtin_ctzll(remaining);
+        remaining &= remaining - 1;
+        gpio_isr_handler_add((gpio_num_t) pin, gpio_isr_handler, (void *) (uintptr_t) pin);
+    }
+
+    uint64_t levels = button_read_levels();
+    component.pins |= pins;
+    component.levels = (component.levels & ~pins) | (levels & pins);
+    component.isr_levels = (component.isr_levels & ~pins) | (levels & pins);
+    component.debounce.filter.state = (component.debounce.filter.state & ~pins) | (levels & pins);
+    portENTER_CRITICAL(&component.pressed_lock);
+    component.pressed = (component.pressed & ~pins) | (~levels & pins);
+    portEXIT_CRITICAL(&component.pressed_lock);
+
+    remaining = pins;
+    while (remaining) {
+        int pin = __builtin_ctzll(remaining);
+        remaining &= remaining - 1;
+        button_arm((gpio_num_t) pin, levels & BUTTON_PIN_BIT(pin));
+    }
+    return ESP_OK;
+}
+
+extern esp_err_t button_set_batch_cb(on_button_batch_cb_t on_button_batch_cb) {
+    component.on_button_batch_cb = on_button_batch_cb;
+    return ESP_OK;
+}
+
+extern esp_err_t button_debounce_enable(const button_debounce_config_t *config) {
+    debounce_t *debounce = &component.debounce;
+
+    if (config == NULL || config->sample_period_us == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (debounce->enabled) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t samples = config->window_us / config->sample_period_us;
+    if (samples < 1) {
+        samples = 1;
+    } else if (samples > BUTTON_DEBOUNCE_MAX_SAMPLES) {
+        ESP_LOGW(TAG, "Debounce window clamped to %d samples", BUTTON_DEBOUNCE_MAX_SAMPLES);
+        samples = BUTTON_DEBOUNCE_MAX_SAMPLES;
+    }
+    debounce->samples = samples;
+    debounce->period_us = config->sample_period_us;
+
+    const esp_timer_create_args_t timer_args = {
+            .callback = &button_debounce_tick,
+            .name = "button_debounce"
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &debounce->timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    debounce->enabled = true;
+    return ESP_OK;
+}
+
+extern esp_err_t button_matrix_init(const button_matrix_config_t *config) {
+    matrix_t *matrix = &component.matrix;
+
+    if (config == NULL || config->row_count == 0 || config->col_count == 0 ||
+        config->row_count > BUTTON_MATRIX_MAX_LINES || config->col_count > BUTTON_MATRIX_MAX_LINES ||
+        config->row_count * config->col_count > BUTTON_MATRIX_MAX_KEYS ||
+        config->scan_period_us == 0 || config->debounce_scans == 0 ||
+        config->debounce_scans > BUTTON_DEBOUNCE_MAX_SAMPLES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (matrix->enabled) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    matrix->config = *config;
+
+    gpio_config_t io_conf = {
+            .intr_type = GPIO_INTR_DISABLE,
+            .mode = GPIO_MODE_OUTPUT_OD,
+            .pin_bit_mask = 0,
+            .pull_up_en = 0,
+            .pull_down_en = 0,
+    };
+    for (int i = 0; i < config->row_count; i++) {
+        io_conf.pin_bit_mask |= BUTTON_PIN_BIT(config->rows[i]);
+    }
+    gpio_config(&io_conf);
 
-    gpio_config_t io_conf;
-    io_conf.intr_type = GPIO_INTR_DISABLE;
     io_conf.mode = GPIO_MODE_INPUT;
-    io_conf.pin_bit_mask = BUTTON_PIN_BIT(pin);
     io_conf.pull_up_en = 1;
-    io_conf.pull_down_en = 0;
+    io_conf.pin_bit_mask = 0;
+    for (int i = 0; i < config->col_count; i++) {
+        io_conf.pin_bit_mask |= BUTTON_PIN_BIT(config->cols[i]);
+    }
     gpio_config(&io_conf);
 
-    gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
-    gpio_isr_handler_add(pin, gpio_isr_handler, (void *) pin);
+    const esp_timer_create_args_t timer_args = {
+            .callback = &button_matrix_tick,
+            .name = "button_matrix"
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &matrix->timer);
+    if (err != ESP_OK) {
+        return err;
+    }
 
-    int level = gpio_get_level(pin);
-    component.levels[pin] = level;
-    if (level) {
-        gpio_set_intr_type(pin, GPIO_INTR_LOW_LEVEL);
-        gpio_wakeup_enable(pin, GPIO_INTR_LOW_LEVEL);
+    button_install_isr_service();
+    for (int i = 0; i < config->col_count; i++) {
+        gpio_isr_handler_add(config->cols[i], button_matrix_isr_handler, NULL);
+    }
+
+    matrix->enabled = true;
+    button_matrix_idle();
+    return ESP_OK;
+}
+
+static esp_err_t button_encoder_pcnt_init(const button_encoder_config_t *config) {
+    pcnt_config_t pcnt_config = {
+            .pulse_gpio_num = config->pin_a,
+            .ctrl_gpio_num = config->pin_b,
+            .channel = PCNT_CHANNEL_0,
+            .unit = config->pcnt_unit,
+            .pos_mode = PCNT_COUNT_DEC,
+            .neg_mode = PCNT_COUNT_INC,
+            .lctrl_mode = PCNT_MODE_REVERSE,
+            .hctrl_mode = PCNT_MODE_KEEP,
+            .counter_h_lim = INT16_MAX,
+            .counter_l_lim = INT16_MIN,
+    };
+    esp_err_t err = pcnt_unit_config(&pcnt_config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Second channel with the roles swapped counts all four edges of a quadrature cycle
+    pcnt_config.pulse_gpio_num = config->pin_b;
+    pcnt_config.ctrl_gpio_num = config->pin_a;
+    pcnt_config.channel = PCNT_CHANNEL_1;
+    pcnt_config.pos_mode = PCNT_COUNT_INC;
+    pcnt_config.neg_mode = PCNT_COUNT_DEC;
+    err = pcnt_unit_config(&pcnt_config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    pcnt_set_filter_value(config->pcnt_unit, BUTTON_ENCODER_PCNT_FILTER);
+    pcnt_filter_enable(config->pcnt_unit);
+    pcnt_counter_pause(config->pcnt_unit);
+    pcnt_counter_clear(config->pcnt_unit);
+    return pcnt_counter_resume(config->pcnt_unit);
+}
+
+extern esp_err_t button_encoder_init(const button_encoder_config_t *config) {
+    encoder_t *encoder = &component.encoder;
+
+    if (config == NULL || config->steps_per_detent == 0 || config->report_period_us == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (encoder->enabled) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    encoder->config = *config;
+
+    // Input-only pins have no pull resistors, asking for one there only hides the missing one
+    const gpio_num_t pins[] = {config->pin_a, config->pin_b};
+    esp_err_t err;
+    for (size_t i = 0; i < sizeof(pins) / sizeof(pins[0]); i++) {
+        bool pull_up = GPIO_IS_VALID_OUTPUT_GPIO(pins[i]);
+        if (!pull_up) {
+            ESP_LOGW(TAG, "Encoder GPIO %d has no internal pull-up, it needs an external one", pins[i]);
+        }
+        gpio_config_t io_conf = {
+                .intr_type = GPIO_INTR_DISABLE,
+                .mode = GPIO_MODE_INPUT,
+                .pin_bit_mask = BUTTON_PIN_BIT(pins[i]),
+                .pull_up_en = pull_up,
+                .pull_down_en = 0,
+        };
+        err = gpio_config(&io_conf);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    if (config->pcnt_unit != BUTTON_ENCODER_NO_PCNT) {
+        err = button_encoder_pcnt_init(config);
+        if (err != ESP_OK) {
+            return err;
+        }
     } else {
-        gpio_set_intr_type(pin, GPIO_INTR_HIGH_LEVEL);
-        gpio_wakeup_enable(pin, GPIO_INTR_HIGH_LEVEL);
+        encoder->state = (gpio_get_level(config->pin_a) ? 2 : 0) | (gpio_get_level(config->pin_b) ? 1 : 0);
+    }
+
+    const esp_timer_create_args_t timer_args = {
+            .callback = &button_encoder_tick,
+            .name = "button_encoder"
+    };
+    err = esp_timer_create(&timer_args, &encoder->timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    button_install_isr_service();
+    gpio_isr_handler_add(config->pin_a, button_encoder_isr_handler, NULL);
+    gpio_set_intr_type(config->pin_a, GPIO_INTR_ANYEDGE);
+    if (config->pcnt_unit == BUTTON_ENCODER_NO_PCNT) {
+        gpio_isr_handler_add(config->pin_b, button_encoder_isr_handler, NULL);
+        gpio_set_intr_type(config->pin_b, GPIO_INTR_ANYEDGE);
+    }
+
+    encoder->enabled = true;
+    return ESP_OK;
+}
+
+extern esp_err_t button_set_long_press(uint32_t long_press_ms, uint32_t long_long_press_ms) {
+    component.long_press.long_press_us = long_press_ms * 1000LL;
+    component.long_press.long_long_press_us = long_long_press_ms * 1000LL;
+    return ESP_OK;
+}
+
+extern esp_err_t button_set_chord(uint64_t pins, uint32_t window_ms) {
+    component.chord.pins = pins;
+    component.chord.window_us = window_ms * 1000LL;
+    return ESP_OK;
+}
+
+extern esp_err_t button_set_multi_tap(uint64_t pins, uint32_t window_ms, bool eager) {
+    component.multi_tap.pins = pins;
+    component.multi_tap.window_us = window_ms * 1000LL;
+    component.multi_tap.eager = eager;
+    return ESP_OK;
+}
+
+extern esp_err_t button_set_repeat(gpio_num_t pin, const button_repeat_config_t *config) {
+    repeat_t *repeat = &component.repeat;
+
+    if (pin < 0 || pin >= BUTTON_KEY_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config == NULL) {
+        repeat->pins &= ~BUTTON_PIN_BIT(pin);
+        return ESP_OK;
+    }
+    if (config->interval_ms == 0 || config->accel_percent >= 100) {
+        return ESP_ERR_INVALID_ARG;
     }
 
+    repeat->config[pin] = *config;
+    if (repeat->config[pin].min_interval_ms == 0 || repeat->config[pin].min_interval_ms > config->interval_ms) {
+        repeat->config[pin].min_interval_ms = config->interval_ms;
+    }
+    repeat->pins |= BUTTON_PIN_BIT(pin);
     return ESP_OK;
-}
\ No newline at end of file
+}
+
+extern esp_err_t button_repeat_stop(void) {
+    button_notify(BUTTON_NOTIFY_REPEAT_STOP);
+    return ESP_OK;
+}
+
+extern uint64_t button_get_state_mask(void) {
+    portENTER_CRITICAL(&component.pressed_lock);
+    uint64_t pressed = component.pressed;
+    portEXIT_CRITICAL(&component.pressed_lock);
+    return pressed;
+}
+
+extern esp_err_t button_get_queue_stats(button_queue_stats_t *stats) {
+    if (stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const ring_t *rings[] = {&component.isr_ring, &component.timer_ring};
+    memset(stats, 0, sizeof(button_queue_stats_t));
+    for (size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+        stats->enqueued += rings[i]->enqueued;
+        stats->dropped += rings[i]->dropped;
+        if (rings[i]->high_water > stats->high_water) {
+            stats->high_water = rings[i]->high_water;
+        }
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,59 @@
+//
+// Monotonic counters in their own raw flash partition, for totals that change far too often
+// for NVS: key presses, boots, reconnects. An increment clears one bit of a pre-erased word, a
+// single four byte flash program with no erase.
+//
+
+#ifndef BLACK_BRICKS_ESP_BASE_COUNTER_H
+#define BLACK_BRICKS_ESP_BASE_COUNTER_H
+
+//MARK: Import common headers
+#include <stdint.h>
+
+#include "esp_err.h"
+
+//MARK: Macros and constants
+// Data partition holding the counters, see partition_table.csv
+#define COUNTER_PARTITION_LABEL "counters"
+#define COUNTER_PARTITION_SUBTYPE 0x41
+
+// Counters kept, indexed from 0. Changing it starts every counter from zero.
+#ifndef COUNTER_MAX
+#define COUNTER_MAX 8
+#endif
+
+// Task writing what counter_increment_async counted, a compaction erases a sector
+#ifndef COUNTER_TASK_PRIORITY
+#define COUNTER_TASK_PRIORITY (tskIDLE_PRIORITY + 1)
+#endif
+#define COUNTER_TASK_STACK_SIZE 3072
+
+//MARK: Types
+
+//MARK: Global variables
+
+//MARK: Function prototypes
+/**
+ * Find the counters partition and count the cleared bits, about 4 kB read. ESP_ERR_NOT_FOUND
+ * when the partition table has no counters, all other calls fail with ESP_ERR_INVALID_STATE then.
+ */
+extern esp_err_t counter_init();
+extern esp_err_t counter_deinit();
+
+/**
+ * The partition holds two sectors, one of them live. Each counter owns a run of its bits;
+ * when a run is used up all counters are compacted into base values in the other sector,
+ * which costs one sector erase every few thousand increments. A power cut loses at most the
+ * increment in progress, never a compacted value.
+ */
+extern esp_err_t counter_increment(uint8_t index);
+
+/**
+ * Count in RAM and leave the flash program, and any compaction, to the counter task, for
+ * callers that must not wait for the flash. counter_get includes what is not written yet. A
+ * power cut loses those increments, esp_restart and counter_deinit write them first.
+ */
+extern esp_err_t counter_increment_async(uint8_t index);
+extern esp_err_t counter_get(uint8_t index, uint32_t *value);
+
+#endif //BLACK_BRICKS_ESP_BASE_COUNTER_H
@@ -0,0 +1,342 @@
+//
+// Two sector layout. Each sector starts with a header carrying a generation and the base value
+// of every counter, followed by one run of bit words per counter. A counter is its base plus
+// the bits cleared in its run; bits are cleared from the lowest upwards, so the next one to
+// clear follows from the count. The valid header with the highest generation marks the live
+// sector. Compaction erases the other sector and writes a header with the current values into
+// it, which switches over in one step: a cut before that header is complete leaves the old
+// sector live.
+//
+
+//MARK: Import common headers
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+//MARK: Import component header
+#include "counter.h"
+
+//MARK: Private macros and constants
+#define TAG "COUNTER"
+
+#define COUNTER_SECTOR_SIZE 4096
+#define COUNTER_MAGIC 0x314e5443u    // "CTN1"
+#define COUNTER_BITS_OFFSET 64
+#define COUNTER_RUN_WORDS ((COUNTER_SECTOR_SIZE - COUNTER_BITS_OFFSET) / sizeof(uint32_t) / COUNTER_MAX)
+#define COUNTER_RUN_BITS (COUNTER_RUN_WORDS * 32)
+#define COUNTER_SCAN_WORDS 16
+
+//MARK: Private types
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t bases[COUNTER_MAX];
+    uint32_t crc;               // esp_rom_crc32_le over the fields before
+} sector_header_t;
+
+_Static_assert(sizeof(sector_header_t) <= COUNTER_BITS_OFFSET, "COUNTER_MAX too large for the header");
+
+typedef struct {
+    const esp_partition_t *partition;
+    SemaphoreHandle_t lock;         // Everything but pending, held across flash access
+    SemaphoreHandle_t pending_lock; // Only pending, never held while waiting for the flash
+    TaskHandle_t task;
+    uint8_t sector;             // Live one, 0 or 1
+    uint32_t generation;
+    uint32_t bases[COUNTER_MAX];
+    uint32_t used[COUNTER_MAX]; // Bits cleared in each run
+    uint32_t pending[COUNTER_MAX];  // Counted by counter_increment_async, not written yet
+} component_t;
+
+//MARK: Declaration of the private opaque structs
+
+//MARK: Public global variables
+
+//MARK: Private global variables
+static component_t component = {
+        .partition = NULL,
+        .lock = NULL,
+        .pending_lock = NULL,
+        .task = NULL,
+};
+
+//MARK: Private functions
+static size_t counter_word_offset(uint8_t sector, uint8_t index, uint32_t word) {
+    return (size_t) sector * COUNTER_SECTOR_SIZE + COUNTER_BITS_OFFSET +
+           ((size_t) index * COUNTER_RUN_WORDS + word) * sizeof(uint32_t);
+}
+
+static uint32_t counter_cleared_bits(uint32_t word) {
+    return 32 - __builtin_popcount(word);
+}
+
+static uint32_t counter_header_crc(const sector_header_t *header) {
+    return esp_rom_crc32_le(0, (const uint8_t *) header, offsetof(sector_header_t, crc));
+}
+
+static bool counter_header_read(uint8_t sector, sector_header_t *header) {
+    if (esp_partition_read(component.partition, (size_t) sector * COUNTER_SECTOR_SIZE, header,
+                           sizeof(sector_header_t)) != ESP_OK) {
+        return false;
+    }
+    return header->magic == COUNTER_MAGIC && header->crc == counter_header_crc(header);
+}
+
+/**
+ * Erase sector and make it live with the given base values.
+ */
+static esp_err_t counter_start_sector(uint8_t sector, uint32_t generation, const uint32_t *bases) {
+    esp_err_t err = esp_partition_erase_range(component.partition, (size_t) sector * COUNTER_SECTOR_SIZE,
+                                              COUNTER_SECTOR_SIZE);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    sector_header_t header = {
+            .magic = COUNTER_MAGIC,
+            .generation = generation,
+    };
+    memcpy(header.bases, bases, sizeof(header.bases));
+    header.crc = counter_header_crc(&header);
+    err = esp_partition_write(component.partition, (size_t) sector * COUNTER_SECTOR_SIZE, &header,
+                              sizeof(sector_header_t));
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    component.sector = sector;
+    component.generation = generation;
+    memcpy(component.bases, bases, sizeof(component.bases));
+    memset(component.used, 0, sizeof(component.used));
+    return ESP_OK;
+}
+
+/**
+ * Fold every counter into a base value in the other sector, giving all runs their bits back.
+ */
+static esp_err_t counter_compact() {
+    uint32_t values[COUNTER_MAX];
+    for (size_t i = 0; i < COUNTER_MAX; i++) {
+        values[i] = component.bases[i] + component.used[i];
+    }
+    ESP_LOGI(TAG, "Compacting into sector %u", 1 - component.sector);
+    return counter_start_sector(1 - component.sector, component.generation + 1, values);
+}
+
+static esp_err_t counter_count_run(uint8_t index) {
+    uint32_t words[COUNTER_SCAN_WORDS];
+    uint32_t used = 0;
+
+    for (uint32_t word = 0; word < COUNTER_RUN_WORDS; word += COUNTER_SCAN_WORDS) {
+        uint32_t count = COUNTER_RUN_WORDS - word;
+        if (count > COUNTER_SCAN_WORDS) {
+            count = COUNTER_SCAN_WORDS;
+        }
+        esp_err_t err = esp_partition_read(component.partition, counter_word_offset(component.sector, index, word),
+                                           words, count * sizeof(uint32_t));
+        if (err != ESP_OK) {
+            return err;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            used += counter_cleared_bits(words[i]);
+        }
+    }
+    component.used[index] = used;
+    return ESP_OK;
+}
+
+static esp_err_t counter_recover() {
+    sector_header_t headers[2];
+    bool valid[2];
+    for (uint8_t sector = 0; sector < 2; sector++) {
+        valid[sector] = counter_header_read(sector, &headers[sector]);
+    }
+    if (!valid[0] && !valid[1]) {
+        uint32_t zeros[COUNTER_MAX] = {0};
+        ESP_LOGI(TAG, "No counters yet, starting from zero");
+        return counter_start_sector(0, 1, zeros);
+    }
+
+    uint8_t sector = !valid[0] || (valid[1] && headers[1].generation > headers[0].generation) ? 1 : 0;
+    component.sector = sector;
+    component.generation = headers[sector].generation;
+    memcpy(component.bases, headers[sector].bases, sizeof(component.bases));
+    for (uint8_t index = 0; index < COUNTER_MAX; index++) {
+        esp_err_t err = counter_count_run(index);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Clear the next bit of a counter, compacting first when its run is used up. Called with lock held.
+ */
+static esp_err_t counter_increment_locked(uint8_t index) {
+    esp_err_t err = ESP_OK;
+    if (component.used[index] == COUNTER_RUN_BITS) {
+        err = counter_compact();
+    }
+    if (err == ESP_OK) {
+        // Bits below the one cleared now are zero already, programming them again is harmless
+        uint32_t word = component.used[index] / 32;
+        uint32_t bit = component.used[index] % 32;
+        uint32_t value = bit == 31 ? 0 : UINT32_MAX << (bit + 1);
+        size_t offset = counter_word_offset(component.sector, index, word);
+        err = esp_partition_write(component.partition, offset, &value, sizeof(uint32_t));
+        if (err == ESP_OK) {
+            component.used[index]++;
+        } else if (esp_partition_read(component.partition, offset, &value, sizeof(uint32_t)) == ESP_OK) {
+            // The bit may or may not have made it
+            component.used[index] = word * 32 + counter_cleared_bits(value);
+        }
+    }
+    return err;
+}
+
+/**
+ * Write the increments counted in RAM. Each one leaves pending only once it is in flash, so
+ * counter_get never misses it in between. Called with lock held.
+ */
+static esp_err_t counter_write_pending_locked() {
+    esp_err_t err = ESP_OK;
+    for (uint8_t index = 0; index < COUNTER_MAX && err == ESP_OK && component.partition != NULL; index++) {
+        xSemaphoreTake(component.pending_lock, portMAX_DELAY);
+        uint32_t pending = component.pending[index];
+        xSemaphoreGive(component.pending_lock);
+
+        for (; pending > 0 && err == ESP_OK; pending--) {
+            err = counter_increment_locked(index);
+            if (err == ESP_OK) {
+                xSemaphoreTake(component.pending_lock, portMAX_DELAY);
+                component.pending[index]--;
+                xSemaphoreGive(component.pending_lock);
+            }
+        }
+    }
+    return err;
+}
+
+static void counter_task(void *arg) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        xSemaphoreTake(component.lock, portMAX_DELAY);
+        esp_err_t err = counter_write_pending_locked();
+        xSemaphoreGive(component.lock);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Cannot write counters: %s", esp_err_to_name(err));
+        }
+    }
+}
+
+static void counter_shutdown_handler(void) {
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    counter_write_pending_locked();
+    xSemaphoreGive(component.lock);
+}
+
+//MARK: Public functions
+esp_err_t counter_init() {
+    if (component.partition != NULL) {
+        return ESP_OK;
+    }
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                (esp_partition_subtype_t) COUNTER_PARTITION_SUBTYPE,
+                                                                COUNTER_PARTITION_LABEL);
+    if (partition == NULL) {
+        ESP_LOGW(TAG, "No %s partition, counters disabled", COUNTER_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (partition->size < 2 * COUNTER_SECTOR_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (component.lock == NULL) {
+        component.lock = xSemaphoreCreateMutex();
+        component.pending_lock = xSemaphoreCreateMutex();
+        if (component.lock == NULL || component.pending_lock == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        if (xTaskCreate(counter_task, "counter", COUNTER_TASK_STACK_SIZE, NULL, COUNTER_TASK_PRIORITY,
+                        &component.task) != pdPASS) {
+            return ESP_ERR_NO_MEM;
+        }
+        esp_register_shutdown_handler(counter_shutdown_handler);
+    }
+
+    component.partition = partition;
+    esp_err_t err = counter_recover();
+    if (err != ESP_OK) {
+        component.partition = NULL;
+    }
+    return err;
+}
+
+esp_err_t counter_deinit() {
+    if (component.partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    esp_err_t err = counter_write_pending_locked();
+    component.partition = NULL;
+    xSemaphoreGive(component.lock);
+    // Left over from a failed write, the values recovered at the next init count without them
+    xSemaphoreTake(component.pending_lock, portMAX_DELAY);
+    memset(component.pending, 0, sizeof(component.pending));
+    xSemaphoreGive(component.pending_lock);
+    return err;
+}
+
+esp_err_t counter_increment(uint8_t index) {
+    if (index >= COUNTER_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (component.partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    esp_err_t err = counter_increment_locked(index);
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+esp_err_t counter_increment_async(uint8_t index) {
+    if (index >= COUNTER_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (component.partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.pending_lock, portMAX_DELAY);
+    component.pending[index]++;
+    xSemaphoreGive(component.pending_lock);
+    xTaskNotifyGive(component.task);
+    return ESP_OK;
+}
+
+esp_err_t counter_get(uint8_t index, uint32_t *value) {
+    if (index >= COUNTER_MAX || value == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (component.partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    xSemaphoreTake(component.pending_lock, portMAX_DELAY);
+    *value = component.bases[index] + component.used[index] + component.pending[index];
+    xSemaphoreGive(component.pending_lock);
+    xSemaphoreGive(component.lock);
+    return ESP_OK;
+}
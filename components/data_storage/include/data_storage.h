@@ -11,16 +11,270 @@
 #include "freertos/queue.h"
 
 //MARK: Macros and constants
+#define DATA_STORAGE_DEFAULT_NAMESPACE "storage"
+
+// Namespaces kept open at the same time, each holds one NVS handle until data_storage_deinit
+#ifndef DATA_STORAGE_MAX_NAMESPACES
+#define DATA_STORAGE_MAX_NAMESPACES 4
+#endif
+
+// Keys tracked by the write-back cache, and bytes of staged blobs before a flush is forced
+#ifndef DATA_STORAGE_CACHE_ENTRIES
+#define DATA_STORAGE_CACHE_ENTRIES 16
+#endif
+#ifndef DATA_STORAGE_STAGED_BYTES_MAX
+#define DATA_STORAGE_STAGED_BYTES_MAX 2048
+#endif
+
+// Bytes of clean blobs kept in RAM by the read-through cache
+#ifndef DATA_STORAGE_CACHE_BYTES_MAX
+#define DATA_STORAGE_CACHE_BYTES_MAX 1024
+#endif
+
+// Pinned blobs up to this size are cached in RAM set aside per pinned key, outside the budget
+// above. Reading them never touches the heap.
+#ifndef DATA_STORAGE_PINNED_VALUE_MAX
+#define DATA_STORAGE_PINNED_VALUE_MAX 128
+#endif
+
+#define DATA_STORAGE_COMMIT_DELAY_DEFAULT_MS 2000
+
+// Storage worker: requests it can queue, and how long a due commit may wait for a quiet moment
+#ifndef DATA_STORAGE_QUEUE_LENGTH
+#define DATA_STORAGE_QUEUE_LENGTH 8
+#endif
+#ifndef DATA_STORAGE_WORKER_PRIORITY
+#define DATA_STORAGE_WORKER_PRIORITY (tskIDLE_PRIORITY + 1)
+#endif
+#define DATA_STORAGE_WORKER_STACK_SIZE 4096
+#define DATA_STORAGE_HOLD_MAX_MS 1000
+
+// Streamed objects are split into blobs of this size under keys derived from the stream key
+#ifndef DATA_STORAGE_CHUNK_SIZE
+#define DATA_STORAGE_CHUNK_SIZE 256
+#endif
+#define DATA_STORAGE_STREAM_KEY_MAX 10
+
+// Bytes one batch can hold, every value takes four plus its key and data
+#ifndef DATA_STORAGE_BATCH_BYTES_MAX
+#define DATA_STORAGE_BATCH_BYTES_MAX 512
+#endif
+
+// Latency histogram bucket i counts calls faster than DATA_STORAGE_LATENCY_BUCKET_US << i, the
+// last bucket everything slower. Distinct error codes counted, others only add to errors_other.
+#define DATA_STORAGE_LATENCY_BUCKETS 12
+#define DATA_STORAGE_LATENCY_BUCKET_US 50
+#define DATA_STORAGE_ERROR_CODES 8
 
 //MARK: Types
+typedef void (*data_storage_done_cb_t)(esp_err_t err, void *arg);
+typedef void (*data_storage_job_t)(void *arg);
+
+typedef struct {
+    uint32_t hits;          // Reads served from RAM
+    uint32_t misses;        // Reads that went to flash
+    uint32_t evictions;     // Cached values dropped to make room
+} data_storage_cache_stats_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t buckets[DATA_STORAGE_LATENCY_BUCKETS];
+} data_storage_latency_t;
+
+typedef struct {
+    esp_err_t code;
+    uint32_t count;
+} data_storage_error_count_t;
+
+/**
+ * Flash traffic since boot or the last data_storage_reset_stats. Reads, writes and commits are
+ * NVS calls, so a write that only got staged or was equal to the stored value counts nowhere
+ * but in writes_skipped or staged. A miss on a missing key is not an error.
+ */
+typedef struct {
+    uint32_t reads;
+    uint32_t writes;                // Sets and key erases
+    uint32_t commits;
+    uint32_t bytes_read;
+    uint32_t bytes_written;
+    uint32_t staged;                // Writes accepted into RAM, each flushed at most once
+    uint32_t writes_skipped;        // Writes equal to the stored value
+    data_storage_cache_stats_t cache;
+    data_storage_error_count_t errors[DATA_STORAGE_ERROR_CODES];
+    uint32_t errors_other;
+    data_storage_latency_t get;
+    data_storage_latency_t set;
+    data_storage_latency_t commit;
+    size_t used_entries;            // Of the NVS partition, 32 bytes each, filled in on request
+    size_t free_entries;
+} data_storage_stats_t;
+
+/**
+ * State of one streamed read or write, usually on the caller's stack. Holds one chunk, so a
+ * stream of any length needs DATA_STORAGE_CHUNK_SIZE bytes of RAM and no heap.
+ */
+typedef struct {
+    char namespace_name[16];
+    char key[DATA_STORAGE_STREAM_KEY_MAX + 1];
+    bool writing;
+    char generation;        // Chunk set being read or written, 'a' or 'b'
+    uint16_t old_chunks;    // Writer: chunks of the object being replaced
+    uint32_t length;
+    uint32_t offset;
+    uint16_t chunk_index;   // Chunk currently in buffer, reader only
+    uint16_t chunk_fill;
+    uint8_t chunk[DATA_STORAGE_CHUNK_SIZE];
+} data_storage_stream_t;
+
+/**
+ * Values collected for one data_storage_batch_commit, usually on the caller's stack. Nothing
+ * reaches storage before the commit.
+ */
+typedef struct {
+    char namespace_name[16];
+    esp_err_t err;          // First failed set, the commit fails with it
+    bool atomic;            // Whether the commit goes through the batch log
+    uint16_t count;
+    uint16_t length;
+    uint8_t data[DATA_STORAGE_BATCH_BYTES_MAX];
+} data_storage_batch_t;
 
 //MARK: Global variables
 
 //MARK: Function prototypes
 extern esp_err_t data_storage_init();
-extern esp_err_t data_storage_write(const char *key, const uint8_t *data, size_t length);
-extern esp_err_t data_storage_read_alloc(const char *key, uint8_t **out_data, size_t *length);
-extern esp_err_t data_storage_write_i32(const char *key, int32_t value);
-extern esp_err_t data_storage_read_i32(const char *key, int32_t *value);
+
+/**
+ * Run the queued async requests, flush staged writes and close every pooled namespace handle.
+ * Storage calls fail with ESP_ERR_INVALID_STATE afterwards until data_storage_init is called
+ * again. Not to be called from a done callback, those run on the worker it waits for.
+ */
+extern esp_err_t data_storage_deinit();
+
+/**
+ * Writes are write-back: a value equal to the stored one is dropped, anything else is kept in
+ * RAM and written with a single commit per namespace once the commit delay has passed since
+ * the first pending write, on data_storage_flush, or on esp_restart. Reads are read-through:
+ * pending and recently used values are served from RAM, a write replaces the cached value.
+ * Namespaces are opened on first use and stay open. Namespace names and keys follow the NVS
+ * rules, at most 15 characters.
+ * A write never waits for flash outside the storage worker: a key new to the cache is compared
+ * with flash by the flush, and flushes forced by the staged byte limit are queued for the
+ * worker. With every cache slot holding a pending write it fails with ESP_ERR_NO_MEM, the flush
+ * that frees them is queued by then; data_storage_write_async queues the write itself instead.
+ */
+extern esp_err_t data_storage_write(const char *namespace_name, const char *key, const uint8_t *data, size_t length);
+extern esp_err_t data_storage_read_alloc(const char *namespace_name, const char *key, uint8_t **out_data, size_t *length);
+
+/**
+ * Read a blob into a caller buffer without touching the heap. *length is the buffer size on
+ * entry and the blob size on return; a NULL data only queries the size. A buffer that is too
+ * small gives ESP_ERR_NVS_INVALID_LENGTH with the needed size in *length. Misses only fill the
+ * cache for pinned keys.
+ */
+extern esp_err_t data_storage_read_into(const char *namespace_name, const char *key, uint8_t *data, size_t *length);
+extern esp_err_t data_storage_write_i32(const char *namespace_name, const char *key, int32_t value);
+extern esp_err_t data_storage_read_i32(const char *namespace_name, const char *key, int32_t *value);
+
+/**
+ * Remove a key together with any staged or cached value, written through with one commit. A
+ * key that is not stored is not an error.
+ */
+extern esp_err_t data_storage_erase(const char *namespace_name, const char *key);
+
+/**
+ * Write all pending values now. Call before deep sleep or cutting power.
+ */
+extern esp_err_t data_storage_flush();
+
+/**
+ * Longest time a write may wait in RAM. Zero hands every write to the storage worker straight
+ * away, which may still merge writes that come in faster than it commits them.
+ */
+extern esp_err_t data_storage_set_commit_delay(uint32_t delay_ms);
+
+/**
+ * Queue a write or flush for the low priority storage worker and return at once, so that a
+ * flash stall never lands on a BLE callback or the button task. done, if set, is called from
+ * the worker with the result. data is copied. Fails with ESP_ERR_TIMEOUT when the queue is
+ * full, nothing is queued then.
+ */
+extern esp_err_t data_storage_write_async(const char *namespace_name, const char *key, const uint8_t *data,
+                                          size_t length, data_storage_done_cb_t done, void *arg);
+extern esp_err_t data_storage_write_i32_async(const char *namespace_name, const char *key, int32_t value,
+                                              data_storage_done_cb_t done, void *arg);
+extern esp_err_t data_storage_flush_async(data_storage_done_cb_t done, void *arg);
+
+/**
+ * Queue a job for the storage worker, for a component whose own writes, e.g. a batch commit,
+ * must not run on the task that asks for them, like the FreeRTOS timer task. The job may call
+ * any data_storage function. Fails with ESP_ERR_TIMEOUT when the queue is full.
+ */
+extern esp_err_t data_storage_run_async(data_storage_job_t job, void *arg);
+
+/**
+ * Tell the worker that timing sensitive traffic is going on, e.g. an HID report burst. Commits
+ * that fall due within hold_ms wait until it has passed, but never longer than
+ * DATA_STORAGE_HOLD_MAX_MS. Cheap enough to call for every report.
+ */
+extern void data_storage_hold_commits(uint32_t hold_ms);
+
+/**
+ * Keep a key in the read-through cache for good. Its value is loaded by the first read and
+ * never evicted afterwards. At most half of DATA_STORAGE_CACHE_ENTRIES keys can be pinned. A
+ * blob larger than DATA_STORAGE_PINNED_VALUE_MAX is not kept and read from flash every time.
+ */
+extern esp_err_t data_storage_pin(const char *namespace_name, const char *key);
+extern esp_err_t data_storage_unpin(const char *namespace_name, const char *key);
+
+/**
+ * Copy out every counter at once. Reset clears them but not the partition usage.
+ */
+extern esp_err_t data_storage_get_stats(data_storage_stats_t *stats);
+extern esp_err_t data_storage_reset_stats();
+
+/**
+ * Stream objects larger than one blob, DATA_STORAGE_CHUNK_SIZE bytes per NVS key. Keys are at
+ * most DATA_STORAGE_STREAM_KEY_MAX characters. A writer fills the spare of two chunk sets and
+ * switches over in close, so readers see either the old or the new object, never a mix.
+ * Streams bypass the cache and are written through with one commit.
+ */
+extern esp_err_t data_storage_stream_open_write(data_storage_stream_t *stream, const char *namespace_name, const char *key);
+extern esp_err_t data_storage_stream_open_read(data_storage_stream_t *stream, const char *namespace_name, const char *key);
+extern esp_err_t data_storage_stream_write(data_storage_stream_t *stream, const void *data, size_t length);
+
+/**
+ * Read up to length bytes, *read_length is 0 at the end of the object. A chunk whose size does
+ * not match the object length fails with ESP_ERR_INVALID_SIZE.
+ */
+extern esp_err_t data_storage_stream_read(data_storage_stream_t *stream, void *data, size_t length, size_t *read_length);
+extern size_t data_storage_stream_length(const data_storage_stream_t *stream);
+
+/**
+ * Finish a stream. For a writer this stores the last chunk and publishes the object.
+ */
+extern esp_err_t data_storage_stream_close(data_storage_stream_t *stream);
+
+/**
+ * Update several keys of one namespace together, e.g. pairing data and the connection
+ * parameters that go with it. The commit writes every value with a single nvs_commit and
+ * either all of them become visible or none: the batch is first stored as one blob, which a
+ * reset during the commit leaves behind to be applied in full when the namespace is next
+ * opened. A batch equal to the stored values writes nothing. Values staged by
+ * data_storage_write for the same keys are replaced.
+ *
+ * The log costs flash: a batch of more than one value writes every byte twice plus the log
+ * entry and its erase, about 2.3 times the entries and 4 times the time of writing the values
+ * alone in storage_bench. A batch begun with data_storage_batch_begin_unlogged skips the log
+ * and keeps the single commit, but a reset during it can leave only some values written.
+ */
+extern esp_err_t data_storage_batch_begin(data_storage_batch_t *batch, const char *namespace_name);
+extern esp_err_t data_storage_batch_begin_unlogged(data_storage_batch_t *batch, const char *namespace_name);
+extern esp_err_t data_storage_batch_set(data_storage_batch_t *batch, const char *key, const uint8_t *data,
+                                        size_t length);
+extern esp_err_t data_storage_batch_set_i32(data_storage_batch_t *batch, const char *key, int32_t value);
+extern esp_err_t data_storage_batch_commit(data_storage_batch_t *batch);
 
 #endif //BLACK_BRICKS_ESP_BASE_DATA_STORAGE_H
@@ -3,7 +3,16 @@
 //
 
 //MARK: Import common headers
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 
@@ -13,18 +22,803 @@
 //MARK: Private macros and constants
 #define TAG "DATA_STORAGE"
 
+#define DATA_STORAGE_FNV_OFFSET 2166136261u
+#define DATA_STORAGE_FNV_PRIME 16777619u
+
+// Chunk keys are "<key>.<generation><hex index>", which leaves three hex digits
+#define DATA_STORAGE_STREAM_MAX_CHUNKS 0x1000
+#define DATA_STORAGE_STREAM_NO_CHUNK UINT16_MAX
+
+// Holds a batch while it is being applied, see data_storage_batch_commit
+#define DATA_STORAGE_BATCH_KEY ".batch"
+#define DATA_STORAGE_BATCH_ITEM_HEADER 4
+
 //MARK: Private types
+typedef struct {
+    char name[NVS_KEY_NAME_MAX_SIZE];
+    nvs_handle_t handle;
+} namespace_t;
+
+typedef enum {
+    ENTRY_BLOB = 0,
+    ENTRY_I32,
+} entry_type_t;
+
+/**
+ * A key the cache knows about. hash describes the newest value, whether it is still staged
+ * (dirty) or already in flash. The value itself (data or i32) is valid while dirty or cached;
+ * clean blobs are dropped again when the byte budget is needed elsewhere.
+ */
+typedef struct {
+    bool used;
+    bool dirty;
+    bool cached;
+    bool pinned;
+    bool compare;           // Value in flash not known, the flush compares before writing
+    uint8_t *pool;          // Pinned only: RAM set aside for the value, see DATA_STORAGE_PINNED_VALUE_MAX
+    uint8_t namespace_index;
+    entry_type_t type;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint32_t hash;
+    size_t length;
+    uint8_t *data;
+    int32_t i32;
+    uint32_t last_used;
+} entry_t;
+
+/**
+ * Stored under the stream key itself, written last so that it switches readers over.
+ */
+typedef struct {
+    uint32_t length;
+    uint16_t chunk_size;
+    uint16_t chunks;
+    char generation;
+} stream_header_t;
+
+/**
+ * One value of a batch. Stored as type, key length and little endian data length, one byte
+ * each but the last two, followed by the key and the data.
+ */
+typedef struct {
+    entry_type_t type;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    const uint8_t *data;
+    size_t length;
+} batch_item_t;
+
+typedef enum {
+    REQUEST_WRITE = 0,
+    REQUEST_WRITE_I32,
+    REQUEST_FLUSH,
+    REQUEST_COMMIT_DUE,     // From the commit timer, subject to data_storage_hold_commits
+    REQUEST_JOB,
+    REQUEST_STOP,
+} request_type_t;
+
+typedef struct {
+    request_type_t type;
+    char namespace_name[NVS_KEY_NAME_MAX_SIZE];
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t *data;
+    size_t length;
+    int32_t i32;
+    data_storage_job_t job;
+    data_storage_done_cb_t done;
+    void *arg;
+} request_t;
+
+typedef struct {
+    SemaphoreHandle_t lock;
+    TimerHandle_t commit_timer;
+    QueueHandle_t queue;
+    TaskHandle_t worker;
+    volatile TickType_t hold_until;
+    uint32_t commit_delay_ms;
+    namespace_t namespaces[DATA_STORAGE_MAX_NAMESPACES];
+    size_t namespace_count;
+    entry_t entries[DATA_STORAGE_CACHE_ENTRIES];
+    size_t staged_bytes;
+    size_t cached_bytes;
+    size_t pinned_count;
+    uint8_t pinned_pool[DATA_STORAGE_CACHE_ENTRIES / 2][DATA_STORAGE_PINNED_VALUE_MAX];
+    bool pinned_pool_used[DATA_STORAGE_CACHE_ENTRIES / 2];
+    bool flush_posted;      // A REQUEST_FLUSH is queued for the worker
+    uint32_t use_clock;
+    data_storage_stats_t stats;
+} component_t;
 
 //MARK: Declaration of the private opaque structs
 
 //MARK: Public global variables
 
 //MARK: Private global variables
+static component_t component = {
+        .lock = NULL,
+        .commit_timer = NULL,
+        .queue = NULL,
+        .worker = NULL,
+        .commit_delay_ms = DATA_STORAGE_COMMIT_DELAY_DEFAULT_MS,
+};
 
 //MARK: Private functions
+static uint32_t data_storage_hash(entry_type_t type, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    uint32_t hash = (DATA_STORAGE_FNV_OFFSET ^ type) * DATA_STORAGE_FNV_PRIME;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * DATA_STORAGE_FNV_PRIME;
+    }
+    return hash;
+}
+
+static void data_storage_count_error(esp_err_t err) {
+    for (size_t i = 0; i < DATA_STORAGE_ERROR_CODES; i++) {
+        data_storage_error_count_t *error = &component.stats.errors[i];
+        if (error->count == 0 || error->code == err) {
+            error->code = err;
+            error->count++;
+            return;
+        }
+    }
+    component.stats.errors_other++;
+}
+
+/**
+ * Account one NVS call that started at started_us. Called with the lock held, like every NVS
+ * call of this component.
+ */
+static esp_err_t data_storage_count(data_storage_latency_t *latency, int64_t started_us, esp_err_t err) {
+    int64_t elapsed_us = esp_timer_get_time() - started_us;
+    size_t bucket = 0;
+    while (bucket < DATA_STORAGE_LATENCY_BUCKETS - 1 &&
+           elapsed_us >= ((int64_t) DATA_STORAGE_LATENCY_BUCKET_US << bucket)) {
+        bucket++;
+    }
+    latency->count++;
+    latency->total_us += elapsed_us;
+    latency->buckets[bucket]++;
+    if (elapsed_us > latency->max_us) {
+        latency->max_us = elapsed_us;
+    }
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        data_storage_count_error(err);
+    }
+    return err;
+}
+
+static esp_err_t data_storage_nvs_get_blob(nvs_handle_t handle, const char *key, void *data, size_t *length) {
+    int64_t started_us = esp_timer_get_time();
+    esp_err_t err = nvs_get_blob(handle, key, data, length);
+    component.stats.reads++;
+    if (err == ESP_OK && data != NULL) {
+        component.stats.bytes_read += *length;
+    }
+    return data_storage_count(&component.stats.get, started_us, err);
+}
+
+static esp_err_t data_storage_nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *value) {
+    int64_t started_us = esp_timer_get_time();
+    esp_err_t err = nvs_get_i32(handle, key, value);
+    component.stats.reads++;
+    if (err == ESP_OK) {
+        component.stats.bytes_read += sizeof(int32_t);
+    }
+    return data_storage_count(&component.stats.get, started_us, err);
+}
+
+static esp_err_t data_storage_nvs_set_blob(nvs_handle_t handle, const char *key, const void *data, size_t length) {
+    int64_t started_us = esp_timer_get_time();
+    esp_err_t err = nvs_set_blob(handle, key, data, length);
+    component.stats.writes++;
+    if (err == ESP_OK) {
+        component.stats.bytes_written += length;
+    }
+    return data_storage_count(&component.stats.set, started_us, err);
+}
+
+static esp_err_t data_storage_nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value) {
+    int64_t started_us = esp_timer_get_time();
+    esp_err_t err = nvs_set_i32(handle, key, value);
+    component.stats.writes++;
+    if (err == ESP_OK) {
+        component.stats.bytes_written += sizeof(int32_t);
+    }
+    return data_storage_count(&component.stats.set, started_us, err);
+}
+
+static esp_err_t data_storage_nvs_erase_key(nvs_handle_t handle, const char *key) {
+    int64_t started_us = esp_timer_get_time();
+    esp_err_t err = nvs_erase_key(handle, key);
+    component.stats.writes++;
+    return data_storage_count(&component.stats.set, started_us, err);
+}
+
+static esp_err_t data_storage_nvs_commit(nvs_handle_t handle) {
+    int64_t started_us = esp_timer_get_time();
+    esp_err_t err = nvs_commit(handle);
+    component.stats.commits++;
+    return data_storage_count(&component.stats.commit, started_us, err);
+}
+
+/**
+ * Decode the batch item at *offset and move past it. False at the end of the batch or when
+ * what follows is not a complete item.
+ */
+static bool data_storage_batch_item(const uint8_t *data, size_t length, size_t *offset, batch_item_t *item) {
+    if (*offset >= length || length - *offset < DATA_STORAGE_BATCH_ITEM_HEADER) {
+        return false;
+    }
+    const uint8_t *header = &data[*offset];
+    size_t key_length = header[1];
+    item->type = header[0];
+    item->length = header[2] | (header[3] << 8);
+    if ((item->type != ENTRY_BLOB && item->type != ENTRY_I32) || key_length == 0 ||
+        key_length >= NVS_KEY_NAME_MAX_SIZE || (item->type == ENTRY_I32 && item->length != sizeof(int32_t)) ||
+        length - *offset - DATA_STORAGE_BATCH_ITEM_HEADER < key_length + item->length) {
+        return false;
+    }
+    memcpy(item->key, header + DATA_STORAGE_BATCH_ITEM_HEADER, key_length);
+    item->key[key_length] = '\0';
+    item->data = header + DATA_STORAGE_BATCH_ITEM_HEADER + key_length;
+    *offset += DATA_STORAGE_BATCH_ITEM_HEADER + key_length + item->length;
+    return true;
+}
+
+/**
+ * Write every value of a batch, without committing. Nothing is written unless the whole batch
+ * decodes.
+ */
+static esp_err_t data_storage_batch_apply(nvs_handle_t handle, const uint8_t *data, size_t length) {
+    batch_item_t item;
+    size_t offset = 0;
+    while (data_storage_batch_item(data, length, &offset, &item)) {
+    }
+    if (offset != length) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    offset = 0;
+    while (data_storage_batch_item(data, length, &offset, &item)) {
+        esp_err_t err;
+        if (item.type == ENTRY_I32) {
+            int32_t value;
+            memcpy(&value, item.data, sizeof(int32_t));
+            err = data_storage_nvs_set_i32(handle, item.key, value);
+        } else {
+            err = data_storage_nvs_set_blob(handle, item.key, item.data, item.length);
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Finish a batch commit cut short by a reset, right after its namespace has been opened and
+ * before anything is read from it.
+ */
+static esp_err_t data_storage_batch_recover(const char *namespace_name, nvs_handle_t handle) {
+    size_t length = 0;
+    esp_err_t err = data_storage_nvs_get_blob(handle, DATA_STORAGE_BATCH_KEY, NULL, &length);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    uint8_t *data = malloc(length ? length : 1);
+    if (data == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGW(TAG, "Finishing an interrupted batch in %s", namespace_name);
+    err = data_storage_nvs_get_blob(handle, DATA_STORAGE_BATCH_KEY, data, &length);
+    if (err == ESP_OK) {
+        err = data_storage_batch_apply(handle, data, length);
+    }
+    free(data);
+    // A batch that cannot be decoded is dropped, it never became visible
+    if (err == ESP_OK || err == ESP_ERR_INVALID_SIZE) {
+        data_storage_nvs_erase_key(handle, DATA_STORAGE_BATCH_KEY);
+        esp_err_t commit_err = data_storage_nvs_commit(handle);
+        err = err == ESP_OK ? commit_err : err;
+    }
+    return err;
+}
+
+/**
+ * Find the pooled handle of a namespace, opening it on first use. Called with the lock held.
+ * Handles are owned by the pool and only closed in data_storage_deinit, so no call path can
+ * leak one.
+ */
+static esp_err_t data_storage_namespace(const char *namespace_name, uint8_t *index) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (namespace_name == NULL || strlen(namespace_name) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+
+    size_t i = 0;
+    while (i < component.namespace_count && strcmp(component.namespaces[i].name, namespace_name) != 0) {
+        i++;
+    }
+    if (i == component.namespace_count) {
+        if (i == DATA_STORAGE_MAX_NAMESPACES) {
+            ESP_LOGE(TAG, "No free namespace slot for %s", namespace_name);
+            return ESP_ERR_NO_MEM;
+        }
+        esp_err_t err = nvs_open(namespace_name, NVS_READWRITE, &component.namespaces[i].handle);
+        if (err != ESP_OK) {
+            return err;
+        }
+        err = data_storage_batch_recover(namespace_name, component.namespaces[i].handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Cannot finish the batch in %s: %s", namespace_name, esp_err_to_name(err));
+        }
+        strcpy(component.namespaces[i].name, namespace_name);
+        component.namespace_count++;
+    }
+    *index = i;
+    return ESP_OK;
+}
+
+static entry_t *data_storage_entry_find(uint8_t namespace_index, const char *key) {
+    for (size_t i = 0; i < DATA_STORAGE_CACHE_ENTRIES; i++) {
+        entry_t *entry = &component.entries[i];
+        if (entry->used && entry->namespace_index == namespace_index && strcmp(entry->key, key) == 0) {
+            entry->last_used = ++component.use_clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Drop the RAM copy of an entry's value, keeping its hash.
+ */
+static void data_storage_entry_release(entry_t *entry) {
+    if (entry->data != NULL && entry->data == entry->pool) {
+        // Only ever holds a clean value and is not part of the byte budget
+        entry->data = NULL;
+    } else if (entry->data != NULL) {
+        if (entry->dirty) {
+            component.staged_bytes -= entry->length;
+        } else {
+            component.cached_bytes -= entry->length;
+        }
+        free(entry->data);
+        entry->data = NULL;
+    }
+    entry->dirty = false;
+    entry->cached = false;
+}
+
+/**
+ * Free cached blob bytes, least recently used first, until length more fit in the budget.
+ */
+static bool data_storage_make_room(size_t length) {
+    if (length > DATA_STORAGE_CACHE_BYTES_MAX) {
+        return false;
+    }
+    while (component.cached_bytes + length > DATA_STORAGE_CACHE_BYTES_MAX) {
+        entry_t *victim = NULL;
+        for (size_t i = 0; i < DATA_STORAGE_CACHE_ENTRIES; i++) {
+            entry_t *entry = &component.entries[i];
+            if (entry->used && !entry->dirty && !entry->pinned && entry->data != NULL &&
+                (victim == NULL || entry->last_used < victim->last_used)) {
+                victim = entry;
+            }
+        }
+        if (victim == NULL) {
+            return false;
+        }
+        data_storage_entry_release(victim);
+        component.stats.cache.evictions++;
+    }
+    return true;
+}
+
+/**
+ * Keep a clean copy of a blob just read from or written to flash, if the budget allows.
+ */
+static void data_storage_entry_cache_blob(entry_t *entry, const uint8_t *data, size_t length) {
+    data_storage_entry_release(entry);
+    entry->length = length;
+    if (entry->pool != NULL && length <= DATA_STORAGE_PINNED_VALUE_MAX) {
+        memcpy(entry->pool, data, length);
+        entry->data = entry->pool;
+        entry->cached = true;
+        return;
+    }
+    if (!data_storage_make_room(length)) {
+        return;
+    }
+    entry->data = malloc(length ? length : 1);
+    if (entry->data != NULL) {
+        memcpy(entry->data, data, length);
+        component.cached_bytes += length;
+        entry->cached = true;
+    }
+}
+
+/**
+ * Take a free slot, or the least recently used clean unpinned one. NULL when none is left.
+ */
+static entry_t *data_storage_entry_alloc(uint8_t namespace_index, const char *key, entry_type_t type) {
+    entry_t *victim = NULL;
+    for (size_t i = 0; i < DATA_STORAGE_CACHE_ENTRIES; i++) {
+        entry_t *entry = &component.entries[i];
+        if (!entry->used) {
+            victim = entry;
+            break;
+        }
+        if (!entry->dirty && !entry->pinned && (victim == NULL || entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+    if (victim == NULL) {
+        return NULL;
+    }
+
+    if (victim->used && victim->cached) {
+        component.stats.cache.evictions++;
+    }
+    data_storage_entry_release(victim);
+    memset(victim, 0, sizeof(entry_t));
+    victim->used = true;
+    victim->namespace_index = namespace_index;
+    victim->type = type;
+    strcpy(victim->key, key);
+    victim->last_used = ++component.use_clock;
+    return victim;
+}
+
+/**
+ * Hash of the value currently in flash, ESP_ERR_NVS_NOT_FOUND if there is none of that type.
+ */
+static esp_err_t data_storage_stored_hash(nvs_handle_t handle, const char *key, entry_type_t type, uint32_t *hash) {
+    if (type == ENTRY_I32) {
+        int32_t value;
+        esp_err_t err = data_storage_nvs_get_i32(handle, key, &value);
+        if (err == ESP_OK) {
+            *hash = data_storage_hash(type, &value, sizeof(value));
+        }
+        return err;
+    }
+
+    size_t length = 0;
+    esp_err_t err = data_storage_nvs_get_blob(handle, key, NULL, &length);
+    if (err != ESP_OK) {
+        return err;
+    }
+    uint8_t *data = malloc(length ? length : 1);
+    if (data == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    err = data_storage_nvs_get_blob(handle, key, data, &length);
+    if (err == ESP_OK) {
+        *hash = data_storage_hash(type, data, length);
+    }
+    free(data);
+    return err;
+}
+
+/**
+ * Write every dirty entry and commit each touched namespace once. Called with the lock held.
+ * Entries that fail stay dirty and are retried on the next flush.
+ */
+static esp_err_t data_storage_flush_locked(void) {
+    esp_err_t result = ESP_OK;
+    component.flush_posted = false;
+    bool touched[DATA_STORAGE_MAX_NAMESPACES] = {false};
+
+    for (size_t i = 0; i < DATA_STORAGE_CACHE_ENTRIES; i++) {
+        entry_t *entry = &component.entries[i];
+        if (!entry->used || !entry->dirty) {
+            continue;
+        }
+
+        nvs_handle_t handle = component.namespaces[entry->namespace_index].handle;
+        uint32_t stored;
+        esp_err_t err = ESP_OK;
+        if (entry->compare && data_storage_stored_hash(handle, entry->key, entry->type, &stored) == ESP_OK &&
+            stored == entry->hash) {
+            // First write of the key since it entered the cache and equal to flash, a read
+            // instead of an erase
+            component.stats.writes_skipped++;
+        } else {
+            if (entry->type == ENTRY_I32) {
+                err = data_storage_nvs_set_i32(handle, entry->key, entry->i32);
+            } else {
+                err = data_storage_nvs_set_blob(handle, entry->key, entry->data, entry->length);
+            }
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Cannot write %s: %s", entry->key, esp_err_to_name(err));
+                result = result == ESP_OK ? err : result;
+                continue;
+            }
+            touched[entry->namespace_index] = true;
+        }
+        entry->compare = false;
+
+        // What was just written stays readable from RAM while the budget allows
+        entry->dirty = false;
+        entry->cached = true;
+        if (entry->data != NULL) {
+            uint8_t *data = entry->data;
+            component.staged_bytes -= entry->length;
+            entry->data = NULL;
+            entry->cached = false;
+            data_storage_entry_cache_blob(entry, data, entry->length);
+            free(data);
+        }
+    }
+
+    for (size_t i = 0; i < component.namespace_count; i++) {
+        if (touched[i]) {
+            esp_err_t err = data_storage_nvs_commit(component.namespaces[i].handle);
+            result = result == ESP_OK ? err : result;
+        }
+    }
+    return result;
+}
+
+static void data_storage_commit_timer_cb(TimerHandle_t timer) {
+    // The timer task must not stall on flash, the worker does the writing
+    request_t request = {.type = REQUEST_COMMIT_DUE};
+    if (xQueueSend(component.queue, &request, 0) != pdTRUE) {
+        xTimerReset(timer, 0);
+    }
+}
+
+static void data_storage_worker_task(void *arg) {
+    request_t request;
+    bool commit_due = false;
+    TickType_t due_since = 0;
+
+    for (;;) {
+        TickType_t wait = portMAX_DELAY;
+        if (commit_due) {
+            TickType_t now = xTaskGetTickCount();
+            TickType_t held = component.hold_until - now;
+            TickType_t waited = now - due_since;
+            if ((int32_t) held <= 0 || waited >= pdMS_TO_TICKS(DATA_STORAGE_HOLD_MAX_MS)) {
+                data_storage_flush();
+                commit_due = false;
+                continue;
+            }
+            wait = held < pdMS_TO_TICKS(DATA_STORAGE_HOLD_MAX_MS) - waited
+                   ? held : pdMS_TO_TICKS(DATA_STORAGE_HOLD_MAX_MS) - waited;
+        }
+        if (xQueueReceive(component.queue, &request, wait) != pdTRUE) {
+            continue;
+        }
+
+        esp_err_t err = ESP_OK;
+        switch (request.type) {
+            case REQUEST_WRITE:
+                err = data_storage_write(request.namespace_name, request.key, request.data, request.length);
+                free(request.data);
+                break;
+            case REQUEST_WRITE_I32:
+                err = data_storage_write_i32(request.namespace_name, request.key, request.i32);
+                break;
+            case REQUEST_FLUSH:
+                err = data_storage_flush();
+                commit_due = false;
+                break;
+            case REQUEST_COMMIT_DUE:
+                if (!commit_due) {
+                    commit_due = true;
+                    due_since = xTaskGetTickCount();
+                }
+                break;
+            case REQUEST_JOB:
+                request.job(request.arg);
+                break;
+            case REQUEST_STOP:
+                // Everything queued before has been handled, arg is the waiting deinit
+                xTaskNotifyGive((TaskHandle_t) request.arg);
+                vTaskDelete(NULL);
+                return;
+        }
+        if (request.done != NULL) {
+            request.done(err, request.arg);
+        }
+    }
+}
+
+static esp_err_t data_storage_post(request_t *request) {
+    if (component.queue == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (xQueueSend(component.queue, request, 0) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t data_storage_post_write(request_t *request, const char *namespace_name, const char *key) {
+    if (namespace_name == NULL || strlen(namespace_name) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    strcpy(request->namespace_name, namespace_name);
+    strcpy(request->key, key);
+    return data_storage_post(request);
+}
+
+static void data_storage_shutdown_handler(void) {
+    data_storage_flush();
+}
+
+/**
+ * Get the staged writes to flash without blocking the caller on it: in place when called by
+ * the worker, else by a flush request to the worker. Called with the lock held.
+ */
+static esp_err_t data_storage_flush_soon(void) {
+    if (xTaskGetCurrentTaskHandle() == component.worker) {
+        return data_storage_flush_locked();
+    }
+    if (component.flush_posted) {
+        return ESP_OK;
+    }
+    request_t request = {.type = REQUEST_FLUSH};
+    if (data_storage_post(&request) == ESP_OK) {
+        component.flush_posted = true;
+    } else {
+        // Queue full, the commit timer posts again until it gets through
+        xTimerChangePeriod(component.commit_timer, 1, 0);
+    }
+    return ESP_OK;
+}
+
+/**
+ * Whether another key could be staged, i.e. some slot is free or clean and unpinned.
+ */
+static bool data_storage_entry_available(void) {
+    for (size_t i = 0; i < DATA_STORAGE_CACHE_ENTRIES; i++) {
+        const entry_t *entry = &component.entries[i];
+        if (!entry->used || (!entry->dirty && !entry->pinned)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Stage a value for the next flush unless it equals what the cache knows is stored. Called with
+ * the lock held, never touches flash outside the worker: a key the cache has not seen yet is
+ * compared against flash by the flush, and flushes forced by a full cache or a zero commit
+ * delay are handed to the worker.
+ */
+static esp_err_t data_storage_stage(const char *namespace_name, const char *key, entry_type_t type,
+                                    const void *data, size_t length) {
+    uint8_t index;
+    esp_err_t err = data_storage_namespace(namespace_name, &index);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+
+    uint32_t hash = data_storage_hash(type, data, length);
+    entry_t *entry = data_storage_entry_find(index, key);
+    if (entry != NULL && entry->type == type && entry->hash == hash && (entry->dirty || !entry->compare)) {
+        component.stats.writes_skipped++;
+        return ESP_OK;
+    }
+    if (entry == NULL) {
+        entry = data_storage_entry_alloc(index, key, type);
+        if (entry == NULL && xTaskGetCurrentTaskHandle() == component.worker) {
+            err = data_storage_flush_locked();
+            if (err != ESP_OK) {
+                return err;
+            }
+            entry = data_storage_entry_alloc(index, key, type);
+        }
+        if (entry == NULL) {
+            // Every slot holds a pending write, the caller may retry once the worker wrote them
+            data_storage_flush_soon();
+            return ESP_ERR_NO_MEM;
+        }
+        entry->compare = true;
+    }
+
+    uint8_t *copy = NULL;
+    if (type == ENTRY_BLOB) {
+        copy = malloc(length ? length : 1);
+        if (copy == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        memcpy(copy, data, length);
+    }
+    data_storage_entry_release(entry);
+    entry->type = type;
+    entry->hash = hash;
+    entry->length = length;
+    entry->dirty = true;
+    component.stats.staged++;
+    if (type == ENTRY_I32) {
+        memcpy(&entry->i32, data, sizeof(int32_t));
+    } else {
+        entry->data = copy;
+        component.staged_bytes += length;
+    }
+
+    if (component.commit_delay_ms == 0 || component.staged_bytes > DATA_STORAGE_STAGED_BYTES_MAX ||
+        !data_storage_entry_available()) {
+        return data_storage_flush_soon();
+    }
+    if (xTimerIsTimerActive(component.commit_timer) == pdFALSE) {
+        xTimerChangePeriod(component.commit_timer, pdMS_TO_TICKS(component.commit_delay_ms), 0);
+    }
+    return ESP_OK;
+}
+
+/**
+ * Look a key up for a read. On ESP_OK the value is in RAM, ESP_ERR_NOT_FOUND means it has to
+ * come from flash; entry is then the key's slot if it has one, to be filled after the read.
+ */
+static esp_err_t data_storage_lookup(const char *namespace_name, const char *key, entry_type_t type,
+                                     uint8_t *index, entry_t **entry) {
+    esp_err_t err = data_storage_namespace(namespace_name, index);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+
+    *entry = data_storage_entry_find(*index, key);
+    if (*entry != NULL && (*entry)->dirty && (*entry)->type != type) {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+    if (*entry != NULL && ((*entry)->dirty || (*entry)->cached) && (*entry)->type == type) {
+        component.stats.cache.hits++;
+        return ESP_OK;
+    }
+    component.stats.cache.misses++;
+    return ESP_ERR_NOT_FOUND;
+}
+
+/**
+ * Slot for a value just read from flash: the key's own, or a new one when the cache has room.
+ */
+static entry_t *data_storage_fill_slot(entry_t *entry, uint8_t index, const char *key, entry_type_t type) {
+    if (entry == NULL) {
+        entry = data_storage_entry_alloc(index, key, type);
+    }
+    if (entry != NULL) {
+        data_storage_entry_release(entry);
+        entry->type = type;
+        entry->compare = false;
+    }
+    return entry;
+}
 
 //MARK: Public functions
 esp_err_t data_storage_init() {
+    if (component.lock == NULL) {
+        component.lock = xSemaphoreCreateMutex();
+        component.commit_timer = xTimerCreate("storage_commit", pdMS_TO_TICKS(DATA_STORAGE_COMMIT_DELAY_DEFAULT_MS),
+                                              pdFALSE, NULL, data_storage_commit_timer_cb);
+        component.queue = xQueueCreate(DATA_STORAGE_QUEUE_LENGTH, sizeof(request_t));
+        if (component.lock == NULL || component.commit_timer == NULL || component.queue == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        if (xTaskCreate(data_storage_worker_task, "storage_worker", DATA_STORAGE_WORKER_STACK_SIZE, NULL,
+                        DATA_STORAGE_WORKER_PRIORITY, &component.worker) != pdPASS) {
+            return ESP_ERR_NO_MEM;
+        }
+        esp_register_shutdown_handler(data_storage_shutdown_handler);
+    }
+
     esp_err_t ret = nvs_flash_init();
 
     if (ret != ESP_ERR_NVS_NO_FREE_PAGES && ret != ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -40,115 +834,800 @@ esp_err_t data_storage_init() {
     return ret;
 }
 
-esp_err_t data_storage_write(const char *key, const uint8_t *data, size_t length) {
-    nvs_handle_t my_handle;
-    esp_err_t err;
+esp_err_t data_storage_deinit() {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
 
-    err = nvs_open("storage", NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) {
-        return err;
+    // Let the worker finish what is queued, the commit timer cannot post after this
+    xTimerStop(component.commit_timer, portMAX_DELAY);
+    request_t stop = {.type = REQUEST_STOP, .arg = xTaskGetCurrentTaskHandle()};
+    xQueueSend(component.queue, &stop, portMAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    vQueueDelete(component.queue);
+    component.queue = NULL;
+    component.worker = NULL;
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    esp_err_t err = data_storage_flush_locked();
+    for (size_t i = 0; i < DATA_STORAGE_CACHE_ENTRIES; i++) {
+        data_storage_entry_release(&component.entries[i]);
+        component.entries[i].used = false;
+        component.entries[i].pinned = false;
+        component.entries[i].pool = NULL;
     }
+    component.pinned_count = 0;
+    memset(component.pinned_pool_used, 0, sizeof(component.pinned_pool_used));
+    for (size_t i = 0; i < component.namespace_count; i++) {
+        nvs_close(component.namespaces[i].handle);
+    }
+    component.namespace_count = 0;
+    xSemaphoreGive(component.lock);
+
+    esp_unregister_shutdown_handler(data_storage_shutdown_handler);
+    xTimerDelete(component.commit_timer, portMAX_DELAY);
+    vSemaphoreDelete(component.lock);
+    component.commit_timer = NULL;
+    component.lock = NULL;
+    return err;
+}
 
+esp_err_t data_storage_write(const char *namespace_name, const char *key, const uint8_t *data, size_t length) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    esp_err_t err = data_storage_stage(namespace_name, key, ENTRY_BLOB, data, length);
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+esp_err_t data_storage_read_alloc(const char *namespace_name, const char *key, uint8_t **out_data, size_t *length) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    uint8_t index;
+    entry_t *entry;
     size_t required_size = 0;
-    err = nvs_get_blob(my_handle, key, NULL, &required_size);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+    esp_err_t err = data_storage_lookup(namespace_name, key, ENTRY_BLOB, &index, &entry);
+    bool hit = err == ESP_OK;
+    if (hit) {
+        required_size = entry->length;
+    } else if (err == ESP_ERR_NOT_FOUND) {
+        err = data_storage_nvs_get_blob(component.namespaces[index].handle, key, NULL, &required_size);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            required_size = 0;
+            err = ESP_OK;
+        }
+    }
+    if (err != ESP_OK || required_size == 0) {
+        xSemaphoreGive(component.lock);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "Nothing saved yet!");
+            *length = 0;
+        }
         return err;
     }
 
-    err = nvs_set_blob(my_handle, key, data, length);
+    uint8_t *data = malloc(required_size);
+    if (data == NULL) {
+        err = ESP_ERR_NO_MEM;
+    } else if (hit) {
+        memcpy(data, entry->data, required_size);
+    } else {
+        err = data_storage_nvs_get_blob(component.namespaces[index].handle, key, data, &required_size);
+        if (err == ESP_OK) {
+            entry = data_storage_fill_slot(entry, index, key, ENTRY_BLOB);
+            if (entry != NULL) {
+                entry->hash = data_storage_hash(ENTRY_BLOB, data, required_size);
+                data_storage_entry_cache_blob(entry, data, required_size);
+            }
+        }
+    }
+    xSemaphoreGive(component.lock);
 
     if (err != ESP_OK) {
+        free(data);
         return err;
     }
+    *length = required_size;
+    *out_data = data;
+    return ESP_OK;
+}
 
-    // Commit
-    err = nvs_commit(my_handle);
-    if (err != ESP_OK) {
-        return err;
+esp_err_t data_storage_read_into(const char *namespace_name, const char *key, uint8_t *data, size_t *length) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (length == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    uint8_t index;
+    entry_t *entry;
+    esp_err_t err = data_storage_lookup(namespace_name, key, ENTRY_BLOB, &index, &entry);
+    if (err == ESP_OK) {
+        if (data != NULL && *length < entry->length) {
+            err = ESP_ERR_NVS_INVALID_LENGTH;
+        } else if (data != NULL) {
+            memcpy(data, entry->data, entry->length);
+        }
+        *length = entry->length;
+    } else if (err == ESP_ERR_NOT_FOUND) {
+        err = data_storage_nvs_get_blob(component.namespaces[index].handle, key, data, length);
+        // Straight into the caller's buffer, the copy kept for the next read goes to the pool
+        if (err == ESP_OK && data != NULL && entry != NULL && entry->pinned && *length <= DATA_STORAGE_PINNED_VALUE_MAX) {
+            entry = data_storage_fill_slot(entry, index, key, ENTRY_BLOB);
+            entry->hash = data_storage_hash(ENTRY_BLOB, data, *length);
+            data_storage_entry_cache_blob(entry, data, *length);
+        }
+    }
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+extern esp_err_t data_storage_write_i32(const char *namespace_name, const char *key, int32_t value) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    esp_err_t err = data_storage_stage(namespace_name, key, ENTRY_I32, &value, sizeof(value));
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+extern esp_err_t data_storage_read_i32(const char *namespace_name, const char *key, int32_t *value) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    uint8_t index;
+    entry_t *entry;
+    esp_err_t err = data_storage_lookup(namespace_name, key, ENTRY_I32, &index, &entry);
+    if (err == ESP_OK) {
+        *value = entry->i32;
+    } else if (err == ESP_ERR_NOT_FOUND) {
+        err = data_storage_nvs_get_i32(component.namespaces[index].handle, key, value);
+        if (err == ESP_OK) {
+            entry = data_storage_fill_slot(entry, index, key, ENTRY_I32);
+            if (entry != NULL) {
+                entry->hash = data_storage_hash(ENTRY_I32, value, sizeof(int32_t));
+                entry->i32 = *value;
+                entry->cached = true;
+            }
+        }
+    }
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+extern esp_err_t data_storage_erase(const char *namespace_name, const char *key) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    uint8_t index;
+    esp_err_t err = data_storage_namespace(namespace_name, &index);
+    if (err == ESP_OK) {
+        // A staged value would bring the key back with the next flush
+        entry_t *entry = data_storage_entry_find(index, key);
+        if (entry != NULL) {
+            if (entry->dirty) {
+                data_storage_flush_locked();
+            }
+            data_storage_entry_release(entry);
+            entry->used = entry->pinned;
+        }
+        nvs_handle_t handle = component.namespaces[index].handle;
+        err = data_storage_nvs_erase_key(handle, key);
+        if (err == ESP_OK) {
+            err = data_storage_nvs_commit(handle);
+        } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+extern esp_err_t data_storage_flush() {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
     }
 
-    // Close
-    nvs_close(my_handle);
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    esp_err_t err = data_storage_flush_locked();
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+extern esp_err_t data_storage_set_commit_delay(uint32_t delay_ms) {
+    component.commit_delay_ms = delay_ms;
+    if (delay_ms == 0) {
+        return data_storage_flush();
+    }
     return ESP_OK;
 }
 
-esp_err_t data_storage_read_alloc(const char *key, uint8_t **out_data, size_t *length) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
+extern esp_err_t data_storage_write_async(const char *namespace_name, const char *key, const uint8_t *data,
+                                          size_t length, data_storage_done_cb_t done, void *arg) {
+    request_t request = {.type = REQUEST_WRITE, .length = length, .done = done, .arg = arg};
 
-    err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
+    request.data = malloc(length ? length : 1);
+    if (request.data == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(request.data, data, length);
+    esp_err_t err = data_storage_post_write(&request, namespace_name, key);
     if (err != ESP_OK) {
-        return err;
+        free(request.data);
     }
+    return err;
+}
 
-    size_t required_size = 0;
-    err = nvs_get_blob(nvs_handle, key, NULL, &required_size);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        return err;
+extern esp_err_t data_storage_write_i32_async(const char *namespace_name, const char *key, int32_t value,
+                                              data_storage_done_cb_t done, void *arg) {
+    request_t request = {.type = REQUEST_WRITE_I32, .i32 = value, .done = done, .arg = arg};
+    return data_storage_post_write(&request, namespace_name, key);
+}
+
+extern esp_err_t data_storage_flush_async(data_storage_done_cb_t done, void *arg) {
+    request_t request = {.type = REQUEST_FLUSH, .done = done, .arg = arg};
+    return data_storage_post(&request);
+}
+
+extern esp_err_t data_storage_run_async(data_storage_job_t job, void *arg) {
+    if (job == NULL) {
+        return ESP_ERR_INVALID_ARG;
     }
-    if (required_size == 0) {
-        ESP_LOGI(__FILE__, "Nothing saved yet!");
-        *length = 0;
-    } else {
-        uint8_t *data = malloc(required_size);
-        err = nvs_get_blob(nvs_handle, key, data, &required_size);
-        if (err != ESP_OK) {
-            free(data);
-            nvs_close(nvs_handle);
-            return err;
+    request_t request = {.type = REQUEST_JOB, .job = job, .arg = arg};
+    return data_storage_post(&request);
+}
+
+extern void data_storage_hold_commits(uint32_t hold_ms) {
+    TickType_t until = xTaskGetTickCount() + pdMS_TO_TICKS(hold_ms);
+    if ((int32_t) (until - component.hold_until) > 0) {
+        component.hold_until = until;
+    }
+}
+
+extern esp_err_t data_storage_pin(const char *namespace_name, const char *key) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    uint8_t index;
+    esp_err_t err = data_storage_namespace(namespace_name, &index);
+    entry_t *entry = NULL;
+    if (err == ESP_OK) {
+        entry = data_storage_entry_find(index, key);
+        if (entry == NULL || !entry->pinned) {
+            if (component.pinned_count >= DATA_STORAGE_CACHE_ENTRIES / 2) {
+                err = ESP_ERR_NO_MEM;
+            } else if (entry == NULL) {
+                // Type is settled by the first read or write
+                entry = data_storage_entry_alloc(index, key, ENTRY_BLOB);
+                err = entry == NULL ? ESP_ERR_NO_MEM : ESP_OK;
+                if (entry != NULL) {
+                    entry->compare = true;
+                }
+            }
+        }
+    }
+    if (err == ESP_OK && !entry->pinned) {
+        size_t slot = 0;
+        while (component.pinned_pool_used[slot]) {
+            slot++;
+        }
+        component.pinned_pool_used[slot] = true;
+        // A clean value already cached moves to the pool on its next load
+        entry->pool = component.pinned_pool[slot];
+        entry->pinned = true;
+        component.pinned_count++;
+    }
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+extern esp_err_t data_storage_unpin(const char *namespace_name, const char *key) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    uint8_t index;
+    esp_err_t err = data_storage_namespace(namespace_name, &index);
+    if (err == ESP_OK) {
+        entry_t *entry = data_storage_entry_find(index, key);
+        if (entry == NULL || !entry->pinned) {
+            err = ESP_ERR_NOT_FOUND;
+        } else {
+            if (entry->data == entry->pool) {
+                data_storage_entry_release(entry);
+            }
+            component.pinned_pool_used[(entry->pool - component.pinned_pool[0]) / DATA_STORAGE_PINNED_VALUE_MAX] = false;
+            entry->pool = NULL;
+            entry->pinned = false;
+            component.pinned_count--;
         }
+    }
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+extern esp_err_t data_storage_get_stats(data_storage_stats_t *stats) {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    nvs_stats_t nvs_stats;
+    esp_err_t err = nvs_get_stats(NULL, &nvs_stats);
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    *stats = component.stats;
+    xSemaphoreGive(component.lock);
+    if (err == ESP_OK) {
+        stats->used_entries = nvs_stats.used_entries;
+        stats->free_entries = nvs_stats.free_entries;
+    }
+    return err;
+}
 
-        *length = required_size;
-        *out_data = data;
+extern esp_err_t data_storage_reset_stats() {
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
     }
 
-    // Close
-    nvs_close(nvs_handle);
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    memset(&component.stats, 0, sizeof(data_storage_stats_t));
+    xSemaphoreGive(component.lock);
     return ESP_OK;
 }
 
-extern esp_err_t data_storage_write_i32(const char *key, int32_t value) {
-    esp_err_t err;
-    nvs_handle_t nvs_handle;
+static void data_storage_stream_chunk_key(const data_storage_stream_t *stream, char generation, uint16_t index,
+                                          char *key) {
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "%.*s.%c%x", DATA_STORAGE_STREAM_KEY_MAX, stream->key, generation,
+             (unsigned) (index % DATA_STORAGE_STREAM_MAX_CHUNKS));
+}
 
-    err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
+/**
+ * Pick up the namespace handle of a stream and get any staged or cached value of its header key
+ * out of the way. Called with the lock held.
+ */
+static esp_err_t data_storage_stream_handle(const data_storage_stream_t *stream, nvs_handle_t *handle) {
+    uint8_t index;
+    esp_err_t err = data_storage_namespace(stream->namespace_name, &index);
     if (err != ESP_OK) {
         return err;
     }
+    entry_t *entry = data_storage_entry_find(index, stream->key);
+    if (entry != NULL) {
+        if (entry->dirty) {
+            data_storage_flush_locked();
+        }
+        data_storage_entry_release(entry);
+        entry->used = entry->pinned;
+    }
+    *handle = component.namespaces[index].handle;
+    return ESP_OK;
+}
+
+static esp_err_t data_storage_stream_open(data_storage_stream_t *stream, const char *namespace_name,
+                                          const char *key, bool writing, stream_header_t *header) {
+    if (stream == NULL || namespace_name == NULL || strlen(namespace_name) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (key == NULL || strlen(key) > DATA_STORAGE_STREAM_KEY_MAX) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memset(stream, 0, sizeof(data_storage_stream_t));
+    strcpy(stream->namespace_name, namespace_name);
+    strcpy(stream->key, key);
+    stream->writing = writing;
+    stream->chunk_index = DATA_STORAGE_STREAM_NO_CHUNK;
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    nvs_handle_t handle;
+    esp_err_t err = data_storage_stream_handle(stream, &handle);
+    if (err == ESP_OK) {
+        size_t length = sizeof(stream_header_t);
+        err = data_storage_nvs_get_blob(handle, key, header, &length);
+        if (err == ESP_OK && (length != sizeof(stream_header_t) || header->chunk_size != DATA_STORAGE_CHUNK_SIZE)) {
+            err = ESP_ERR_INVALID_SIZE;
+        }
+    }
+    xSemaphoreGive(component.lock);
+    return err;
+}
+
+/**
+ * Erase the chunks of a generation from first on: all below known, then on until one is
+ * missing. Writers store chunks in order, so one cut short leaves a run of them behind that no
+ * header describes. Returns the number erased. Called with the lock held.
+ */
+static uint16_t data_storage_stream_erase_chunks(const data_storage_stream_t *stream, nvs_handle_t handle,
+                                                 char generation, uint16_t first, uint16_t known) {
+    uint16_t erased = 0;
+    for (uint16_t i = first; i < DATA_STORAGE_STREAM_MAX_CHUNKS; i++) {
+        char chunk_key[NVS_KEY_NAME_MAX_SIZE];
+        data_storage_stream_chunk_key(stream, generation, i, chunk_key);
+        esp_err_t err = data_storage_nvs_erase_key(handle, chunk_key);
+        if (err == ESP_OK) {
+            erased++;
+        } else if (i >= known) {
+            break;
+        }
+    }
+    return erased;
+}
+
+static esp_err_t data_storage_stream_put_chunk(data_storage_stream_t *stream) {
+    uint16_t index = (stream->offset - stream->chunk_fill) / DATA_STORAGE_CHUNK_SIZE;
+    char chunk_key[NVS_KEY_NAME_MAX_SIZE];
+    data_storage_stream_chunk_key(stream, stream->generation, index, chunk_key);
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    nvs_handle_t handle;
+    esp_err_t err = data_storage_stream_handle(stream, &handle);
+    if (err == ESP_OK) {
+        err = data_storage_nvs_set_blob(handle, chunk_key, stream->chunk, stream->chunk_fill);
+    }
+    xSemaphoreGive(component.lock);
+
+    stream->chunk_fill = 0;
+    return err;
+}
+
+extern esp_err_t data_storage_stream_open_write(data_storage_stream_t *stream, const char *namespace_name,
+                                                const char *key) {
+    stream_header_t header;
+    esp_err_t err = data_storage_stream_open(stream, namespace_name, key, true, &header);
+    if (err == ESP_OK) {
+        stream->generation = header.generation == 'a' ? 'b' : 'a';
+        stream->old_chunks = header.chunks;
+    } else if (err == ESP_ERR_NVS_NOT_FOUND || err == ESP_ERR_INVALID_SIZE) {
+        stream->generation = 'a';
+        stream->old_chunks = 0;
+        err = ESP_OK;
+    }
+    return err;
+}
+
+extern esp_err_t data_storage_stream_open_read(data_storage_stream_t *stream, const char *namespace_name,
+                                               const char *key) {
+    stream_header_t header;
+    esp_err_t err = data_storage_stream_open(stream, namespace_name, key, false, &header);
+    if (err == ESP_OK) {
+        stream->generation = header.generation;
+        stream->length = header.length;
+    }
+    return err;
+}
+
+extern esp_err_t data_storage_stream_write(data_storage_stream_t *stream, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+
+    if (stream == NULL || !stream->writing) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ((uint64_t) stream->offset + length > (uint64_t) DATA_STORAGE_STREAM_MAX_CHUNKS * DATA_STORAGE_CHUNK_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    while (length > 0) {
+        size_t part = DATA_STORAGE_CHUNK_SIZE - stream->chunk_fill;
+        if (part > length) {
+            part = length;
+        }
+        memcpy(&stream->chunk[stream->chunk_fill], bytes, part);
+        stream->chunk_fill += part;
+        stream->offset += part;
+        bytes += part;
+        length -= part;
+
+        if (stream->chunk_fill == DATA_STORAGE_CHUNK_SIZE) {
+            esp_err_t err = data_storage_stream_put_chunk(stream);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+extern esp_err_t data_storage_stream_read(data_storage_stream_t *stream, void *data, size_t length,
+                                          size_t *read_length) {
+    uint8_t *bytes = data;
+
+    if (stream == NULL || stream->writing || read_length == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    *read_length = 0;
+    while (length > 0 && stream->offset < stream->length) {
+        uint16_t index = stream->offset / DATA_STORAGE_CHUNK_SIZE;
+        uint32_t chunk_start = (uint32_t) index * DATA_STORAGE_CHUNK_SIZE;
+        if (index != stream->chunk_index) {
+            char chunk_key[NVS_KEY_NAME_MAX_SIZE];
+            size_t expected_length = stream->length - chunk_start;
+            if (expected_length > DATA_STORAGE_CHUNK_SIZE) {
+                expected_length = DATA_STORAGE_CHUNK_SIZE;
+            }
+            size_t chunk_length = expected_length;
+            data_storage_stream_chunk_key(stream, stream->generation, index, chunk_key);
+
+            xSemaphoreTake(component.lock, portMAX_DELAY);
+            nvs_handle_t handle;
+            esp_err_t err = data_storage_stream_handle(stream, &handle);
+            if (err == ESP_OK) {
+                err = data_storage_nvs_get_blob(handle, chunk_key, stream->chunk, &chunk_length);
+            }
+            xSemaphoreGive(component.lock);
+            // A short chunk would stall the loop below, so it fails the read like a corrupt header
+            if (err == ESP_OK && chunk_length != expected_length) {
+                err = ESP_ERR_INVALID_SIZE;
+            }
+            if (err != ESP_OK) {
+                stream->chunk_index = DATA_STORAGE_STREAM_NO_CHUNK;
+                return err;
+            }
+            stream->chunk_index = index;
+            stream->chunk_fill = chunk_length;
+        }
+
+        size_t part = chunk_start + stream->chunk_fill - stream->offset;
+        if (part > length) {
+            part = length;
+        }
+        memcpy(bytes, &stream->chunk[stream->offset - chunk_start], part);
+        stream->offset += part;
+        *read_length += part;
+        bytes += part;
+        length -= part;
+    }
+    return ESP_OK;
+}
+
+extern size_t data_storage_stream_length(const data_storage_stream_t *stream) {
+    return stream->writing ? stream->offset : stream->length;
+}
+
+extern esp_err_t data_storage_stream_close(data_storage_stream_t *stream) {
+    if (stream == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!stream->writing) {
+        stream->key[0] = '\0';
+        return ESP_OK;
+    }
 
-    err = nvs_set_i32(nvs_handle, key, value);
+    esp_err_t err = ESP_OK;
+    if (stream->chunk_fill > 0) {
+        err = data_storage_stream_put_chunk(stream);
+    }
+    stream->writing = false;
     if (err != ESP_OK) {
-        nvs_close(nvs_handle);
         return err;
     }
 
-    err = nvs_commit(nvs_handle);
+    stream_header_t header = {
+            .length = stream->offset,
+            .chunk_size = DATA_STORAGE_CHUNK_SIZE,
+            .chunks = (stream->offset + DATA_STORAGE_CHUNK_SIZE - 1) / DATA_STORAGE_CHUNK_SIZE,
+            .generation = stream->generation,
+    };
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    nvs_handle_t handle;
+    err = data_storage_stream_handle(stream, &handle);
+    if (err == ESP_OK) {
+        err = data_storage_nvs_set_blob(handle, stream->key, &header, sizeof(header));
+    }
+    if (err == ESP_OK) {
+        err = data_storage_nvs_commit(handle);
+    }
+    if (err == ESP_OK) {
+        // The old object is unreachable now, give its chunks back, along with any that an
+        // interrupted writer left in either generation
+        char old_generation = stream->generation == 'a' ? 'b' : 'a';
+        uint16_t erased = data_storage_stream_erase_chunks(stream, handle, old_generation, 0, stream->old_chunks);
+        erased += data_storage_stream_erase_chunks(stream, handle, stream->generation, header.chunks, header.chunks);
+        if (erased > 0) {
+            data_storage_nvs_commit(handle);
+        }
+    }
+    xSemaphoreGive(component.lock);
+
+    stream->key[0] = '\0';
+    return err;
+}
+
+//MARK: Batches
+static esp_err_t data_storage_batch_add(data_storage_batch_t *batch, const char *key, entry_type_t type,
+                                        const void *data, size_t length) {
+    if (batch == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = ESP_OK;
+    size_t key_length = key == NULL ? 0 : strlen(key);
+    if (key_length == 0 || key_length >= NVS_KEY_NAME_MAX_SIZE) {
+        err = ESP_ERR_NVS_KEY_TOO_LONG;
+    } else if (data == NULL && length > 0) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (DATA_STORAGE_BATCH_ITEM_HEADER + key_length + length > DATA_STORAGE_BATCH_BYTES_MAX - batch->length) {
+        err = ESP_ERR_NO_MEM;
+    }
     if (err != ESP_OK) {
-        nvs_close(nvs_handle);
+        batch->err = batch->err == ESP_OK ? err : batch->err;
         return err;
     }
 
-    nvs_close(nvs_handle);
+    uint8_t *item = &batch->data[batch->length];
+    item[0] = type;
+    item[1] = key_length;
+    item[2] = length & 0xFF;
+    item[3] = length >> 8;
+    memcpy(item + DATA_STORAGE_BATCH_ITEM_HEADER, key, key_length);
+    memcpy(item + DATA_STORAGE_BATCH_ITEM_HEADER + key_length, data, length);
+    batch->length += DATA_STORAGE_BATCH_ITEM_HEADER + key_length + length;
+    batch->count++;
+    return ESP_OK;
+}
+
+/**
+ * Whether a batch value equals the newest one known, from the cache or else from flash.
+ * Called with the lock held.
+ */
+static bool data_storage_batch_item_same(uint8_t index, const batch_item_t *item) {
+    uint32_t hash = data_storage_hash(item->type, item->data, item->length);
+    entry_t *entry = data_storage_entry_find(index, item->key);
+    if (entry != NULL && entry->type == item->type && (entry->dirty || !entry->compare)) {
+        return entry->hash == hash;
+    }
+    uint32_t stored;
+    return (entry == NULL || entry->compare) &&
+           data_storage_stored_hash(component.namespaces[index].handle, item->key, item->type, &stored) == ESP_OK &&
+           stored == hash;
+}
 
+/**
+ * Make the cache agree with a batch just committed. Values staged earlier for the same keys
+ * would overwrite it on the next flush and are dropped. After a failed commit flash may hold
+ * any mix, the keys are then forgotten, or for pinned ones reloaded on the next read.
+ */
+static void data_storage_batch_cache(uint8_t index, const data_storage_batch_t *batch, bool committed) {
+    batch_item_t item;
+    size_t offset = 0;
+    while (data_storage_batch_item(batch->data, batch->length, &offset, &item)) {
+        entry_t *entry = data_storage_entry_find(index, item.key);
+        if (entry == NULL && committed) {
+            // Known from now on, so that the next batch compares against RAM
+            entry = data_storage_entry_alloc(index, item.key, item.type);
+        }
+        if (entry == NULL) {
+            continue;
+        }
+        data_storage_entry_release(entry);
+        if (!committed) {
+            entry->used = entry->pinned;
+            if (entry->pinned) {
+                data_storage_stored_hash(component.namespaces[index].handle, entry->key, entry->type, &entry->hash);
+            }
+            continue;
+        }
+        entry->type = item.type;
+        entry->hash = data_storage_hash(item.type, item.data, item.length);
+        if (item.type == ENTRY_I32) {
+            memcpy(&entry->i32, item.data, sizeof(int32_t));
+            entry->length = sizeof(int32_t);
+            entry->cached = true;
+        } else {
+            data_storage_entry_cache_blob(entry, item.data, item.length);
+        }
+    }
+}
+
+extern esp_err_t data_storage_batch_begin(data_storage_batch_t *batch, const char *namespace_name) {
+    if (batch == NULL || namespace_name == NULL || strlen(namespace_name) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    batch->err = ESP_OK;
+    batch->atomic = true;
+    batch->count = 0;
+    batch->length = 0;
+    strcpy(batch->namespace_name, namespace_name);
     return ESP_OK;
 }
 
-extern esp_err_t data_storage_read_i32(const char *key, int32_t *value) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
+extern esp_err_t data_storage_batch_begin_unlogged(data_storage_batch_t *batch, const char *namespace_name) {
+    esp_err_t err = data_storage_batch_begin(batch, namespace_name);
+    if (err == ESP_OK) {
+        batch->atomic = false;
+    }
+    return err;
+}
 
-    err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        return err;
+extern esp_err_t data_storage_batch_set(data_storage_batch_t *batch, const char *key, const uint8_t *data,
+                                        size_t length) {
+    return data_storage_batch_add(batch, key, ENTRY_BLOB, data, length);
+}
+
+extern esp_err_t data_storage_batch_set_i32(data_storage_batch_t *batch, const char *key, int32_t value) {
+    return data_storage_batch_add(batch, key, ENTRY_I32, &value, sizeof(int32_t));
+}
+
+extern esp_err_t data_storage_batch_commit(data_storage_batch_t *batch) {
+    if (batch == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (component.lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (batch->err != ESP_OK || batch->count == 0) {
+        return batch->err;
     }
 
-    err = nvs_get_i32(nvs_handle, key, value);
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    uint8_t index;
+    esp_err_t err = data_storage_namespace(batch->namespace_name, &index);
     if (err != ESP_OK) {
-        nvs_close(nvs_handle);
+        xSemaphoreGive(component.lock);
         return err;
     }
 
-    // Close
-    nvs_close(nvs_handle);
-    return ESP_OK;
-}
\ No newline at end of file
+    bool changed = false;
+    batch_item_t item;
+    size_t offset = 0;
+    while (!changed && data_storage_batch_item(batch->data, batch->length, &offset, &item)) {
+        changed = !data_storage_batch_item_same(index, &item);
+    }
+    if (!changed) {
+        component.stats.writes_skipped += batch->count;
+        xSemaphoreGive(component.lock);
+        return ESP_OK;
+    }
+
+    // A single value is atomic on its own, more need the copy to roll forward from
+    nvs_handle_t handle = component.namespaces[index].handle;
+    bool logged = batch->atomic && batch->count > 1;
+    if (logged) {
+        err = data_storage_nvs_set_blob(handle, DATA_STORAGE_BATCH_KEY, batch->data, batch->length);
+    }
+    if (err == ESP_OK) {
+        err = data_storage_batch_apply(handle, batch->data, batch->length);
+    }
+    if (err == ESP_OK && logged) {
+        err = data_storage_nvs_erase_key(handle, DATA_STORAGE_BATCH_KEY);
+    }
+    if (err == ESP_OK) {
+        err = data_storage_nvs_commit(handle);
+    }
+    data_storage_batch_cache(index, batch, err == ESP_OK);
+    if (err != ESP_OK) {
+        // Whatever got written is finished or dropped when the namespace is next opened
+        ESP_LOGE(TAG, "Cannot commit batch in %s: %s", batch->namespace_name, esp_err_to_name(err));
+    }
+    xSemaphoreGive(component.lock);
+    return err;
+}
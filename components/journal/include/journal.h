@@ -0,0 +1,116 @@
+//
+// Append-only usage journal in its own raw flash partition, for field diagnostics: button
+// presses, connections, errors. Kept out of NVS so that a busy device does not wear out the
+// settings partition.
+//
+
+#ifndef BLACK_BRICKS_ESP_BASE_JOURNAL_H
+#define BLACK_BRICKS_ESP_BASE_JOURNAL_H
+
+//MARK: Import common headers
+#include <stdint.h>
+
+#include "esp_err.h"
+
+//MARK: Macros and constants
+// Data partition holding the journal, see partition_table.csv
+#define JOURNAL_PARTITION_LABEL "journal"
+#define JOURNAL_PARTITION_SUBTYPE 0x40
+
+// Records buffered in RAM, and how many of them make a batch that is written straight away
+#ifndef JOURNAL_BUFFER_RECORDS
+#define JOURNAL_BUFFER_RECORDS 32
+#endif
+#ifndef JOURNAL_BATCH_RECORDS
+#define JOURNAL_BATCH_RECORDS 16
+#endif
+
+// Longest time an appended record waits in RAM
+#ifndef JOURNAL_FLUSH_DELAY_MS
+#define JOURNAL_FLUSH_DELAY_MS 10000
+#endif
+
+// Task writing the buffered records, a sector erase takes tens of milliseconds
+#ifndef JOURNAL_TASK_PRIORITY
+#define JOURNAL_TASK_PRIORITY (tskIDLE_PRIORITY + 1)
+#endif
+#define JOURNAL_TASK_STACK_SIZE 3072
+
+// Records fetched from flash per read while iterating
+#define JOURNAL_READ_RECORDS 16
+#define JOURNAL_RECORD_SIZE 16
+
+//MARK: Types
+/**
+ * One journal entry. type and arg are up to the application, 0xFF is reserved.
+ */
+typedef struct {
+    uint32_t sequence;      // Assigned when written, counts up over the life of the partition
+    uint32_t uptime_ms;     // Since the boot that appended the record
+    uint8_t type;
+    uint8_t arg;
+    int32_t value;
+} journal_record_t;
+
+/**
+ * Iterator over the records in flash, usually on the caller's stack. Holds
+ * JOURNAL_READ_RECORDS records, reading out the whole journal needs no more RAM than that.
+ */
+typedef struct {
+    uint32_t sequence;      // Next sequence wanted, older records are skipped
+    uint16_t sector;
+    uint16_t sectors_left;
+    uint16_t slot;          // Next slot to fetch from flash in sector
+    uint16_t fill;
+    uint16_t index;         // Next record to return from buffer
+    uint8_t buffer[JOURNAL_READ_RECORDS * JOURNAL_RECORD_SIZE];
+} journal_reader_t;
+
+typedef struct {
+    uint32_t appended;      // Since boot
+    uint32_t dropped;       // Appends lost because the RAM buffer was full
+    uint32_t written;       // Records written to flash since boot
+    uint32_t write_errors;
+    uint32_t sector_erases; // Since boot
+    uint32_t oldest_sequence;
+    uint32_t next_sequence;
+    uint32_t max_erase_count; // Of any sector over the life of the partition
+    uint16_t sectors;
+} journal_stats_t;
+
+//MARK: Global variables
+
+//MARK: Function prototypes
+/**
+ * Find the journal partition and recover the write position: one header read per sector and a
+ * binary search of the newest sector, no full scan. ESP_ERR_NOT_FOUND when the partition
+ * table has no journal, all other calls fail with ESP_ERR_INVALID_STATE then.
+ */
+extern esp_err_t journal_init();
+
+/**
+ * Queue a record in RAM. Records are written in batches: when JOURNAL_BATCH_RECORDS are
+ * waiting, JOURNAL_FLUSH_DELAY_MS after the first one, on journal_flush and on esp_restart.
+ * The flash work runs on the journal task, never on the caller or a timer. Fails with
+ * ESP_ERR_NO_MEM and counts a drop when the buffer is full.
+ */
+extern esp_err_t journal_append(uint8_t type, uint8_t arg, int32_t value);
+
+/**
+ * Write every buffered record now.
+ */
+extern esp_err_t journal_flush();
+
+/**
+ * The journal is a ring of flash sectors, each erased in turn once the one before is full, so
+ * every sector wears the same and the oldest records make room for new ones. Opening a reader
+ * flushes the buffer, then journal_reader_next returns records from from_sequence (0 for
+ * everything still kept) in order, and ESP_ERR_NOT_FOUND at the end. Records overwritten
+ * while a reader is open are skipped. Appending while reading is fine.
+ */
+extern esp_err_t journal_reader_open(journal_reader_t *reader, uint32_t from_sequence);
+extern esp_err_t journal_reader_next(journal_reader_t *reader, journal_record_t *record);
+
+extern esp_err_t journal_get_stats(journal_stats_t *stats);
+
+#endif //BLACK_BRICKS_ESP_BASE_JOURNAL_H
@@ -0,0 +1,456 @@
+//
+// Sector ring in a raw data partition. Every sector starts with a header naming the sequence
+// of its first slot, followed by fixed size record slots written in order. Only the newest
+// sector has erased slots, so the write position is found from the headers and one binary
+// search. A slot left half written by a power cut fails its CRC and is skipped by readers.
+//
+
+//MARK: Import common headers
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+
+//MARK: Import component header
+#include "journal.h"
+
+//MARK: Private macros and constants
+#define TAG "JOURNAL"
+
+#define JOURNAL_SECTOR_SIZE 4096
+#define JOURNAL_MAGIC 0x314e524au    // "JRN1"
+#define JOURNAL_SLOTS ((JOURNAL_SECTOR_SIZE - sizeof(sector_header_t)) / sizeof(slot_t))
+
+//MARK: Private types
+/**
+ * Written right after the sector is erased, before any of its slots.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t first_sequence;    // Of slot 0, sequences of the other slots follow from it
+    uint32_t erase_count;       // Of this sector, over the life of the partition
+    uint32_t crc;               // esp_rom_crc32_le over the fields before
+} sector_header_t;
+
+/**
+ * A record as stored. Buffered records only get their sequence and CRC when written.
+ */
+typedef struct {
+    uint32_t sequence;
+    uint32_t uptime_ms;
+    uint8_t type;
+    uint8_t arg;
+    uint16_t crc;               // esp_rom_crc16_le over the slot with crc zeroed
+    int32_t value;
+} slot_t;
+
+_Static_assert(sizeof(slot_t) == JOURNAL_RECORD_SIZE, "journal_reader_t is sized by JOURNAL_RECORD_SIZE");
+
+typedef struct {
+    const esp_partition_t *partition;
+    SemaphoreHandle_t lock;         // Buffer and append counters
+    SemaphoreHandle_t flash_lock;   // Write position and every flash access
+    TimerHandle_t flush_timer;
+    TaskHandle_t task;              // Runs every flush not asked for by a caller
+    slot_t buffer[JOURNAL_BUFFER_RECORDS];
+    size_t buffer_head;
+    size_t buffer_count;
+    uint16_t sectors;
+    uint16_t sector;                // Being written
+    uint16_t slot;                  // Next free slot of sector
+    uint32_t first_sequence;        // Of sector
+    journal_stats_t stats;
+} component_t;
+
+//MARK: Declaration of the private opaque structs
+
+//MARK: Public global variables
+
+//MARK: Private global variables
+static component_t component = {
+        .partition = NULL,
+        .lock = NULL,
+        .flash_lock = NULL,
+        .flush_timer = NULL,
+        .task = NULL,
+};
+
+//MARK: Private functions
+static size_t journal_slot_offset(uint16_t sector, uint16_t slot) {
+    return (size_t) sector * JOURNAL_SECTOR_SIZE + sizeof(sector_header_t) + (size_t) slot * sizeof(slot_t);
+}
+
+static uint16_t journal_slot_crc(const slot_t *slot) {
+    slot_t copy = *slot;
+    copy.crc = 0;
+    return esp_rom_crc16_le(0, (const uint8_t *) &copy, sizeof(slot_t));
+}
+
+static bool journal_slot_erased(const slot_t *slot) {
+    const uint8_t *bytes = (const uint8_t *) slot;
+    for (size_t i = 0; i < sizeof(slot_t); i++) {
+        if (bytes[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool journal_header_read(uint16_t sector, sector_header_t *header) {
+    if (esp_partition_read(component.partition, (size_t) sector * JOURNAL_SECTOR_SIZE, header,
+                           sizeof(sector_header_t)) != ESP_OK) {
+        return false;
+    }
+    return header->magic == JOURNAL_MAGIC &&
+           header->crc == esp_rom_crc32_le(0, (const uint8_t *) header, offsetof(sector_header_t, crc));
+}
+
+/**
+ * Erase sector and make it the one being written. Its erase count carries over when the old
+ * header is still readable.
+ */
+static esp_err_t journal_start_sector(uint16_t sector, uint32_t first_sequence) {
+    sector_header_t header;
+    uint32_t erase_count = journal_header_read(sector, &header) ? header.erase_count : 0;
+
+    esp_err_t err = esp_partition_erase_range(component.partition, (size_t) sector * JOURNAL_SECTOR_SIZE,
+                                              JOURNAL_SECTOR_SIZE);
+    if (err != ESP_OK) {
+        return err;
+    }
+    component.stats.sector_erases++;
+
+    header.magic = JOURNAL_MAGIC;
+    header.first_sequence = first_sequence;
+    header.erase_count = erase_count + 1;
+    header.crc = esp_rom_crc32_le(0, (const uint8_t *) &header, offsetof(sector_header_t, crc));
+    err = esp_partition_write(component.partition, (size_t) sector * JOURNAL_SECTOR_SIZE, &header,
+                              sizeof(sector_header_t));
+    if (err != ESP_OK) {
+        return err;
+    }
+    component.sector = sector;
+    component.slot = 0;
+    component.first_sequence = first_sequence;
+    return ESP_OK;
+}
+
+/**
+ * The newest valid header marks the sector being written, its first erased slot the position.
+ */
+static esp_err_t journal_recover() {
+    sector_header_t header;
+    bool found = false;
+
+    for (uint16_t sector = 0; sector < component.sectors; sector++) {
+        if (journal_header_read(sector, &header) && (!found || header.first_sequence > component.first_sequence)) {
+            found = true;
+            component.sector = sector;
+            component.first_sequence = header.first_sequence;
+        }
+    }
+    if (!found) {
+        ESP_LOGI(TAG, "No journal yet, starting one");
+        return journal_start_sector(0, 0);
+    }
+
+    // Slots are written in order: [0, low) are used, [high, JOURNAL_SLOTS) erased
+    uint16_t low = 0;
+    uint16_t high = JOURNAL_SLOTS;
+    while (low < high) {
+        uint16_t middle = (low + high) / 2;
+        slot_t slot;
+        esp_err_t err = esp_partition_read(component.partition, journal_slot_offset(component.sector, middle),
+                                           &slot, sizeof(slot_t));
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (journal_slot_erased(&slot)) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    component.slot = low;
+    return ESP_OK;
+}
+
+/**
+ * Stamp and write count buffered records, moving on to the next sector as each one fills up.
+ * Called with flash_lock held.
+ */
+static esp_err_t journal_write_locked(slot_t *slots, size_t count) {
+    while (count > 0) {
+        if (component.slot == JOURNAL_SLOTS) {
+            esp_err_t err = journal_start_sector((component.sector + 1) % component.sectors,
+                                                 component.first_sequence + JOURNAL_SLOTS);
+            if (err != ESP_OK) {
+                component.stats.write_errors++;
+                return err;
+            }
+        }
+
+        size_t length = JOURNAL_SLOTS - component.slot;
+        if (length > count) {
+            length = count;
+        }
+        for (size_t i = 0; i < length; i++) {
+            slots[i].sequence = component.first_sequence + component.slot + i;
+            slots[i].crc = journal_slot_crc(&slots[i]);
+        }
+        esp_err_t err = esp_partition_write(component.partition, journal_slot_offset(component.sector, component.slot),
+                                            slots, length * sizeof(slot_t));
+        // Part of a failed write may have reached flash, those slots are never used again
+        component.slot += length;
+        if (err != ESP_OK) {
+            component.stats.write_errors++;
+            return err;
+        }
+        component.stats.written += length;
+        slots += length;
+        count -= length;
+    }
+    return ESP_OK;
+}
+
+static void journal_task(void *arg) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        esp_err_t err = journal_flush();
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Cannot write journal: %s", esp_err_to_name(err));
+        }
+    }
+}
+
+// Runs on the timer service task, which must not wait for a sector erase
+static void journal_flush_timer_cb(TimerHandle_t timer) {
+    xTaskNotifyGive(component.task);
+}
+
+static void journal_shutdown_handler(void) {
+    journal_flush();
+}
+
+//MARK: Public functions
+esp_err_t journal_init() {
+    if (component.partition != NULL) {
+        return ESP_OK;
+    }
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                (esp_partition_subtype_t) JOURNAL_PARTITION_SUBTYPE,
+                                                                JOURNAL_PARTITION_LABEL);
+    if (partition == NULL) {
+        ESP_LOGW(TAG, "No %s partition, journal disabled", JOURNAL_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+    // The ring erases the oldest sector while the newest is kept, it needs two at least
+    if (partition->size / JOURNAL_SECTOR_SIZE < 2) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (component.lock == NULL) {
+        component.lock = xSemaphoreCreateMutex();
+        component.flash_lock = xSemaphoreCreateMutex();
+        component.flush_timer = xTimerCreate("journal_flush", pdMS_TO_TICKS(JOURNAL_FLUSH_DELAY_MS), pdFALSE, NULL,
+                                             journal_flush_timer_cb);
+        if (component.lock == NULL || component.flash_lock == NULL || component.flush_timer == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        if (xTaskCreate(journal_task, "journal", JOURNAL_TASK_STACK_SIZE, NULL, JOURNAL_TASK_PRIORITY,
+                        &component.task) != pdPASS) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    component.partition = partition;
+    component.sectors = partition->size / JOURNAL_SECTOR_SIZE;
+    esp_err_t err = journal_recover();
+    if (err != ESP_OK) {
+        component.partition = NULL;
+        return err;
+    }
+    esp_register_shutdown_handler(journal_shutdown_handler);
+    ESP_LOGI(TAG, "Journal of %u sectors, next record %u", component.sectors,
+             component.first_sequence + component.slot);
+    return ESP_OK;
+}
+
+esp_err_t journal_append(uint8_t type, uint8_t arg, int32_t value) {
+    if (component.partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    slot_t record = {
+            .uptime_ms = (uint32_t) (esp_timer_get_time() / 1000),
+            .type = type,
+            .arg = arg,
+            .value = value,
+    };
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    if (component.buffer_count == JOURNAL_BUFFER_RECORDS) {
+        component.stats.dropped++;
+        xSemaphoreGive(component.lock);
+        return ESP_ERR_NO_MEM;
+    }
+    component.buffer[(component.buffer_head + component.buffer_count) % JOURNAL_BUFFER_RECORDS] = record;
+    component.buffer_count++;
+    component.stats.appended++;
+    size_t count = component.buffer_count;
+    xSemaphoreGive(component.lock);
+
+    if (count >= JOURNAL_BATCH_RECORDS) {
+        xTaskNotifyGive(component.task);
+    } else if (count == 1) {
+        xTimerChangePeriod(component.flush_timer, pdMS_TO_TICKS(JOURNAL_FLUSH_DELAY_MS), 0);
+    }
+    return ESP_OK;
+}
+
+esp_err_t journal_flush() {
+    if (component.partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    slot_t batch[JOURNAL_BATCH_RECORDS];
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(component.flash_lock, portMAX_DELAY);
+    for (;;) {
+        // Take the records out first, appends must not wait for the flash
+        size_t count = 0;
+        xSemaphoreTake(component.lock, portMAX_DELAY);
+        while (count < JOURNAL_BATCH_RECORDS && component.buffer_count > 0) {
+            batch[count++] = component.buffer[component.buffer_head];
+            component.buffer_head = (component.buffer_head + 1) % JOURNAL_BUFFER_RECORDS;
+            component.buffer_count--;
+        }
+        xSemaphoreGive(component.lock);
+        if (count == 0) {
+            break;
+        }
+
+        esp_err_t write_err = journal_write_locked(batch, count);
+        err = err == ESP_OK ? write_err : err;
+    }
+    xSemaphoreGive(component.flash_lock);
+    return err;
+}
+
+esp_err_t journal_reader_open(journal_reader_t *reader, uint32_t from_sequence) {
+    if (component.partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = journal_flush();
+    memset(reader, 0, sizeof(journal_reader_t));
+    reader->sequence = from_sequence;
+    reader->sectors_left = component.sectors;
+    // Start right after the newest sector, at the oldest one
+    reader->slot = JOURNAL_SLOTS;
+    xSemaphoreTake(component.flash_lock, portMAX_DELAY);
+    reader->sector = component.sector;
+    xSemaphoreGive(component.flash_lock);
+    return err;
+}
+
+esp_err_t journal_reader_next(journal_reader_t *reader, journal_record_t *record) {
+    if (component.partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    for (;;) {
+        if (reader->index < reader->fill) {
+            slot_t slot;
+            memcpy(&slot, &reader->buffer[reader->index++ * sizeof(slot_t)], sizeof(slot_t));
+            if (journal_slot_erased(&slot)) {
+                // Nothing written past this point of the sector
+                reader->slot = JOURNAL_SLOTS;
+                reader->fill = 0;
+                continue;
+            }
+            if (slot.crc != journal_slot_crc(&slot) || slot.sequence < reader->sequence) {
+                continue;
+            }
+            record->sequence = slot.sequence;
+            record->uptime_ms = slot.uptime_ms;
+            record->type = slot.type;
+            record->arg = slot.arg;
+            record->value = slot.value;
+            reader->sequence = slot.sequence + 1;
+            return ESP_OK;
+        }
+
+        if (reader->slot < JOURNAL_SLOTS) {
+            uint16_t count = JOURNAL_SLOTS - reader->slot;
+            if (count > JOURNAL_READ_RECORDS) {
+                count = JOURNAL_READ_RECORDS;
+            }
+            xSemaphoreTake(component.flash_lock, portMAX_DELAY);
+            esp_err_t err = esp_partition_read(component.partition, journal_slot_offset(reader->sector, reader->slot),
+                                               reader->buffer, count * sizeof(slot_t));
+            xSemaphoreGive(component.flash_lock);
+            if (err != ESP_OK) {
+                return err;
+            }
+            reader->slot += count;
+            reader->fill = count;
+            reader->index = 0;
+            continue;
+        }
+
+        if (reader->sectors_left == 0) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        reader->sector = (reader->sector + 1) % component.sectors;
+        reader->sectors_left--;
+        sector_header_t header;
+        xSemaphoreTake(component.flash_lock, portMAX_DELAY);
+        bool valid = journal_header_read(reader->sector, &header);
+        xSemaphoreGive(component.flash_lock);
+        // Skip sectors never used and those holding only records before the one wanted
+        if (valid && header.first_sequence + JOURNAL_SLOTS > reader->sequence) {
+            reader->slot = reader->sequence > header.first_sequence ? reader->sequence - header.first_sequence : 0;
+        }
+    }
+}
+
+esp_err_t journal_get_stats(journal_stats_t *stats) {
+    if (component.partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(component.flash_lock, portMAX_DELAY);
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    *stats = component.stats;
+    xSemaphoreGive(component.lock);
+    stats->sectors = component.sectors;
+    stats->next_sequence = component.first_sequence + component.slot;
+    stats->oldest_sequence = stats->next_sequence;
+    stats->max_erase_count = 0;
+    for (uint16_t sector = 0; sector < component.sectors; sector++) {
+        sector_header_t header;
+        if (!journal_header_read(sector, &header)) {
+            continue;
+        }
+        if (header.first_sequence < stats->oldest_sequence) {
+            stats->oldest_sequence = header.first_sequence;
+        }
+        if (header.erase_count > stats->max_erase_count) {
+            stats->max_erase_count = header.erase_count;
+        }
+    }
+    xSemaphoreGive(component.flash_lock);
+    return ESP_OK;
+}
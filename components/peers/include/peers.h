@@ -0,0 +1,107 @@
+//
+// Peers heard while scanning: address to advertised name, RSSI and when it was last heard.
+// Fixed capacity with least recently heard eviction and no heap, so scan results can be fed in
+// from the BLE callback as they come. Names of the peers that matter, seen repeatedly or kept
+// because they connected, are staged in data_storage lazily, to let a host picker or
+// diagnostics show known peers without rescanning.
+//
+
+#ifndef BLACK_BRICKS_ESP_BASE_PEERS_H
+#define BLACK_BRICKS_ESP_BASE_PEERS_H
+
+//MARK: Import common headers
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+//MARK: Macros and constants
+#define PEERS_NAMESPACE "peers"
+#define PEERS_BDA_LENGTH 6
+// Longest name that fits in 31 bytes of advertising data
+#define PEERS_NAME_MAX 29
+
+// Peers kept, a power of two of at most 64. Each takes one key in PEERS_NAMESPACE.
+#ifndef PEERS_MAX
+#define PEERS_MAX 16
+#endif
+
+// A peer is written once it has been seen this many times, a passer-by never is
+#ifndef PEERS_PERSIST_MIN_SEEN
+#define PEERS_PERSIST_MIN_SEEN 3
+#endif
+
+// New or renamed peers are written together once this many are pending, or at the latest
+// after the delay. Flushes are at least the interval apart, counted from boot.
+#ifndef PEERS_BATCH_ENTRIES
+#define PEERS_BATCH_ENTRIES 8
+#endif
+#ifndef PEERS_PERSIST_DELAY_MS
+#define PEERS_PERSIST_DELAY_MS 60000
+#endif
+#ifndef PEERS_FLUSH_INTERVAL_MS
+#define PEERS_FLUSH_INTERVAL_MS 10000
+#endif
+
+//MARK: Types
+typedef struct {
+    uint8_t bda[PEERS_BDA_LENGTH];
+    int8_t rssi;
+    char name[PEERS_NAME_MAX + 1];  // NUL terminated
+    int64_t last_seen_us;           // esp_timer_get_time, 0 if not heard since boot
+} peer_t;
+
+typedef struct {
+    uint32_t seen;                  // Scan results fed in
+    uint32_t added;
+    uint32_t evicted;
+    uint32_t renamed;
+    uint32_t written;               // Peers written to storage
+    uint32_t write_errors;          // Failed writes
+    uint16_t count;
+    uint16_t pending;               // Waiting to be written
+} peers_stats_t;
+
+//MARK: Global variables
+
+//MARK: Function prototypes
+/**
+ * Load the peers stored by earlier boots, in the order they were last heard. Needs
+ * data_storage_init first.
+ */
+extern esp_err_t peers_init();
+
+/**
+ * Record a scan result, cheap enough for every advertisement. name need not be NUL terminated
+ * and may be NULL for an advertisement without one: a known peer then only gets its RSSI and
+ * time updated, an unknown one is ignored. A new peer takes the place of the one least
+ * recently heard when the cache is full. Only new peers and name changes are written to
+ * storage, and only once the peer has been seen PEERS_PERSIST_MIN_SEEN times. RSSI and time
+ * are kept in RAM.
+ */
+extern esp_err_t peers_seen(const uint8_t *bda, const uint8_t *name, size_t name_length, int rssi);
+
+/**
+ * Write a peer without waiting for it to be seen PEERS_PERSIST_MIN_SEEN times, e.g. when it
+ * connects. ESP_ERR_NOT_FOUND for a peer never heard with a name.
+ */
+extern esp_err_t peers_keep(const uint8_t *bda);
+
+/**
+ * Look a peer up by address in constant time. ESP_ERR_NOT_FOUND for an unknown one.
+ */
+extern esp_err_t peers_find(const uint8_t *bda, peer_t *peer);
+
+/**
+ * Copy out up to max peers, most recently heard first.
+ */
+extern esp_err_t peers_list(peer_t *peers, size_t max, size_t *count);
+
+/**
+ * Write the pending peers now instead of waiting for the delay.
+ */
+extern esp_err_t peers_flush();
+
+extern esp_err_t peers_get_stats(peers_stats_t *stats);
+
+#endif //BLACK_BRICKS_ESP_BASE_PEERS_H
@@ -0,0 +1,500 @@
+//
+// Open addressing hash table with linear probing from address to entry, at most half full,
+// and a doubly linked list of the entries from most to least recently heard. Entry i is stored
+// under key "peer<i>", so an evicted peer is replaced in storage by the one that took its
+// entry. Every touch gives the entry a new sequence number, which orders the list again on
+// load.
+//
+
+//MARK: Import common headers
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+
+#include "data_storage.h"
+
+//MARK: Import component header
+#include "peers.h"
+
+//MARK: Private macros and constants
+#define TAG "PEERS"
+
+#define PEERS_BUCKETS (PEERS_MAX * 2)
+#define PEERS_NONE 0xFF
+#define PEERS_KEY_SIZE 8                // "peer63" and the NUL
+
+_Static_assert(PEERS_MAX <= 64 && (PEERS_MAX & (PEERS_MAX - 1)) == 0, "PEERS_MAX must be a power of two up to 64");
+_Static_assert(PEERS_PERSIST_MIN_SEEN >= 1 && PEERS_PERSIST_MIN_SEEN <= UINT8_MAX, "PEERS_PERSIST_MIN_SEEN must fit a uint8_t");
+
+//MARK: Private types
+/**
+ * A peer as stored. name is not NUL terminated.
+ */
+typedef struct {
+    uint32_t sequence;
+    uint8_t bda[PEERS_BDA_LENGTH];
+    int8_t rssi;
+    uint8_t name_length;
+    char name[PEERS_NAME_MAX];
+} stored_peer_t;
+
+typedef struct {
+    stored_peer_t peer;
+    int64_t last_seen_us;
+    uint8_t newer;                      // Neighbours in the recency list, PEERS_NONE at the ends
+    uint8_t older;
+    bool used;
+    bool pending;                       // Changed since last written
+    uint8_t sightings;                  // Up to PEERS_PERSIST_MIN_SEEN, written from there on
+} entry_t;
+
+typedef struct {
+    bool ready;
+    SemaphoreHandle_t lock;             // Table, list and stats
+    SemaphoreHandle_t flush_lock;       // Keeps flushes in order, a later one must not be overwritten
+    TimerHandle_t flush_timer;
+    int64_t flushed_us;                 // Start of the last flush, 0 before the first
+    entry_t entries[PEERS_MAX];
+    uint8_t buckets[PEERS_BUCKETS];     // Entry index or PEERS_NONE
+    uint8_t newest;
+    uint8_t oldest;
+    uint32_t sequence;
+    peers_stats_t stats;
+} component_t;
+
+//MARK: Declaration of the private opaque structs
+
+//MARK: Public global variables
+
+//MARK: Private global variables
+static component_t component = {
+        .ready = false,
+        .lock = NULL,
+        .flush_lock = NULL,
+        .flush_timer = NULL,
+};
+
+//MARK: Private functions
+static size_t peers_hash(const uint8_t *bda) {
+    // FNV-1a, the leading bytes of public addresses are the vendor and much the same
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < PEERS_BDA_LENGTH; i++) {
+        hash = (hash ^ bda[i]) * 16777619u;
+    }
+    return hash & (PEERS_BUCKETS - 1);
+}
+
+/**
+ * Bucket holding bda, or the empty one where it would go.
+ */
+static size_t peers_bucket(const uint8_t *bda) {
+    size_t bucket = peers_hash(bda);
+    while (component.buckets[bucket] != PEERS_NONE &&
+           memcmp(component.entries[component.buckets[bucket]].peer.bda, bda, PEERS_BDA_LENGTH) != 0) {
+        bucket = (bucket + 1) & (PEERS_BUCKETS - 1);
+    }
+    return bucket;
+}
+
+/**
+ * Empty a bucket and move later entries of the probe run back into the gap, so that every
+ * entry stays reachable from its hash without tombstones.
+ */
+static void peers_remove_bucket(size_t hole) {
+    component.buckets[hole] = PEERS_NONE;
+    for (size_t next = (hole + 1) & (PEERS_BUCKETS - 1); component.buckets[next] != PEERS_NONE;
+         next = (next + 1) & (PEERS_BUCKETS - 1)) {
+        size_t home = peers_hash(component.entries[component.buckets[next]].peer.bda);
+        if (((next - home) & (PEERS_BUCKETS - 1)) >= ((next - hole) & (PEERS_BUCKETS - 1))) {
+            component.buckets[hole] = component.buckets[next];
+            component.buckets[next] = PEERS_NONE;
+            hole = next;
+        }
+    }
+}
+
+static void peers_unlink(uint8_t index) {
+    entry_t *entry = &component.entries[index];
+    if (entry->newer != PEERS_NONE) {
+        component.entries[entry->newer].older = entry->older;
+    } else {
+        component.newest = entry->older;
+    }
+    if (entry->older != PEERS_NONE) {
+        component.entries[entry->older].newer = entry->newer;
+    } else {
+        component.oldest = entry->newer;
+    }
+}
+
+static void peers_link_newest(uint8_t index) {
+    entry_t *entry = &component.entries[index];
+    entry->newer = PEERS_NONE;
+    entry->older = component.newest;
+    if (component.newest != PEERS_NONE) {
+        component.entries[component.newest].newer = index;
+    } else {
+        component.oldest = index;
+    }
+    component.newest = index;
+}
+
+static void peers_remove(uint8_t index) {
+    peers_remove_bucket(peers_bucket(component.entries[index].peer.bda));
+    peers_unlink(index);
+    if (component.entries[index].pending) {
+        component.stats.pending--;
+    }
+    component.entries[index].used = false;
+    component.entries[index].pending = false;
+    component.stats.count--;
+}
+
+/**
+ * Returns true if this made the entry pending.
+ */
+static bool peers_mark_pending(entry_t *entry) {
+    if (entry->pending) {
+        return false;
+    }
+    entry->pending = true;
+    component.stats.pending++;
+    return true;
+}
+
+/**
+ * Count a sighting. The entry becomes pending when it changed and is worth writing, or when
+ * this sighting made it worth writing. Returns true if this made the entry pending.
+ */
+static bool peers_sighted(entry_t *entry, bool changed) {
+    if (entry->sightings < PEERS_PERSIST_MIN_SEEN) {
+        changed = ++entry->sightings == PEERS_PERSIST_MIN_SEEN;
+    }
+    return changed && peers_mark_pending(entry);
+}
+
+/**
+ * Arm the flush timer after an entry became pending: PEERS_PERSIST_DELAY_MS for the first one,
+ * right away once PEERS_BATCH_ENTRIES are pending, but never before PEERS_FLUSH_INTERVAL_MS
+ * have passed since the last flush. flush_at is when that is.
+ */
+static void peers_schedule(uint16_t pending, int64_t flush_at, int64_t now) {
+    if (pending != 1 && pending < PEERS_BATCH_ENTRIES) {
+        return;
+    }
+    int64_t delay_ms = pending >= PEERS_BATCH_ENTRIES ? 0 : PEERS_PERSIST_DELAY_MS;
+    int64_t wait_ms = (flush_at - now + 999) / 1000;
+    TickType_t ticks = pdMS_TO_TICKS(wait_ms > delay_ms ? wait_ms : delay_ms);
+    xTimerChangePeriod(component.flush_timer, ticks > 0 ? ticks : 1, 0);
+}
+
+static void peers_copy(const entry_t *entry, peer_t *peer) {
+    memcpy(peer->bda, entry->peer.bda, PEERS_BDA_LENGTH);
+    peer->rssi = entry->peer.rssi;
+    memcpy(peer->name, entry->peer.name, entry->peer.name_length);
+    peer->name[entry->peer.name_length] = '\0';
+    peer->last_seen_us = entry->last_seen_us;
+}
+
+static void peers_key(uint8_t index, char *key) {
+    snprintf(key, PEERS_KEY_SIZE, "peer%u", index);
+}
+
+/**
+ * Put the stored peers in the table, oldest first so that each load makes the list newest. A
+ * peer found in two entries is kept in the newer one, the other entry gets reused.
+ */
+static void peers_load() {
+    uint8_t loaded[PEERS_MAX];
+    size_t count = 0;
+    for (uint8_t index = 0; index < PEERS_MAX; index++) {
+        char key[PEERS_KEY_SIZE];
+        peers_key(index, key);
+        stored_peer_t *peer = &component.entries[index].peer;
+        size_t length = sizeof(stored_peer_t);
+        if (data_storage_read_into(PEERS_NAMESPACE, key, (uint8_t *) peer, &length) != ESP_OK ||
+            length != sizeof(stored_peer_t) || peer->name_length == 0 || peer->name_length > PEERS_NAME_MAX) {
+            continue;
+        }
+        size_t position = count++;
+        for (; position > 0 && component.entries[loaded[position - 1]].peer.sequence > peer->sequence; position--) {
+            loaded[position] = loaded[position - 1];
+        }
+        loaded[position] = index;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t index = loaded[i];
+        entry_t *entry = &component.entries[index];
+        size_t bucket = peers_bucket(entry->peer.bda);
+        if (component.buckets[bucket] != PEERS_NONE) {
+            peers_remove(component.buckets[bucket]);
+            bucket = peers_bucket(entry->peer.bda);
+        }
+        component.buckets[bucket] = index;
+        entry->used = true;
+        entry->sightings = PEERS_PERSIST_MIN_SEEN;
+        entry->last_seen_us = 0;
+        peers_link_newest(index);
+        component.stats.count++;
+        component.sequence = entry->peer.sequence;
+    }
+}
+
+static void peers_flush_job(void *arg) {
+    esp_err_t err = peers_flush();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot write peers: %s", esp_err_to_name(err));
+        xTimerChangePeriod(component.flush_timer, pdMS_TO_TICKS(PEERS_FLUSH_INTERVAL_MS), 0);
+    }
+}
+
+static void peers_flush_timer_cb(TimerHandle_t timer) {
+    // The timer task must not wait for the storage lock, the storage worker stages the peers
+    if (data_storage_run_async(peers_flush_job, NULL) != ESP_OK) {
+        xTimerReset(timer, 0);
+    }
+}
+
+static void peers_shutdown_handler(void) {
+    // Handlers run newest first, the one of data_storage writes what this stages
+    peers_flush();
+}
+
+//MARK: Public functions
+esp_err_t peers_init() {
+    if (component.ready) {
+        return ESP_OK;
+    }
+
+    if (component.lock == NULL) {
+        component.lock = xSemaphoreCreateMutex();
+        component.flush_lock = xSemaphoreCreateMutex();
+        component.flush_timer = xTimerCreate("peers_flush", pdMS_TO_TICKS(PEERS_PERSIST_DELAY_MS), pdFALSE, NULL,
+                                             peers_flush_timer_cb);
+        if (component.lock == NULL || component.flush_lock == NULL || component.flush_timer == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    memset(component.entries, 0, sizeof(component.entries));
+    memset(component.buckets, PEERS_NONE, sizeof(component.buckets));
+    memset(&component.stats, 0, sizeof(peers_stats_t));
+    component.newest = PEERS_NONE;
+    component.oldest = PEERS_NONE;
+    component.sequence = 0;
+    component.flushed_us = 0;
+    peers_load();
+    component.ready = true;
+    xSemaphoreGive(component.lock);
+
+    esp_register_shutdown_handler(peers_shutdown_handler);
+    ESP_LOGI(TAG, "%u peers known", component.stats.count);
+    return ESP_OK;
+}
+
+esp_err_t peers_seen(const uint8_t *bda, const uint8_t *name, size_t name_length, int rssi) {
+    if (bda == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!component.ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (name != NULL) {
+        const uint8_t *end = memchr(name, '\0', name_length);
+        name_length = end != NULL ? (size_t) (end - name) : name_length;
+        name_length = name_length < PEERS_NAME_MAX ? name_length : PEERS_NAME_MAX;
+    }
+    if (name_length == 0) {
+        name = NULL;
+    }
+    rssi = rssi < INT8_MIN ? INT8_MIN : rssi > INT8_MAX ? INT8_MAX : rssi;
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    component.stats.seen++;
+    size_t bucket = peers_bucket(bda);
+    uint8_t index = component.buckets[bucket];
+    bool marked = false;
+    if (index != PEERS_NONE) {
+        entry_t *entry = &component.entries[index];
+        bool renamed = name != NULL &&
+                       (name_length != entry->peer.name_length || memcmp(entry->peer.name, name, name_length) != 0);
+        if (renamed) {
+            memcpy(entry->peer.name, name, name_length);
+            entry->peer.name_length = name_length;
+            component.stats.renamed++;
+        }
+        marked = peers_sighted(entry, renamed);
+        if (index != component.newest) {
+            peers_unlink(index);
+            peers_link_newest(index);
+        }
+    } else if (name != NULL) {
+        if (component.stats.count == PEERS_MAX) {
+            index = component.oldest;
+            peers_remove(index);
+            component.stats.evicted++;
+            bucket = peers_bucket(bda);
+        } else {
+            index = 0;
+            while (component.entries[index].used) {
+                index++;
+            }
+        }
+        entry_t *entry = &component.entries[index];
+        memcpy(entry->peer.bda, bda, PEERS_BDA_LENGTH);
+        memcpy(entry->peer.name, name, name_length);
+        entry->peer.name_length = name_length;
+        entry->used = true;
+        entry->sightings = 0;
+        component.buckets[bucket] = index;
+        peers_link_newest(index);
+        marked = peers_sighted(entry, true);
+        component.stats.count++;
+        component.stats.added++;
+    }
+    if (index != PEERS_NONE) {
+        entry_t *entry = &component.entries[index];
+        entry->peer.rssi = (int8_t) rssi;
+        entry->peer.sequence = ++component.sequence;
+        entry->last_seen_us = now;
+    }
+    uint16_t pending = component.stats.pending;
+    int64_t flush_at = component.flushed_us + PEERS_FLUSH_INTERVAL_MS * 1000LL;
+    xSemaphoreGive(component.lock);
+
+    if (marked) {
+        peers_schedule(pending, flush_at, now);
+    }
+    return ESP_OK;
+}
+
+esp_err_t peers_keep(const uint8_t *bda) {
+    if (bda == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!component.ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    uint8_t index = component.buckets[peers_bucket(bda)];
+    bool marked = false;
+    if (index != PEERS_NONE && component.entries[index].sightings < PEERS_PERSIST_MIN_SEEN) {
+        component.entries[index].sightings = PEERS_PERSIST_MIN_SEEN;
+        marked = peers_mark_pending(&component.entries[index]);
+    }
+    uint16_t pending = component.stats.pending;
+    int64_t flush_at = component.flushed_us + PEERS_FLUSH_INTERVAL_MS * 1000LL;
+    xSemaphoreGive(component.lock);
+
+    if (marked) {
+        peers_schedule(pending, flush_at, esp_timer_get_time());
+    }
+    return index != PEERS_NONE ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t peers_find(const uint8_t *bda, peer_t *peer) {
+    if (bda == NULL || peer == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!component.ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    uint8_t index = component.buckets[peers_bucket(bda)];
+    if (index != PEERS_NONE) {
+        peers_copy(&component.entries[index], peer);
+    }
+    xSemaphoreGive(component.lock);
+    return index != PEERS_NONE ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t peers_list(peer_t *peers, size_t max, size_t *count) {
+    if ((peers == NULL && max > 0) || count == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!component.ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    *count = 0;
+    for (uint8_t index = component.newest; index != PEERS_NONE && *count < max;
+         index = component.entries[index].older) {
+        peers_copy(&component.entries[index], &peers[(*count)++]);
+    }
+    xSemaphoreGive(component.lock);
+    return ESP_OK;
+}
+
+esp_err_t peers_flush() {
+    if (!component.ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.flush_lock, portMAX_DELAY);
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    component.flushed_us = esp_timer_get_time();
+    xSemaphoreGive(component.lock);
+
+    // Staged one by one, data_storage commits them together once its commit delay has passed
+    esp_err_t err = ESP_OK;
+    for (uint8_t index = 0; index < PEERS_MAX && err == ESP_OK; index++) {
+        entry_t *entry = &component.entries[index];
+        stored_peer_t peer;
+        xSemaphoreTake(component.lock, portMAX_DELAY);
+        bool pending = entry->pending;
+        if (pending) {
+            peer = entry->peer;
+            entry->pending = false;
+            component.stats.pending--;
+        }
+        xSemaphoreGive(component.lock);
+        if (!pending) {
+            continue;
+        }
+
+        char key[PEERS_KEY_SIZE];
+        peers_key(index, key);
+        err = data_storage_write(PEERS_NAMESPACE, key, (const uint8_t *) &peer, sizeof(stored_peer_t));
+        xSemaphoreTake(component.lock, portMAX_DELAY);
+        if (err != ESP_OK) {
+            // Retried with whatever peer holds the entry by then
+            if (entry->used) {
+                peers_mark_pending(entry);
+            }
+            component.stats.write_errors++;
+        } else {
+            component.stats.written++;
+        }
+        xSemaphoreGive(component.lock);
+    }
+    xSemaphoreGive(component.flush_lock);
+    return err;
+}
+
+esp_err_t peers_get_stats(peers_stats_t *stats) {
+    if (stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!component.ready) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(component.lock, portMAX_DELAY);
+    *stats = component.stats;
+    xSemaphoreGive(component.lock);
+    return ESP_OK;
+}
@@ -0,0 +1,105 @@
+//
+// Loads an image from host/pack_assets.py into a RAM assets partition and runs it through
+// components/assets as the firmware would: map, check the index, verify every table, then look
+// up the tables named on the command line.
+//
+// Exit code 1 when the image is unusable or a table is missing.
+//
+
+//MARK: Import common headers
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "assets.h"
+#include "host_partition.h"
+
+//MARK: Macros and constants
+#define CHECK_PARTITION_SIZE 0x40000    // assets in partition_table.csv
+
+//MARK: Private functions
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options] IMAGE [TYPE:ID]...\n"
+            "  -s SIZE    partition size (default 0x%x)\n"
+            "  -V         print component logs\n",
+            name, CHECK_PARTITION_SIZE);
+}
+
+//MARK: Main
+int main(int argc, char **argv) {
+    unsigned long size = CHECK_PARTITION_SIZE;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:V")) != -1) {
+        switch (option) {
+            case 's':
+                size = strtoul(optarg, NULL, 0);
+                break;
+            case 'V':
+                host_log_verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    esp_err_t err = host_partition_add(ASSETS_PARTITION_LABEL, ESP_PARTITION_TYPE_DATA, ASSETS_PARTITION_SUBTYPE, size);
+    if (err == ESP_OK) {
+        err = host_partition_load(ASSETS_PARTITION_LABEL, argv[optind]);
+    }
+    if (err == ESP_OK) {
+        err = assets_init();
+    }
+    if (err == ESP_OK) {
+        err = assets_verify();
+    }
+    if (err != ESP_OK) {
+        fprintf(stderr, "%s: %s\n", argv[optind], esp_err_to_name(err));
+        return 1;
+    }
+
+    int result = 0;
+    for (int i = optind + 1; i < argc; i++) {
+        static const char *const type_names[] = {
+                [ASSET_TYPE_LAYOUT] = "layout",
+                [ASSET_TYPE_KEYMAP] = "keymap",
+                [ASSET_TYPE_MACROS] = "macros",
+        };
+        char *separator = strchr(argv[i], ':');
+        if (separator == NULL) {
+            usage(argv[0]);
+            return 2;
+        }
+        *separator = '\0';
+        unsigned long type = 0;
+        for (size_t t = 0; t < sizeof(type_names) / sizeof(type_names[0]); t++) {
+            if (type_names[t] != NULL && strcmp(argv[i], type_names[t]) == 0) {
+                type = t;
+            }
+        }
+        if (type == 0) {
+            type = strtoul(argv[i], NULL, 0);
+        }
+        unsigned long id = strtoul(separator + 1, NULL, 0);
+
+        const void *data;
+        size_t length;
+        err = assets_get(type, id, &data, &length);
+        if (err == ESP_OK) {
+            printf("%s:%lu %zu bytes\n", argv[i], id, length);
+        } else {
+            printf("%s:%lu %s\n", argv[i], id, esp_err_to_name(err));
+            result = 1;
+        }
+    }
+    assets_deinit();
+    return result;
+}
@@ -0,0 +1,470 @@
+//
+// Replays a recorded GPIO edge trace through components/button on the host.
+//
+// Trace format, one edge per line, times in microseconds and non-decreasing:
+//     <time_us> <gpio> <level>
+//     <time_us> m<key> <pressed>
+// The second form presses (1) or releases (0) a key of the matrix given with -m, keys numbered
+// row by row. Blank lines and lines starting with '#' are ignored. Every pin named in the trace
+// is set up with button_init_set() and starts released, except the encoder pins given with -e.
+//
+// With -g the emitted events are compared with a golden file holding the -v event lines.
+//
+
+//MARK: Import common headers
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "button.h"
+#include "host_sim.h"
+
+//MARK: Macros and constants
+#define REPLAY_TAIL_DEFAULT_MS 1000
+#define REPLAY_EVENT_TYPES (BUTTON_ENCODER + 1)
+#define REPLAY_LINE_SIZE 128
+#define REPLAY_REPEAT_MAX 8
+
+//MARK: Types
+typedef struct {
+    int64_t time_us;
+    gpio_num_t pin;
+    int key;                // Matrix key, or -1 for a GPIO edge
+    int level;
+} trace_edge_t;
+
+typedef struct {
+    trace_edge_t *edges;
+    size_t count;
+    uint64_t pins;
+} trace_t;
+
+typedef struct {
+    bool verbose;
+    FILE *golden;
+    const char *golden_path;
+    int golden_line;
+    uint32_t mismatches;
+    uint32_t events[REPLAY_EVENT_TYPES];
+    uint32_t total;
+    int64_t worst_latency_us;
+} replay_t;
+
+//MARK: Global variables
+static replay_t replay;
+
+static const char *event_names[REPLAY_EVENT_TYPES] = {
+        "DOWN", "UP", "LONG_PRESS", "LONG_LONG_PRESS", "CHORD", "CHORD_UP", "TAP", "TAP_CORRECTION",
+        "REPEAT", "ENCODER",
+};
+
+//MARK: Private functions
+/**
+ * Next event line of the golden file, skipping comments and blank lines. False at its end.
+ */
+static bool golden_next(char *line, size_t size) {
+    while (fgets(line, (int) size, replay.golden) != NULL) {
+        replay.golden_line++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '#' && line[0] != '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Compare an emitted event with the golden file. Only the first mismatch is shown, the rest
+ * usually follow from it.
+ */
+static void golden_check(const char *line) {
+    char expected[REPLAY_LINE_SIZE];
+    if (!golden_next(expected, sizeof(expected))) {
+        if (replay.mismatches++ == 0) {
+            fprintf(stderr, "%s: unexpected event '%s' after the end\n", replay.golden_path, line);
+        }
+    } else if (strcmp(expected, line) != 0) {
+        if (replay.mismatches++ == 0) {
+            fprintf(stderr, "%s:%d: expected '%s', got '%s'\n", replay.golden_path, replay.golden_line, expected,
+                    line);
+        }
+    }
+}
+
+/**
+ * Parse a comma separated list of GPIO numbers. Returns the count, or -1 when malformed.
+ */
+static int parse_pins(const char *text, gpio_num_t *pins, int max) {
+    int count = 0;
+    while (count < max) {
+        char *end;
+        long pin = strtol(text, &end, 10);
+        if (end == text || pin < 0 || pin >= GPIO_NUM_MAX) {
+            return -1;
+        }
+        pins[count++] = (gpio_num_t) pin;
+        if (*end != ',') {
+            return *end == '\0' ? count : -1;
+        }
+        text = end + 1;
+    }
+    return -1;
+}
+
+/**
+ * -m ROWS:COLS[:SCAN_US[:SCANS]], ROWS and COLS comma separated.
+ */
+static bool parse_matrix(char *text, button_matrix_config_t *config) {
+    char *fields[4] = {0};
+    int count = 0;
+    for (char *field = strtok(text, ":"); field != NULL && count < 4; field = strtok(NULL, ":")) {
+        fields[count++] = field;
+    }
+    if (count < 2) {
+        return false;
+    }
+    int rows = parse_pins(fields[0], config->rows, BUTTON_MATRIX_MAX_LINES);
+    int cols = parse_pins(fields[1], config->cols, BUTTON_MATRIX_MAX_LINES);
+    if (rows < 1 || cols < 1) {
+        return false;
+    }
+    config->row_count = (uint8_t) rows;
+    config->col_count = (uint8_t) cols;
+    config->scan_period_us = fields[2] != NULL ? strtoul(fields[2], NULL, 10) : BUTTON_MATRIX_SCAN_PERIOD_DEFAULT_US;
+    config->debounce_scans = fields[3] != NULL ? (uint8_t) strtoul(fields[3], NULL, 10) : 3;
+    return true;
+}
+
+static esp_err_t replay_event_cb(const button_event_t *event) {
+    int64_t latency = host_sim_now() - event->timestamp;
+    if (latency > replay.worst_latency_us) {
+        replay.worst_latency_us = latency;
+    }
+    if (event->type < REPLAY_EVENT_TYPES) {
+        replay.events[event->type]++;
+    }
+    replay.total++;
+
+    char line[REPLAY_LINE_SIZE];
+    int length = snprintf(line, sizeof(line), "%" PRId64 " %d %s", event->timestamp, event->pin,
+                          event_names[event->type]);
+    if (event->type == BUTTON_CHORD || event->type == BUTTON_CHORD_UP) {
+        snprintf(line + length, sizeof(line) - length, " pins=%" PRIx64, event->pins);
+    } else if (event->type == BUTTON_TAP || event->type == BUTTON_TAP_CORRECTION ||
+               event->type == BUTTON_REPEAT) {
+        snprintf(line + length, sizeof(line) - length, " count=%u", event->count);
+    } else if (event->type == BUTTON_ENCODER) {
+        snprintf(line + length, sizeof(line) - length, " delta=%d", event->delta);
+    }
+    if (replay.verbose) {
+        printf("%s\n", line);
+    }
+    if (replay.golden != NULL) {
+        golden_check(line);
+    }
+    return ESP_OK;
+}
+
+static int trace_load(const char *path, trace_t *trace) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    size_t capacity = 0;
+    char line[128];
+    int line_number = 0;
+    int64_t last = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0') {
+            continue;
+        }
+
+        trace_edge_t edge = {.key = -1};
+        int pin = 0;
+        if (sscanf(start, "%" SCNd64 " m%d %d", &edge.time_us, &edge.key, &edge.level) == 3) {
+            if (edge.key < 0 || edge.key >= BUTTON_MATRIX_MAX_KEYS) {
+                edge.time_us = -1;
+            }
+        } else if (sscanf(start, "%" SCNd64 " %d %d", &edge.time_us, &pin, &edge.level) != 3 ||
+                   pin < 0 || pin >= GPIO_NUM_MAX) {
+            edge.time_us = -1;
+        }
+        if (edge.time_us < last) {
+            fprintf(stderr, "%s:%d: expected '<time_us> <gpio> <level>' or '<time_us> m<key> <pressed>' in time order\n",
+                    path, line_number);
+            fclose(file);
+            return -1;
+        }
+        edge.pin = (gpio_num_t) pin;
+        last = edge.time_us;
+
+        if (trace->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            trace_edge_t *edges = realloc(trace->edges, capacity * sizeof(trace_edge_t));
+            if (edges == NULL) {
+                fclose(file);
+                return -1;
+            }
+            trace->edges = edges;
+        }
+        trace->edges[trace->count++] = edge;
+        if (edge.key < 0) {
+            trace->pins |= BUTTON_PIN_BIT(pin);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options] TRACE\n"
+            "  -c MASK:MS              report presses of the hex MASK pins within MS as chords\n"
+            "  -d SAMPLE_US:WINDOW_US  enable the sampling debouncer\n"
+            "  -e A:B[:UNIT]           rotary encoder on GPIO A and B, decoded by PCNT UNIT or the ISR\n"
+            "  -g FILE                 compare the events with the -v lines in FILE, exit 4 on a mismatch\n"
+            "  -H MASK                 hex mask of active-high pins (pulled down, pressed at 1)\n"
+            "  -l US                   task wake-up latency after a notification (default 0)\n"
+            "  -m ROWS:COLS[:SCAN_US[:SCANS]]\n"
+            "                          key matrix on comma separated row and column GPIOs\n"
+            "  -n COUNT                replay the trace COUNT times back to back (default 1)\n"
+            "  -r PIN:DELAY_MS:INTERVAL_MS[:MIN_MS:ACCEL]\n"
+            "                          typematic repeat on PIN, may be given %d times\n"
+            "  -t MS                   keep running this long after the last edge (default %d)\n"
+            "  -T MASK:MS[:EAGER]      recognize taps on the hex MASK pins within MS\n"
+            "  -v                      print every emitted event\n"
+            "  -V                      also print component logs\n",
+            name, REPLAY_REPEAT_MAX, REPLAY_TAIL_DEFAULT_MS);
+}
+
+//MARK: Main
+int main(int argc, char **argv) {
+    button_debounce_config_t debounce = {0};
+    button_pin_options_t options = {0};
+    bool debounce_enabled = false;
+    uint64_t chord_pins = 0;
+    uint32_t chord_window_ms = 0;
+    uint64_t tap_pins = 0;
+    uint32_t tap_window_ms = 0;
+    int tap_eager = 0;
+    gpio_num_t repeat_pins[REPLAY_REPEAT_MAX];
+    button_repeat_config_t repeats[REPLAY_REPEAT_MAX];
+    int repeat_count = 0;
+    button_matrix_config_t matrix = {0};
+    bool matrix_enabled = false;
+    button_encoder_config_t encoder = {
+            .pcnt_unit = BUTTON_ENCODER_NO_PCNT,
+            .steps_per_detent = BUTTON_ENCODER_STEPS_PER_DETENT_DEFAULT,
+            .report_period_us = BUTTON_ENCODER_REPORT_PERIOD_DEFAULT_US,
+    };
+    bool encoder_enabled = false;
+    int64_t latency_us = 0;
+    int64_t tail_us = REPLAY_TAIL_DEFAULT_MS * 1000LL;
+    long rounds = 1;
+
+    int option;
+    while ((option = getopt(argc, argv, "c:d:e:g:H:l:m:n:r:t:T:vV")) != -1) {
+        switch (option) {
+            case 'c':
+                if (sscanf(optarg, "%" SCNx64 ":%" SCNu32, &chord_pins, &chord_window_ms) != 2) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'd':
+                if (sscanf(optarg, "%" SCNu32 ":%" SCNu32, &debounce.sample_period_us, &debounce.window_us) != 2) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                debounce_enabled = true;
+                break;
+            case 'e': {
+                int pin_a;
+                int pin_b;
+                if (sscanf(optarg, "%d:%d:%d", &pin_a, &pin_b, &encoder.pcnt_unit) < 2 ||
+                    pin_a < 0 || pin_a >= GPIO_NUM_MAX || pin_b < 0 || pin_b >= GPIO_NUM_MAX) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                encoder.pin_a = (gpio_num_t) pin_a;
+                encoder.pin_b = (gpio_num_t) pin_b;
+                encoder_enabled = true;
+                break;
+            }
+            case 'g':
+                replay.golden_path = optarg;
+                break;
+            case 'H':
+                options.active_high = strtoull(optarg, NULL, 16);
+                break;
+            case 'l':
+                latency_us = strtoll(optarg, NULL, 10);
+                break;
+            case 'm':
+                if (!parse_matrix(optarg, &matrix)) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                matrix_enabled = true;
+                break;
+            case 'n':
+                rounds = strtol(optarg, NULL, 10);
+                break;
+            case 'r': {
+                int pin;
+                button_repeat_config_t *repeat = &repeats[repeat_count];
+                memset(repeat, 0, sizeof(button_repeat_config_t));
+                if (repeat_count == REPLAY_REPEAT_MAX ||
+                    sscanf(optarg, "%d:%" SCNu32 ":%" SCNu32 ":%" SCNu32 ":%" SCNu8, &pin, &repeat->delay_ms,
+                           &repeat->interval_ms, &repeat->min_interval_ms, &repeat->accel_percent) < 3 ||
+                    pin < 0 || pin >= GPIO_NUM_MAX) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                repeat_pins[repeat_count++] = (gpio_num_t) pin;
+                break;
+            }
+            case 't':
+                tail_us = strtoll(optarg, NULL, 10) * 1000LL;
+                break;
+            case 'T':
+                if (sscanf(optarg, "%" SCNx64 ":%" SCNu32 ":%d", &tap_pins, &tap_window_ms, &tap_eager) < 2) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'v':
+                replay.verbose = true;
+                break;
+            case 'V':
+                host_log_verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1 || rounds < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    trace_t trace = {0};
+    if (trace_load(argv[optind], &trace) != 0) {
+        return 1;
+    }
+    if (trace.count == 0) {
+        fprintf(stderr, "%s: no edges\n", argv[optind]);
+        return 1;
+    }
+
+    if (replay.golden_path != NULL && (replay.golden = fopen(replay.golden_path, "r")) == NULL) {
+        perror(replay.golden_path);
+        return 1;
+    }
+
+    // Same order as keyboard_init, the task starts last
+    uint64_t encoder_pins = encoder_enabled ? BUTTON_PIN_BIT(encoder.pin_a) | BUTTON_PIN_BIT(encoder.pin_b) : 0;
+    uint64_t pins = trace.pins & ~encoder_pins;
+    host_sim_set_task_latency(latency_us);
+    if (pins != 0 && button_init_set(pins, &options) != ESP_OK) {
+        fprintf(stderr, "invalid pin set\n");
+        return 1;
+    }
+    if (debounce_enabled && button_debounce_enable(&debounce) != ESP_OK) {
+        fprintf(stderr, "invalid debounce config\n");
+        return 1;
+    }
+    if (chord_window_ms != 0 && button_set_chord(chord_pins, chord_window_ms) != ESP_OK) {
+        fprintf(stderr, "invalid chord config\n");
+        return 1;
+    }
+    if (tap_window_ms != 0 && button_set_multi_tap(tap_pins, tap_window_ms, tap_eager != 0) != ESP_OK) {
+        fprintf(stderr, "invalid multi-tap config\n");
+        return 1;
+    }
+    for (int i = 0; i < repeat_count; i++) {
+        if (button_set_repeat(repeat_pins[i], &repeats[i]) != ESP_OK) {
+            fprintf(stderr, "invalid repeat config for GPIO %d\n", repeat_pins[i]);
+            return 1;
+        }
+    }
+    if (matrix_enabled) {
+        host_sim_set_matrix(matrix.rows, matrix.row_count, matrix.cols, matrix.col_count);
+        if (button_matrix_init(&matrix) != ESP_OK) {
+            fprintf(stderr, "invalid matrix config\n");
+            return 1;
+        }
+    }
+    if (encoder_enabled && button_encoder_init(&encoder) != ESP_OK) {
+        fprintf(stderr, "invalid encoder config\n");
+        return 1;
+    }
+    button_component_init(replay_event_cb);
+
+    // Each round starts after the previous one has gone quiet, with the clock moved on
+    int64_t span = trace.edges[trace.count - 1].time_us + tail_us;
+    struct timespec started;
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (long round = 0; round < rounds; round++) {
+        int64_t offset = round * span;
+        for (size_t i = 0; i < trace.count; i++) {
+            const trace_edge_t *edge = &trace.edges[i];
+            host_sim_advance(offset + edge->time_us);
+            if (edge->key >= 0) {
+                host_sim_set_key(edge->key, edge->level != 0);
+            } else {
+                host_sim_set_level(edge->pin, edge->level);
+            }
+        }
+        host_sim_advance(offset + span);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double wall_s = (double) (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+    button_queue_stats_t queue;
+    button_get_queue_stats(&queue);
+    host_sim_stats_t sim;
+    host_sim_get_stats(&sim);
+
+    printf("edges          %zu\n", trace.count * rounds);
+    printf("events         %u\n", replay.total);
+    for (int type = 0; type < REPLAY_EVENT_TYPES; type++) {
+        if (replay.events[type] != 0) {
+            printf("  %-16s %u\n", event_names[type], replay.events[type]);
+        }
+    }
+    printf("enqueued       %" PRIu32 "\n", queue.enqueued);
+    printf("dropped        %" PRIu32 "\n", queue.dropped);
+    printf("queue depth    %" PRIu32 " / %d\n", queue.high_water, BUTTON_RING_LENGTH);
+    printf("worst latency  %" PRId64 " us\n", replay.worst_latency_us);
+    printf("worst wake-up  %" PRId64 " us\n", sim.worst_task_delay_us);
+    printf("isr calls      %" PRIu32 "\n", sim.isr_calls);
+    printf("timer calls    %" PRIu32 "\n", sim.timer_callbacks);
+    printf("task runs      %" PRIu32 "\n", sim.task_runs);
+
+    // Wall clock figures change from run to run, keep them off stdout so it can be diffed
+    fprintf(stderr, "replayed %.3f s of trace in %.3f s, %.0f events/s, %.0f edges/s\n",
+            (double) (span * rounds) / 1e6, wall_s, replay.total / wall_s, trace.count * rounds / wall_s);
+
+    char extra[REPLAY_LINE_SIZE];
+    if (replay.golden != NULL && golden_next(extra, sizeof(extra)) && replay.mismatches++ == 0) {
+        fprintf(stderr, "%s:%d: expected '%s', got no more events\n", replay.golden_path, replay.golden_line, extra);
+    }
+    if (replay.golden != NULL) {
+        fclose(replay.golden);
+        printf("golden diffs   %" PRIu32 "\n", replay.mismatches);
+    }
+
+    free(trace.edges);
+    return replay.mismatches != 0 ? 4 : queue.dropped != 0 ? 3 : 0;
+}
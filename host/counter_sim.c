@@ -0,0 +1,142 @@
+//
+// Drives components/counter through a long run of increments on the RAM flash, cutting the
+// power at random programs and erases, and checks after every reboot that no counter lost
+// more than the increment in flight or gained one it never made. Prints the wear it caused.
+//
+// Exit code 1 on any wrong value or on a write that tried to set a bit.
+//
+
+//MARK: Import common headers
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "counter.h"
+#include "host_partition.h"
+
+//MARK: Macros and constants
+#define SIM_INCREMENTS_DEFAULT 200000
+#define SIM_CUT_EVERY_DEFAULT 5000
+#define SIM_PARTITION_SIZE (2 * HOST_PARTITION_SECTOR_SIZE)
+
+//MARK: Global variables
+static uint32_t expected[COUNTER_MAX];
+static uint32_t failures;
+
+//MARK: Private functions
+/**
+ * Restart the component the way a reboot would and compare every counter. in_flight is the
+ * counter whose increment was cut, it may or may not have counted.
+ */
+static void sim_reboot(int in_flight) {
+    host_partition_power_restore();
+    counter_deinit();
+    esp_err_t err = counter_init();
+    if (err != ESP_OK) {
+        fprintf(stderr, "counter_init after reboot: %s\n", esp_err_to_name(err));
+        failures++;
+        return;
+    }
+
+    for (int i = 0; i < COUNTER_MAX; i++) {
+        uint32_t value = 0;
+        counter_get(i, &value);
+        bool ok = value == expected[i] || (i == in_flight && value == expected[i] + 1);
+        if (!ok) {
+            fprintf(stderr, "counter %d is %" PRIu32 " after reboot, expected %" PRIu32 "%s\n", i, value,
+                    expected[i], i == in_flight ? " or one more" : "");
+            failures++;
+        }
+        expected[i] = value;
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n COUNT   increments (default %d)\n"
+            "  -c OPS     cut the power once every OPS flash operations on average, 0 never (default %d)\n"
+            "  -s SEED    random seed (default 1)\n"
+            "  -V         print component logs\n",
+            name, SIM_INCREMENTS_DEFAULT, SIM_CUT_EVERY_DEFAULT);
+}
+
+//MARK: Main
+int main(int argc, char **argv) {
+    long increments = SIM_INCREMENTS_DEFAULT;
+    long cut_every = SIM_CUT_EVERY_DEFAULT;
+    unsigned seed = 1;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:c:s:V")) != -1) {
+        switch (option) {
+            case 'n':
+                increments = strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                cut_every = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'V':
+                host_log_verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc || increments < 1 || cut_every < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    srand(seed);
+    host_partition_add(COUNTER_PARTITION_LABEL, ESP_PARTITION_TYPE_DATA, COUNTER_PARTITION_SUBTYPE,
+                       SIM_PARTITION_SIZE);
+    if (counter_init() != ESP_OK) {
+        fprintf(stderr, "counter_init failed\n");
+        return 1;
+    }
+
+    uint32_t cuts = 0;
+    bool cut_pending = false;
+    for (long n = 0; n < increments; n++) {
+        if (cut_every > 0 && !cut_pending) {
+            host_partition_power_cut(rand() % (2 * cut_every));
+            cut_pending = true;
+        }
+
+        // Mostly key presses, now and then one of the rarer counters
+        int index = rand() % 4 != 0 ? 0 : rand() % COUNTER_MAX;
+        esp_err_t err = counter_increment(index);
+        if (err == ESP_OK) {
+            expected[index]++;
+        } else {
+            cuts++;
+            cut_pending = false;
+            sim_reboot(index);
+        }
+    }
+    // A clean reboot at the end must give back exactly what was counted
+    sim_reboot(-1);
+
+    host_partition_stats_t stats;
+    host_partition_get_stats(COUNTER_PARTITION_LABEL, &stats);
+    uint32_t total = 0;
+    for (int i = 0; i < COUNTER_MAX; i++) {
+        total += expected[i];
+    }
+    printf("increments %ld, counted %" PRIu32 ", power cuts %" PRIu32 ", wrong values %" PRIu32 "\n",
+           increments, total, cuts, failures);
+    printf("writes %" PRIu32 " (%" PRIu32 " bytes), bit sets %" PRIu32 ", sector erases %" PRIu32 " (%" PRIu32
+           " / %" PRIu32 "), increments per erase %.0f\n",
+           stats.writes, stats.bytes_written, stats.bit_sets, stats.erases,
+           host_partition_sector_erases(COUNTER_PARTITION_LABEL, 0),
+           host_partition_sector_erases(COUNTER_PARTITION_LABEL, 1),
+           stats.erases > 0 ? (double) increments / stats.erases : 0.0);
+    return failures > 0 || stats.bit_sets > 0 ? 1 : 0;
+}
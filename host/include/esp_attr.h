@@ -0,0 +1,11 @@
+//
+// Host stand-in for the ESP-IDF header of the same name.
+//
+
+#ifndef HOST_ESP_ATTR_H
+#define HOST_ESP_ATTR_H
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+#endif //HOST_ESP_ATTR_H
@@ -0,0 +1,22 @@
+//
+// Host stand-in for the ESP-IDF header of the same name.
+// Errors and warnings go to stderr, everything else only when host_log_verbose is set.
+//
+
+#ifndef HOST_ESP_LOG_H
+#define HOST_ESP_LOG_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+extern bool host_log_verbose;
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) do { \
+        if (host_log_verbose) fprintf(stderr, "I %s: " format "\n", tag, ##__VA_ARGS__); \
+    } while (0)
+#define ESP_LOGD(tag, format, ...) do { } while (0)
+#define ESP_LOGV(tag, format, ...) do { } while (0)
+
+#endif //HOST_ESP_LOG_H
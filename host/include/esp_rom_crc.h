@@ -0,0 +1,14 @@
+//
+// Host stand-in for the ESP-IDF header of the same name. Same polynomials and the same
+// inversion of the running value as the ROM functions.
+//
+
+#ifndef HOST_ESP_ROM_CRC_H
+#define HOST_ESP_ROM_CRC_H
+
+#include <stdint.h>
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len);
+uint16_t esp_rom_crc16_le(uint16_t crc, uint8_t const *buf, uint32_t len);
+
+#endif //HOST_ESP_ROM_CRC_H
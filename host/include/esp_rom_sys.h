@@ -0,0 +1,12 @@
+//
+// Host stand-in for the ESP-IDF header of the same name.
+//
+
+#ifndef HOST_ESP_ROM_SYS_H
+#define HOST_ESP_ROM_SYS_H
+
+#include <stdint.h>
+
+void esp_rom_delay_us(uint32_t us);
+
+#endif //HOST_ESP_ROM_SYS_H
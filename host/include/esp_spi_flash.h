@@ -0,0 +1,14 @@
+//
+// Host stand-in for the ESP-IDF header of the same name, only what partition mapping needs.
+//
+
+#ifndef HOST_ESP_SPI_FLASH_H
+#define HOST_ESP_SPI_FLASH_H
+
+#include <stdint.h>
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle);
+
+#endif //HOST_ESP_SPI_FLASH_H
@@ -0,0 +1,17 @@
+//
+// Host stand-in for the ESP-IDF header of the same name.
+// Shutdown handlers run from host_esp_restart(), which tools call where the firmware would reboot.
+//
+
+#ifndef HOST_ESP_SYSTEM_H
+#define HOST_ESP_SYSTEM_H
+
+#include "esp_err.h"
+
+typedef void (*shutdown_handler_t)(void);
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handle);
+esp_err_t esp_unregister_shutdown_handler(shutdown_handler_t handle);
+void host_esp_restart(void);
+
+#endif //HOST_ESP_SYSTEM_H
@@ -0,0 +1,38 @@
+//
+// Host stand-in for the FreeRTOS header of the same name.
+// The simulation never runs ISRs, timers and the task concurrently, so critical sections are empty.
+//
+
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_attr.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+#define portTICK_PERIOD_MS 10
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms) / portTICK_PERIOD_MS)
+
+typedef struct {
+    int owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) (void) (mux)
+#define portEXIT_CRITICAL(mux) (void) (mux)
+#define portENTER_CRITICAL_ISR(mux) (void) (mux)
+#define portEXIT_CRITICAL_ISR(mux) (void) (mux)
+#define portYIELD_FROM_ISR() do { } while (0)
+
+#endif //HOST_FREERTOS_H
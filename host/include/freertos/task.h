@@ -0,0 +1,39 @@
+//
+// Host stand-in for the FreeRTOS header of the same name.
+// host_sim implements the notification calls for the single task the button component uses,
+// host_rtos the rest on real threads.
+//
+
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include "FreeRTOS.h"
+
+#define tskIDLE_PRIORITY 0
+
+typedef struct host_task *TaskHandle_t;
+typedef TaskHandle_t xTaskHandle;
+typedef void (*TaskFunction_t)(void *arg);
+
+typedef enum {
+    eNoAction,
+    eSetBits,
+    eIncrement,
+    eSetValueWithOverwrite,
+    eSetValueWithoutOverwrite,
+} eNotifyAction;
+
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *created_task);
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action);
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action,
+                              BaseType_t *higher_priority_task_woken);
+BaseType_t xTaskNotifyWait(uint32_t bits_to_clear_on_entry, uint32_t bits_to_clear_on_exit,
+                           uint32_t *notification_value, TickType_t ticks_to_wait);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+TickType_t xTaskGetTickCount(void);
+void vTaskDelete(TaskHandle_t task);
+
+#endif //HOST_FREERTOS_TASK_H
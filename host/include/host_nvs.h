@@ -0,0 +1,65 @@
+//
+// RAM or file backed NVS behind the nvs.h and nvs_flash.h stand-ins.
+//
+// Values live in RAM; the flash underneath is only modelled to count what the real NVS would
+// do. Each page holds HOST_NVS_PAGE_ENTRIES 32 byte entries, an i32 takes one entry and a blob
+// two plus one per 32 bytes. Every set appends to the active page and marks the previous copy
+// stale, erase_key only marks. When no free page is left beyond the one NVS keeps in reserve,
+// the page with most stale entries has its live entries copied into the reserve and is erased.
+// A power cut can be scheduled like on host_partition: the chosen set, erase or commit is lost,
+// NVS writes an item whole or not at all, and every write after it fails until power is restored.
+//
+
+#ifndef HOST_NVS_STANDIN_H
+#define HOST_NVS_STANDIN_H
+
+//MARK: Import common headers
+#include <stdbool.h>
+#include <stdint.h>
+#include "nvs.h"
+
+//MARK: Macros and constants
+#define HOST_NVS_PAGE_ENTRIES 126
+#define HOST_NVS_ENTRY_SIZE 32
+#define HOST_NVS_MAX_PAGES 64
+
+//MARK: Types
+typedef struct {
+    uint32_t pages;                 // Partition size in 4 kB pages, the keyboard uses 6
+    const char *path;               // Load on nvs_flash_init, save on every commit, NULL for RAM only
+    uint32_t read_latency_us;       // Per get
+    uint32_t write_latency_us;      // Per entry written
+    uint32_t erase_latency_us;      // Per page erased
+    bool sleep;                     // Really wait out the latencies instead of only adding them up
+} host_nvs_config_t;
+
+typedef struct {
+    uint32_t reads;
+    uint32_t sets;
+    uint32_t erase_keys;
+    uint32_t commits;
+    uint32_t entry_writes;          // Including those moved by page reclaim
+    uint32_t page_erases;
+    uint64_t busy_us;               // Sum of the configured latencies of all of the above
+} host_nvs_stats_t;
+
+//MARK: Function prototypes
+/**
+ * Set up the model before nvs_flash_init. Without it a 6 page RAM partition with no latency is used.
+ */
+void host_nvs_configure(const host_nvs_config_t *config);
+void host_nvs_get_stats(host_nvs_stats_t *stats);
+void host_nvs_reset_stats(void);
+
+/**
+ * Cut the power at the set, erase_key or commit that follows operations more of them, 0 for the next.
+ */
+void host_nvs_power_cut(uint32_t operations);
+void host_nvs_power_restore(void);
+
+/**
+ * Entries in use, including stale ones not reclaimed yet, and entries the partition can hold.
+ */
+void host_nvs_get_usage(uint32_t *used_entries, uint32_t *total_entries);
+
+#endif //HOST_NVS_STANDIN_H
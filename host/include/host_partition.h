@@ -0,0 +1,51 @@
+//
+// RAM flash behind the esp_partition.h stand-in.
+//
+// Behaves like NOR flash: erase sets a whole sector to 0xFF, a write can only clear bits, so
+// it ANDs into what is there. Writes that try to set a bit are counted, real flash would keep
+// the zero. A power cut can be scheduled: the chosen program or erase only gets half way and
+// every call after it fails until power is restored, like a device that lost power mid-write.
+// esp_partition_mmap hands out a pointer straight into the RAM flash.
+//
+
+#ifndef HOST_PARTITION_STANDIN_H
+#define HOST_PARTITION_STANDIN_H
+
+//MARK: Import common headers
+#include <stdint.h>
+#include "esp_partition.h"
+
+//MARK: Macros and constants
+#define HOST_PARTITION_SECTOR_SIZE 4096
+#define HOST_PARTITION_MAX 8
+
+//MARK: Types
+typedef struct {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t bytes_written;
+    uint32_t erases;                // Sectors
+    uint32_t bit_sets;              // Writes that tried to turn a 0 into a 1
+    uint32_t max_sector_erases;     // Of the most worn sector
+    uint32_t mappings;              // Currently mapped with esp_partition_mmap
+} host_partition_stats_t;
+
+//MARK: Function prototypes
+/**
+ * Add an erased partition, placed after the ones added before. size is a multiple of the sector size.
+ */
+esp_err_t host_partition_add(const char *label, esp_partition_type_t type, uint8_t subtype, uint32_t size);
+/**
+ * Erase a partition and write a file into it, as flashing an image would.
+ */
+esp_err_t host_partition_load(const char *label, const char *path);
+esp_err_t host_partition_get_stats(const char *label, host_partition_stats_t *stats);
+uint32_t host_partition_sector_erases(const char *label, uint32_t sector);
+
+/**
+ * Cut the power during the program or erase that follows operations more of them, 0 for the next.
+ */
+void host_partition_power_cut(uint32_t operations);
+void host_partition_power_restore(void);
+
+#endif //HOST_PARTITION_STANDIN_H
@@ -0,0 +1,59 @@
+//
+// Deterministic host runtime behind the ESP-IDF/FreeRTOS stand-ins in this directory.
+//
+
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+//MARK: Import common headers
+#include <stdbool.h>
+#include <stdint.h>
+#include "driver/gpio.h"
+
+//MARK: Types
+/**
+ * Counters collected while the simulation runs.
+ * task_delay is the time between a notification and the task picking it up.
+ */
+typedef struct {
+    uint32_t isr_calls;
+    uint32_t timer_callbacks;
+    uint32_t task_runs;
+    int64_t worst_task_delay_us;
+} host_sim_stats_t;
+
+//MARK: Function prototypes
+/**
+ * Delay between a task notification and the notified task running, in simulated microseconds.
+ * Zero means the task runs as soon as the ISR or timer callback that notified it returns.
+ * A larger value models a busy CPU or a higher priority task holding it off.
+ */
+void host_sim_set_task_latency(int64_t latency_us);
+
+/**
+ * Drive an input pin as if the external circuit changed it, firing any enabled interrupt.
+ * Call host_sim_advance() first so timers and the task catch up to the edge time.
+ */
+void host_sim_set_level(gpio_num_t gpio_num, int level);
+
+/**
+ * Wire a key matrix between the given row and column pins. A pressed key connects its row and
+ * column, so a column reads low while any pressed key on it has its row driven low, and high
+ * from its pull-up otherwise. Keys are numbered row by row like BUTTON_MATRIX_KEY().
+ */
+void host_sim_set_matrix(const gpio_num_t *rows, uint8_t row_count, const gpio_num_t *cols, uint8_t col_count);
+
+/**
+ * Press or release a key of the matrix, firing any column interrupt this causes.
+ */
+void host_sim_set_key(int key, bool pressed);
+
+/**
+ * Move the simulated clock forward, running due timer callbacks and task wake-ups in time order.
+ */
+void host_sim_advance(int64_t until_us);
+
+int64_t host_sim_now(void);
+void host_sim_get_stats(host_sim_stats_t *stats);
+
+#endif //HOST_SIM_H
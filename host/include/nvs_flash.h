@@ -0,0 +1,14 @@
+//
+// Host stand-in for the ESP-IDF header of the same name.
+//
+
+#ifndef HOST_NVS_FLASH_H
+#define HOST_NVS_FLASH_H
+
+#include "nvs.h"
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_deinit(void);
+esp_err_t nvs_flash_erase(void);
+
+#endif //HOST_NVS_FLASH_H
@@ -0,0 +1,18 @@
+//
+// Host stand-in for the ESP-IDF header of the same name.
+// The input registers are plain words kept in sync with the simulated pin levels.
+//
+
+#ifndef HOST_SOC_GPIO_REG_H
+#define HOST_SOC_GPIO_REG_H
+
+#include <stdint.h>
+
+extern volatile uint32_t host_gpio_in_reg[2];
+
+#define GPIO_IN_REG 0
+#define GPIO_IN1_REG 1
+#define GPIO_IN1_DATA 0x000000FF
+#define REG_READ(reg) (host_gpio_in_reg[(reg)])
+
+#endif //HOST_SOC_GPIO_REG_H
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+#
+# Builds the image for the assets partition read by components/assets. Each table is given as
+# TYPE:ID:FILE, TYPE being layout, keymap, macros or a number, ID a number (the locale for
+# layouts). The format is described in components/assets/include/assets.h.
+#
+#   host/pack_assets.py -o build/assets.bin layout:0:us.bin layout:1:de.bin keymap:0:media.bin
+#   parttool.py write_partition --partition-name assets --input build/assets.bin
+#
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = 0x31545341          # "AST1"
+FORMAT_VERSION = 1
+ALIGN = 4
+PARTITION_SIZE = 0x40000    # assets in partition_table.csv
+TYPES = {"layout": 1, "keymap": 2, "macros": 3}
+
+HEADER = struct.Struct("<IHHII")
+ENTRY = struct.Struct("<HHIII")
+
+
+def parse_table(argument):
+    try:
+        kind, table_id, path = argument.split(":", 2)
+        kind = TYPES[kind] if kind in TYPES else int(kind, 0)
+        table_id = int(table_id, 0)
+    except (KeyError, ValueError):
+        raise argparse.ArgumentTypeError("expected TYPE:ID:FILE, got %r" % argument)
+    if not 0 <= kind <= 0xFFFF or not 0 <= table_id <= 0xFFFF:
+        raise argparse.ArgumentTypeError("type and id must fit in 16 bits: %r" % argument)
+    return kind, table_id, path
+
+
+def pack(tables):
+    tables = sorted(tables)
+    for previous, current in zip(tables, tables[1:]):
+        if previous[:2] == current[:2]:
+            raise ValueError("table %d:%d given twice" % current[:2])
+
+    offset = HEADER.size + ENTRY.size * len(tables)
+    index = b""
+    data = b""
+    for kind, table_id, path in tables:
+        with open(path, "rb") as file:
+            content = file.read()
+        # ESP-IDF's esp_rom_crc32_le(0, ...) is the zlib CRC-32
+        index += ENTRY.pack(kind, table_id, offset + len(data), len(content), zlib.crc32(content))
+        data += content + b"\xff" * (-len(content) % ALIGN)
+
+    size = offset + len(data)
+    header = HEADER.pack(MAGIC, FORMAT_VERSION, len(tables), size, zlib.crc32(index))
+    return header + index + data
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack tables into an assets partition image.")
+    parser.add_argument("-o", "--output", required=True, help="image file to write")
+    parser.add_argument("-s", "--size", type=lambda text: int(text, 0), default=PARTITION_SIZE,
+                        help="partition size to check against (default 0x%x)" % PARTITION_SIZE)
+    parser.add_argument("tables", nargs="+", type=parse_table, metavar="TYPE:ID:FILE")
+    arguments = parser.parse_args()
+
+    try:
+        image = pack(arguments.tables)
+    except (OSError, ValueError) as error:
+        sys.exit("pack_assets: %s" % error)
+    if len(image) > arguments.size:
+        sys.exit("pack_assets: image of %d bytes does not fit the %d byte partition" % (len(image), arguments.size))
+
+    with open(arguments.output, "wb") as file:
+        file.write(image)
+    print("%s: %d tables, %d of %d bytes" % (arguments.output, len(arguments.tables), len(image), arguments.size))
+
+
+if __name__ == "__main__":
+    main()
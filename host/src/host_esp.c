@@ -0,0 +1,128 @@
+//
+// Pieces of the ESP-IDF stand-ins shared by every host runtime.
+//
+
+//MARK: Import common headers
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "nvs.h"
+
+//MARK: Macros and constants
+#define HOST_ESP_MAX_SHUTDOWN_HANDLERS 8
+
+//MARK: Global variables
+bool host_log_verbose = false;
+
+static shutdown_handler_t shutdown_handlers[HOST_ESP_MAX_SHUTDOWN_HANDLERS];
+
+//MARK: ESP-IDF stand-ins
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK:
+            return "ESP_OK";
+        case ESP_FAIL:
+            return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:
+            return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:
+            return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:
+            return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:
+            return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND:
+            return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED:
+            return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT:
+            return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE:
+            return "ESP_ERR_INVALID_RESPONSE";
+        case ESP_ERR_INVALID_CRC:
+            return "ESP_ERR_INVALID_CRC";
+        case ESP_ERR_INVALID_VERSION:
+            return "ESP_ERR_INVALID_VERSION";
+        case ESP_ERR_NVS_NOT_INITIALIZED:
+            return "ESP_ERR_NVS_NOT_INITIALIZED";
+        case ESP_ERR_NVS_NOT_FOUND:
+            return "ESP_ERR_NVS_NOT_FOUND";
+        case ESP_ERR_NVS_TYPE_MISMATCH:
+            return "ESP_ERR_NVS_TYPE_MISMATCH";
+        case ESP_ERR_NVS_READ_ONLY:
+            return "ESP_ERR_NVS_READ_ONLY";
+        case ESP_ERR_NVS_NOT_ENOUGH_SPACE:
+            return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+        case ESP_ERR_NVS_INVALID_NAME:
+            return "ESP_ERR_NVS_INVALID_NAME";
+        case ESP_ERR_NVS_INVALID_HANDLE:
+            return "ESP_ERR_NVS_INVALID_HANDLE";
+        case ESP_ERR_NVS_KEY_TOO_LONG:
+            return "ESP_ERR_NVS_KEY_TOO_LONG";
+        case ESP_ERR_NVS_INVALID_LENGTH:
+            return "ESP_ERR_NVS_INVALID_LENGTH";
+        case ESP_ERR_NVS_NO_FREE_PAGES:
+            return "ESP_ERR_NVS_NO_FREE_PAGES";
+        case ESP_ERR_NVS_VALUE_TOO_LONG:
+            return "ESP_ERR_NVS_VALUE_TOO_LONG";
+        case ESP_ERR_NVS_NEW_VERSION_FOUND:
+            return "ESP_ERR_NVS_NEW_VERSION_FOUND";
+        default:
+            return "UNKNOWN ERROR";
+    }
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len) {
+    crc = ~crc;
+    while (len-- > 0) {
+        crc ^= *buf++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+uint16_t esp_rom_crc16_le(uint16_t crc, uint8_t const *buf, uint32_t len) {
+    crc = ~crc;
+    while (len-- > 0) {
+        crc ^= *buf++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x8408u : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handle) {
+    for (size_t i = 0; i < HOST_ESP_MAX_SHUTDOWN_HANDLERS; i++) {
+        if (shutdown_handlers[i] == NULL) {
+            shutdown_handlers[i] = handle;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_unregister_shutdown_handler(shutdown_handler_t handle) {
+    for (size_t i = 0; i < HOST_ESP_MAX_SHUTDOWN_HANDLERS; i++) {
+        if (shutdown_handlers[i] == handle) {
+            shutdown_handlers[i] = NULL;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_INVALID_STATE;
+}
+
+void host_esp_restart(void) {
+    // Newest first, like esp_restart
+    for (size_t i = HOST_ESP_MAX_SHUTDOWN_HANDLERS; i > 0; i--) {
+        if (shutdown_handlers[i - 1] != NULL) {
+            shutdown_handlers[i - 1]();
+        }
+    }
+}
@@ -0,0 +1,629 @@
+//
+// RAM or file backed NVS behind the nvs.h and nvs_flash.h stand-ins, see host_nvs.h.
+//
+// Values are kept per namespace, key and type like the real NVS does, so a blob and an i32
+// under the same key are two items. Next to the values it tracks how many entries of each
+// item sit on which page, which is all the page model needs to count writes and erases.
+//
+
+//MARK: Import common headers
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "host_nvs.h"
+
+//MARK: Macros and constants
+#define HOST_NVS_MAX_NAMESPACES 254
+#define HOST_NVS_DEFAULT_PAGES 6
+#define HOST_NVS_FILE_MAGIC "HNVS1"
+
+//MARK: Types
+typedef enum {
+    ITEM_I32 = 0,
+    ITEM_BLOB,
+} item_type_t;
+
+typedef struct {
+    bool used;
+    uint8_t namespace_index;
+    item_type_t type;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    size_t length;
+    uint8_t *data;
+    uint16_t entries[HOST_NVS_MAX_PAGES];   // Live entries of this item per page
+} item_t;
+
+typedef struct {
+    uint16_t used;                          // Entries written since the last erase, live or stale
+    uint16_t stale;
+} page_t;
+
+typedef struct {
+    bool open;
+    bool writable;
+    uint8_t namespace_index;
+} handle_t;
+
+typedef struct {
+    bool initialized;
+    host_nvs_config_t config;
+    host_nvs_stats_t stats;
+    pthread_mutex_t lock;
+    char namespaces[HOST_NVS_MAX_NAMESPACES][NVS_KEY_NAME_MAX_SIZE];
+    size_t namespace_count;
+    item_t *items;
+    size_t item_count;
+    handle_t *handles;
+    size_t handle_count;
+    page_t pages[HOST_NVS_MAX_PAGES];
+    uint32_t active_page;
+    uint16_t pending[HOST_NVS_MAX_PAGES];   // Entries of the value being written, not live yet
+    bool power_cut_pending;
+    bool power_off;
+    uint32_t operations_before_cut;
+} host_nvs_t;
+
+//MARK: Private global variables
+static host_nvs_t nvs = {
+        .config = {
+                .pages = HOST_NVS_DEFAULT_PAGES,
+        },
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+//MARK: Private functions
+static void host_nvs_busy(uint32_t count, uint32_t latency_us) {
+    uint64_t busy_us = (uint64_t) count * latency_us;
+    nvs.stats.busy_us += busy_us;
+    if (nvs.config.sleep && busy_us > 0) {
+        usleep(busy_us);
+    }
+}
+
+static uint32_t host_nvs_item_entries(item_type_t type, size_t length) {
+    if (type == ITEM_I32) {
+        return 1;
+    }
+    // Blob index entry, data header entry and the data itself
+    return 2 + (length + HOST_NVS_ENTRY_SIZE - 1) / HOST_NVS_ENTRY_SIZE;
+}
+
+/**
+ * Move every live entry off the victim page into the active one and erase the victim.
+ */
+static void host_nvs_reclaim(uint32_t victim) {
+    page_t *active = &nvs.pages[nvs.active_page];
+    for (size_t i = 0; i < nvs.item_count; i++) {
+        item_t *item = &nvs.items[i];
+        if (item->used && item->entries[victim] > 0) {
+            active->used += item->entries[victim];
+            item->entries[nvs.active_page] += item->entries[victim];
+            nvs.stats.entry_writes += item->entries[victim];
+            host_nvs_busy(item->entries[victim], nvs.config.write_latency_us);
+            item->entries[victim] = 0;
+        }
+    }
+    active->used += nvs.pending[victim];
+    nvs.pending[nvs.active_page] += nvs.pending[victim];
+    nvs.stats.entry_writes += nvs.pending[victim];
+    nvs.pending[victim] = 0;
+
+    nvs.pages[victim].used = 0;
+    nvs.pages[victim].stale = 0;
+    nvs.stats.page_erases++;
+    host_nvs_busy(1, nvs.config.erase_latency_us);
+}
+
+/**
+ * Switch to a fresh page, reclaiming the stalest one when only the reserve page is left.
+ */
+static esp_err_t host_nvs_next_page(void) {
+    uint32_t free_pages = 0;
+    uint32_t first_free = 0;
+    for (uint32_t i = 0; i < nvs.config.pages; i++) {
+        if (i != nvs.active_page && nvs.pages[i].used == 0) {
+            if (free_pages++ == 0) {
+                first_free = i;
+            }
+        }
+    }
+    if (free_pages >= 2) {
+        nvs.active_page = first_free;
+        return ESP_OK;
+    }
+
+    uint32_t victim = nvs.config.pages;
+    for (uint32_t i = 0; i < nvs.config.pages; i++) {
+        if (nvs.pages[i].stale > 0 && (victim == nvs.config.pages || nvs.pages[i].stale > nvs.pages[victim].stale)) {
+            victim = i;
+        }
+    }
+    if (free_pages == 0 || victim == nvs.config.pages) {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    nvs.active_page = first_free;
+    host_nvs_reclaim(victim);
+    return ESP_OK;
+}
+
+/**
+ * Append count entries for the value being written, into nvs.pending.
+ */
+static esp_err_t host_nvs_append(uint32_t count) {
+    while (count > 0) {
+        page_t *page = &nvs.pages[nvs.active_page];
+        uint32_t room = HOST_NVS_PAGE_ENTRIES - page->used;
+        if (room == 0) {
+            esp_err_t err = host_nvs_next_page();
+            if (err != ESP_OK) {
+                return err;
+            }
+            continue;
+        }
+        uint32_t part = count < room ? count : room;
+        page->used += part;
+        nvs.pending[nvs.active_page] += part;
+        nvs.stats.entry_writes += part;
+        host_nvs_busy(part, nvs.config.write_latency_us);
+        count -= part;
+    }
+    return ESP_OK;
+}
+
+static void host_nvs_mark_stale(uint16_t *entries) {
+    for (uint32_t i = 0; i < HOST_NVS_MAX_PAGES; i++) {
+        nvs.pages[i].stale += entries[i];
+        entries[i] = 0;
+    }
+}
+
+static item_t *host_nvs_find(uint8_t namespace_index, const char *key, item_type_t type) {
+    for (size_t i = 0; i < nvs.item_count; i++) {
+        item_t *item = &nvs.items[i];
+        if (item->used && item->namespace_index == namespace_index && item->type == type &&
+            strcmp(item->key, key) == 0) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+static item_t *host_nvs_item_alloc(void) {
+    for (size_t i = 0; i < nvs.item_count; i++) {
+        if (!nvs.items[i].used) {
+            return &nvs.items[i];
+        }
+    }
+    item_t *items = realloc(nvs.items, (nvs.item_count + 1) * sizeof(item_t));
+    if (items == NULL) {
+        return NULL;
+    }
+    nvs.items = items;
+    memset(&nvs.items[nvs.item_count], 0, sizeof(item_t));
+    return &nvs.items[nvs.item_count++];
+}
+
+/**
+ * Account for one set, erase or commit. ESP_FAIL if the power goes during this one or is gone.
+ */
+static esp_err_t host_nvs_power_step(void) {
+    if (nvs.power_cut_pending && nvs.operations_before_cut > 0) {
+        nvs.operations_before_cut--;
+    } else if (nvs.power_cut_pending) {
+        nvs.power_cut_pending = false;
+        nvs.power_off = true;
+    }
+    return nvs.power_off ? ESP_FAIL : ESP_OK;
+}
+
+/**
+ * Store a value the way NVS does: append the new copy, then retire the old one.
+ */
+static esp_err_t host_nvs_store(uint8_t namespace_index, const char *key, item_type_t type, const void *value,
+                                size_t length) {
+    uint8_t *data = malloc(length ? length : 1);
+    if (data == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(data, value, length);
+
+    memset(nvs.pending, 0, sizeof(nvs.pending));
+    esp_err_t err = host_nvs_append(host_nvs_item_entries(type, length));
+    item_t *item = host_nvs_find(namespace_index, key, type);
+    if (err == ESP_OK && item == NULL) {
+        item = host_nvs_item_alloc();
+        err = item == NULL ? ESP_ERR_NO_MEM : ESP_OK;
+    }
+    if (err != ESP_OK) {
+        // A failed write leaves dead entries behind on flash as well
+        host_nvs_mark_stale(nvs.pending);
+        free(data);
+        return err;
+    }
+
+    if (item->used) {
+        host_nvs_mark_stale(item->entries);
+        free(item->data);
+    } else {
+        memset(item, 0, sizeof(item_t));
+        item->used = true;
+        item->namespace_index = namespace_index;
+        item->type = type;
+        strcpy(item->key, key);
+    }
+    memcpy(item->entries, nvs.pending, sizeof(nvs.pending));
+    item->data = data;
+    item->length = length;
+    return ESP_OK;
+}
+
+static void host_nvs_clear(void) {
+    for (size_t i = 0; i < nvs.item_count; i++) {
+        free(nvs.items[i].data);
+    }
+    free(nvs.items);
+    nvs.items = NULL;
+    nvs.item_count = 0;
+    nvs.namespace_count = 0;
+    memset(nvs.pages, 0, sizeof(nvs.pages));
+    nvs.active_page = 0;
+}
+
+static esp_err_t host_nvs_save(void) {
+    FILE *file = fopen(nvs.config.path, "wb");
+    if (file == NULL) {
+        return ESP_FAIL;
+    }
+    fwrite(HOST_NVS_FILE_MAGIC, 1, sizeof(HOST_NVS_FILE_MAGIC), file);
+    for (size_t i = 0; i < nvs.item_count; i++) {
+        item_t *item = &nvs.items[i];
+        if (!item->used) {
+            continue;
+        }
+        uint8_t type = item->type;
+        uint32_t length = item->length;
+        fwrite(nvs.namespaces[item->namespace_index], 1, NVS_KEY_NAME_MAX_SIZE, file);
+        fwrite(item->key, 1, NVS_KEY_NAME_MAX_SIZE, file);
+        fwrite(&type, 1, 1, file);
+        fwrite(&length, sizeof(length), 1, file);
+        fwrite(item->data, 1, item->length, file);
+    }
+    return fclose(file) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static uint8_t host_nvs_namespace_add(const char *name) {
+    for (size_t i = 0; i < nvs.namespace_count; i++) {
+        if (strcmp(nvs.namespaces[i], name) == 0) {
+            return i;
+        }
+    }
+    strcpy(nvs.namespaces[nvs.namespace_count], name);
+    return nvs.namespace_count++;
+}
+
+/**
+ * Rebuild the partition from a file written by host_nvs_save, compacted, without counting it.
+ */
+static esp_err_t host_nvs_load(void) {
+    FILE *file = fopen(nvs.config.path, "rb");
+    if (file == NULL) {
+        return ESP_OK;
+    }
+
+    char magic[sizeof(HOST_NVS_FILE_MAGIC)];
+    esp_err_t err = ESP_OK;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, HOST_NVS_FILE_MAGIC, sizeof(magic)) != 0) {
+        err = ESP_ERR_NVS_NEW_VERSION_FOUND;
+    }
+
+    host_nvs_stats_t stats = nvs.stats;
+    char name[NVS_KEY_NAME_MAX_SIZE];
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t type;
+    uint32_t length;
+    while (err == ESP_OK && fread(name, 1, sizeof(name), file) == sizeof(name)) {
+        if (fread(key, 1, sizeof(key), file) != sizeof(key) || fread(&type, 1, 1, file) != 1 ||
+            fread(&length, sizeof(length), 1, file) != 1) {
+            err = ESP_ERR_NVS_NEW_VERSION_FOUND;
+            break;
+        }
+        uint8_t *data = malloc(length ? length : 1);
+        if (data == NULL || fread(data, 1, length, file) != length) {
+            err = data == NULL ? ESP_ERR_NO_MEM : ESP_ERR_NVS_NEW_VERSION_FOUND;
+            free(data);
+            break;
+        }
+        name[NVS_KEY_NAME_MAX_SIZE - 1] = '\0';
+        key[NVS_KEY_NAME_MAX_SIZE - 1] = '\0';
+        err = host_nvs_store(host_nvs_namespace_add(name), key, type, data, length);
+        free(data);
+    }
+    fclose(file);
+    nvs.stats = stats;
+    return err;
+}
+
+static handle_t *host_nvs_handle(nvs_handle_t handle) {
+    if (!nvs.initialized || handle == 0 || handle > nvs.handle_count || !nvs.handles[handle - 1].open) {
+        return NULL;
+    }
+    return &nvs.handles[handle - 1];
+}
+
+static esp_err_t host_nvs_get(nvs_handle_t handle, const char *key, item_type_t type, item_t **item) {
+    handle_t *open_handle = host_nvs_handle(handle);
+    if (open_handle == NULL) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    nvs.stats.reads++;
+    host_nvs_busy(1, nvs.config.read_latency_us);
+    *item = host_nvs_find(open_handle->namespace_index, key, type);
+    return *item == NULL ? ESP_ERR_NVS_NOT_FOUND : ESP_OK;
+}
+
+static esp_err_t host_nvs_set(nvs_handle_t handle, const char *key, item_type_t type, const void *value,
+                              size_t length) {
+    handle_t *open_handle = host_nvs_handle(handle);
+    if (open_handle == NULL) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (!open_handle->writable) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    if (host_nvs_power_step() != ESP_OK) {
+        return ESP_FAIL;
+    }
+    nvs.stats.sets++;
+    return host_nvs_store(open_handle->namespace_index, key, type, value, length);
+}
+
+//MARK: Public functions
+void host_nvs_configure(const host_nvs_config_t *config) {
+    pthread_mutex_lock(&nvs.lock);
+    nvs.config = *config;
+    if (nvs.config.pages < 2 || nvs.config.pages > HOST_NVS_MAX_PAGES) {
+        nvs.config.pages = HOST_NVS_DEFAULT_PAGES;
+    }
+    pthread_mutex_unlock(&nvs.lock);
+}
+
+void host_nvs_get_stats(host_nvs_stats_t *stats) {
+    pthread_mutex_lock(&nvs.lock);
+    *stats = nvs.stats;
+    pthread_mutex_unlock(&nvs.lock);
+}
+
+void host_nvs_reset_stats(void) {
+    pthread_mutex_lock(&nvs.lock);
+    memset(&nvs.stats, 0, sizeof(nvs.stats));
+    pthread_mutex_unlock(&nvs.lock);
+}
+
+void host_nvs_power_cut(uint32_t operations) {
+    pthread_mutex_lock(&nvs.lock);
+    nvs.power_cut_pending = true;
+    nvs.operations_before_cut = operations;
+    pthread_mutex_unlock(&nvs.lock);
+}
+
+void host_nvs_power_restore(void) {
+    pthread_mutex_lock(&nvs.lock);
+    nvs.power_cut_pending = false;
+    nvs.power_off = false;
+    pthread_mutex_unlock(&nvs.lock);
+}
+
+void host_nvs_get_usage(uint32_t *used_entries, uint32_t *total_entries) {
+    pthread_mutex_lock(&nvs.lock);
+    *used_entries = 0;
+    for (uint32_t i = 0; i < nvs.config.pages; i++) {
+        *used_entries += nvs.pages[i].used;
+    }
+    *total_entries = nvs.config.pages * HOST_NVS_PAGE_ENTRIES;
+    pthread_mutex_unlock(&nvs.lock);
+}
+
+esp_err_t nvs_flash_init(void) {
+    pthread_mutex_lock(&nvs.lock);
+    esp_err_t err = ESP_OK;
+    if (!nvs.initialized) {
+        // RAM contents survive a deinit like flash does, a file is read again
+        if (nvs.config.path != NULL) {
+            host_nvs_clear();
+            err = host_nvs_load();
+        }
+        nvs.initialized = err == ESP_OK;
+    }
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
+
+esp_err_t nvs_flash_deinit(void) {
+    pthread_mutex_lock(&nvs.lock);
+    nvs.initialized = false;
+    free(nvs.handles);
+    nvs.handles = NULL;
+    nvs.handle_count = 0;
+    pthread_mutex_unlock(&nvs.lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    pthread_mutex_lock(&nvs.lock);
+    host_nvs_clear();
+    nvs.stats.page_erases += nvs.config.pages;
+    host_nvs_busy(nvs.config.pages, nvs.config.erase_latency_us);
+    esp_err_t err = nvs.config.path != NULL ? host_nvs_save() : ESP_OK;
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+    if (name == NULL || strlen(name) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+
+    pthread_mutex_lock(&nvs.lock);
+    esp_err_t err = ESP_OK;
+    size_t index = 0;
+    while (index < nvs.namespace_count && strcmp(nvs.namespaces[index], name) != 0) {
+        index++;
+    }
+    if (!nvs.initialized) {
+        err = ESP_ERR_NVS_NOT_INITIALIZED;
+    } else if (index == nvs.namespace_count && open_mode == NVS_READONLY) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (index == nvs.namespace_count && index == HOST_NVS_MAX_NAMESPACES) {
+        err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    } else if (index == nvs.namespace_count) {
+        // A new namespace costs one entry of its own
+        memset(nvs.pending, 0, sizeof(nvs.pending));
+        err = host_nvs_append(1);
+        if (err == ESP_OK) {
+            host_nvs_namespace_add(name);
+        }
+    }
+
+    handle_t *handles = NULL;
+    if (err == ESP_OK) {
+        handles = realloc(nvs.handles, (nvs.handle_count + 1) * sizeof(handle_t));
+        err = handles == NULL ? ESP_ERR_NO_MEM : ESP_OK;
+    }
+    if (err == ESP_OK) {
+        nvs.handles = handles;
+        nvs.handles[nvs.handle_count] = (handle_t) {
+                .open = true,
+                .writable = open_mode == NVS_READWRITE,
+                .namespace_index = index,
+        };
+        *out_handle = ++nvs.handle_count;
+    }
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
+
+void nvs_close(nvs_handle_t handle) {
+    pthread_mutex_lock(&nvs.lock);
+    handle_t *open_handle = host_nvs_handle(handle);
+    if (open_handle != NULL) {
+        open_handle->open = false;
+    }
+    pthread_mutex_unlock(&nvs.lock);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length) {
+    pthread_mutex_lock(&nvs.lock);
+    item_t *item;
+    esp_err_t err = host_nvs_get(handle, key, ITEM_BLOB, &item);
+    if (err == ESP_OK && out_value != NULL && *length < item->length) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else if (err == ESP_OK && out_value != NULL) {
+        memcpy(out_value, item->data, item->length);
+    }
+    if (err == ESP_OK || err == ESP_ERR_NVS_INVALID_LENGTH) {
+        *length = item->length;
+    }
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+    pthread_mutex_lock(&nvs.lock);
+    esp_err_t err = host_nvs_set(handle, key, ITEM_BLOB, value, length);
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
+
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *out_value) {
+    pthread_mutex_lock(&nvs.lock);
+    item_t *item;
+    esp_err_t err = host_nvs_get(handle, key, ITEM_I32, &item);
+    if (err == ESP_OK) {
+        memcpy(out_value, item->data, sizeof(int32_t));
+    }
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
+
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value) {
+    pthread_mutex_lock(&nvs.lock);
+    esp_err_t err = host_nvs_set(handle, key, ITEM_I32, &value, sizeof(value));
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    pthread_mutex_lock(&nvs.lock);
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    handle_t *open_handle = host_nvs_handle(handle);
+    if (open_handle == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (!open_handle->writable) {
+        err = ESP_ERR_NVS_READ_ONLY;
+    } else if (key == NULL || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        err = ESP_ERR_NVS_KEY_TOO_LONG;
+    } else if (host_nvs_power_step() != ESP_OK) {
+        err = ESP_FAIL;
+    } else {
+        nvs.stats.erase_keys++;
+        // Any type, the key names the item
+        for (item_type_t type = ITEM_I32; type <= ITEM_BLOB; type++) {
+            item_t *item = host_nvs_find(open_handle->namespace_index, key, type);
+            if (item != NULL) {
+                host_nvs_mark_stale(item->entries);
+                free(item->data);
+                item->data = NULL;
+                item->used = false;
+                err = ESP_OK;
+            }
+        }
+    }
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
+
+esp_err_t nvs_get_stats(const char *part_name, nvs_stats_t *nvs_stats) {
+    pthread_mutex_lock(&nvs.lock);
+    esp_err_t err = nvs.initialized ? ESP_OK : ESP_ERR_NVS_NOT_INITIALIZED;
+    if (err == ESP_OK) {
+        nvs_stats->used_entries = 0;
+        for (uint32_t i = 0; i < nvs.config.pages; i++) {
+            nvs_stats->used_entries += nvs.pages[i].used;
+        }
+        nvs_stats->total_entries = nvs.config.pages * HOST_NVS_PAGE_ENTRIES;
+        nvs_stats->free_entries = nvs_stats->total_entries - nvs_stats->used_entries;
+        nvs_stats->namespace_count = nvs.namespace_count;
+    }
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    pthread_mutex_lock(&nvs.lock);
+    esp_err_t err = ESP_OK;
+    if (host_nvs_handle(handle) == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (host_nvs_power_step() != ESP_OK) {
+        err = ESP_FAIL;
+    } else {
+        nvs.stats.commits++;
+        if (nvs.config.path != NULL) {
+            err = host_nvs_save();
+        }
+    }
+    pthread_mutex_unlock(&nvs.lock);
+    return err;
+}
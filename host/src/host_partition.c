@@ -0,0 +1,274 @@
+//
+// RAM flash behind the esp_partition.h stand-in, see host_partition.h.
+//
+
+//MARK: Import common headers
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_partition.h"
+#include "host_partition.h"
+
+//MARK: Macros and constants
+#define HOST_PARTITION_FIRST_ADDRESS 0x110000
+
+//MARK: Types
+typedef struct {
+    esp_partition_t partition;
+    uint8_t *flash;
+    uint32_t *sector_erases;
+    host_partition_stats_t stats;
+} host_partition_t;
+
+typedef enum {
+    POWER_ON = 0,
+    POWER_CUT_PENDING,
+    POWER_OFF,
+} power_state_t;
+
+//MARK: Private global variables
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static host_partition_t partitions[HOST_PARTITION_MAX];
+static size_t partition_count;
+static power_state_t power = POWER_ON;
+static uint32_t operations_before_cut;
+
+//MARK: Private functions
+static host_partition_t *host_partition_find(const char *label) {
+    for (size_t i = 0; i < partition_count; i++) {
+        if (strcmp(partitions[i].partition.label, label) == 0) {
+            return &partitions[i];
+        }
+    }
+    return NULL;
+}
+
+static host_partition_t *host_partition_of(const esp_partition_t *partition) {
+    for (size_t i = 0; i < partition_count; i++) {
+        if (&partitions[i].partition == partition) {
+            return &partitions[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Account for one program or erase. Returns false if the power goes during this one.
+ */
+static bool host_partition_power_step(void) {
+    if (power != POWER_CUT_PENDING) {
+        return true;
+    }
+    if (operations_before_cut > 0) {
+        operations_before_cut--;
+        return true;
+    }
+    power = POWER_OFF;
+    return false;
+}
+
+static esp_err_t host_partition_check(const host_partition_t *host, size_t offset, size_t size) {
+    if (host == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (offset > host->partition.size || size > host->partition.size - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return power == POWER_OFF ? ESP_FAIL : ESP_OK;
+}
+
+//MARK: ESP-IDF stand-ins
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label) {
+    pthread_mutex_lock(&lock);
+    const esp_partition_t *found = NULL;
+    for (size_t i = 0; i < partition_count && found == NULL; i++) {
+        const esp_partition_t *partition = &partitions[i].partition;
+        if (partition->type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || partition->subtype == subtype) &&
+            (label == NULL || strcmp(partition->label, label) == 0)) {
+            found = partition;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size) {
+    pthread_mutex_lock(&lock);
+    host_partition_t *host = host_partition_of(partition);
+    esp_err_t err = host_partition_check(host, src_offset, size);
+    if (err == ESP_OK) {
+        memcpy(dst, &host->flash[src_offset], size);
+        host->stats.reads++;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size) {
+    pthread_mutex_lock(&lock);
+    host_partition_t *host = host_partition_of(partition);
+    esp_err_t err = host_partition_check(host, dst_offset, size);
+    if (err == ESP_OK) {
+        const uint8_t *bytes = src;
+        size_t programmed = size;
+        if (!host_partition_power_step()) {
+            programmed = size / 2;
+            err = ESP_FAIL;
+        }
+        for (size_t i = 0; i < programmed; i++) {
+            uint8_t *cell = &host->flash[dst_offset + i];
+            if (bytes[i] & ~*cell) {
+                host->stats.bit_sets++;
+            }
+            *cell &= bytes[i];
+        }
+        host->stats.writes++;
+        host->stats.bytes_written += programmed;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size) {
+    pthread_mutex_lock(&lock);
+    host_partition_t *host = host_partition_of(partition);
+    esp_err_t err = host_partition_check(host, offset, size);
+    if (err == ESP_OK && (offset % HOST_PARTITION_SECTOR_SIZE != 0 || size % HOST_PARTITION_SECTOR_SIZE != 0)) {
+        err = ESP_ERR_INVALID_ARG;
+    }
+    for (size_t sector = offset / HOST_PARTITION_SECTOR_SIZE;
+         err == ESP_OK && sector < (offset + size) / HOST_PARTITION_SECTOR_SIZE; sector++) {
+        size_t erased = HOST_PARTITION_SECTOR_SIZE;
+        if (!host_partition_power_step()) {
+            erased /= 2;
+            err = ESP_FAIL;
+        }
+        memset(&host->flash[sector * HOST_PARTITION_SECTOR_SIZE], 0xFF, erased);
+        host->sector_erases[sector]++;
+        host->stats.erases++;
+        if (host->sector_erases[sector] > host->stats.max_sector_erases) {
+            host->stats.max_sector_erases = host->sector_erases[sector];
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             esp_partition_mmap_memory_t memory, const void **out_ptr,
+                             spi_flash_mmap_handle_t *out_handle) {
+    pthread_mutex_lock(&lock);
+    host_partition_t *host = host_partition_of(partition);
+    esp_err_t err = host_partition_check(host, offset, size);
+    if (err == ESP_OK) {
+        *out_ptr = &host->flash[offset];
+        *out_handle = (spi_flash_mmap_handle_t) (host - partitions);
+        host->stats.mappings++;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle) {
+    pthread_mutex_lock(&lock);
+    if (handle < partition_count && partitions[handle].stats.mappings > 0) {
+        partitions[handle].stats.mappings--;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+//MARK: Host functions
+esp_err_t host_partition_add(const char *label, esp_partition_type_t type, uint8_t subtype, uint32_t size) {
+    if (label == NULL || strlen(label) >= sizeof(partitions[0].partition.label) || size == 0 ||
+        size % HOST_PARTITION_SECTOR_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&lock);
+    esp_err_t err = ESP_OK;
+    if (partition_count == HOST_PARTITION_MAX || host_partition_find(label) != NULL) {
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        host_partition_t *host = &partitions[partition_count];
+        host->flash = malloc(size);
+        host->sector_erases = calloc(size / HOST_PARTITION_SECTOR_SIZE, sizeof(uint32_t));
+        if (host->flash == NULL || host->sector_erases == NULL) {
+            free(host->flash);
+            free(host->sector_erases);
+            err = ESP_ERR_NO_MEM;
+        } else {
+            memset(host->flash, 0xFF, size);
+            host->partition.type = type;
+            host->partition.subtype = (esp_partition_subtype_t) subtype;
+            host->partition.size = size;
+            host->partition.address = partition_count == 0 ? HOST_PARTITION_FIRST_ADDRESS :
+                                      partitions[partition_count - 1].partition.address +
+                                      partitions[partition_count - 1].partition.size;
+            strcpy(host->partition.label, label);
+            memset(&host->stats, 0, sizeof(host_partition_stats_t));
+            partition_count++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+esp_err_t host_partition_load(const char *label, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    pthread_mutex_lock(&lock);
+    host_partition_t *host = host_partition_find(label);
+    esp_err_t err = host != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+    if (err == ESP_OK) {
+        memset(host->flash, 0xFF, host->partition.size);
+        size_t length = fread(host->flash, 1, host->partition.size, file);
+        if (ferror(file) || (length == host->partition.size && fgetc(file) != EOF)) {
+            err = ESP_ERR_INVALID_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    fclose(file);
+    return err;
+}
+
+esp_err_t host_partition_get_stats(const char *label, host_partition_stats_t *stats) {
+    pthread_mutex_lock(&lock);
+    host_partition_t *host = host_partition_find(label);
+    if (host != NULL) {
+        *stats = host->stats;
+    }
+    pthread_mutex_unlock(&lock);
+    return host != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+uint32_t host_partition_sector_erases(const char *label, uint32_t sector) {
+    pthread_mutex_lock(&lock);
+    host_partition_t *host = host_partition_find(label);
+    uint32_t erases = 0;
+    if (host != NULL && sector < host->partition.size / HOST_PARTITION_SECTOR_SIZE) {
+        erases = host->sector_erases[sector];
+    }
+    pthread_mutex_unlock(&lock);
+    return erases;
+}
+
+void host_partition_power_cut(uint32_t operations) {
+    pthread_mutex_lock(&lock);
+    power = POWER_CUT_PENDING;
+    operations_before_cut = operations;
+    pthread_mutex_unlock(&lock);
+}
+
+void host_partition_power_restore(void) {
+    pthread_mutex_lock(&lock);
+    power = POWER_ON;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,336 @@
+//
+// FreeRTOS stand-ins on real threads and the real clock, for components that run their own
+// tasks, queues and software timers. Unlike host_sim nothing here is deterministic; it is meant
+// for unit tests and benchmarks, not for replays. Do not link both into one program.
+//
+// Timer callbacks run on one service thread, as with the FreeRTOS timer task.
+//
+
+//MARK: Import common headers
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+
+//MARK: Types
+struct host_task {
+    TaskFunction_t code;
+    void *arg;
+    uint32_t notifications;
+};
+
+struct host_semaphore {
+    pthread_mutex_t mutex;
+};
+
+struct host_queue {
+    size_t length;
+    size_t item_size;
+    size_t head;
+    size_t count;
+    uint8_t *items;
+};
+
+struct host_timer {
+    TimerCallbackFunction_t callback;
+    TickType_t period;
+    bool auto_reload;
+    bool active;
+    TickType_t expiry;
+    struct host_timer *next;
+};
+
+//MARK: Private global variables
+static pthread_mutex_t rtos_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rtos_changed;
+static pthread_once_t rtos_once = PTHREAD_ONCE_INIT;
+static __thread struct host_task *current_task;
+
+static struct host_timer *timers;
+static pthread_t timer_thread;
+static bool timer_thread_started;
+
+//MARK: Private functions
+static void host_rtos_init(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rtos_changed, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static uint64_t host_rtos_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Wait on rtos_changed for up to ticks, with rtos_lock held. False once the time is up.
+ */
+static bool host_rtos_wait(TickType_t ticks) {
+    if (ticks == portMAX_DELAY) {
+        pthread_cond_wait(&rtos_changed, &rtos_lock);
+        return true;
+    }
+
+    uint64_t deadline_ms = host_rtos_now_ms() + (uint64_t) ticks * portTICK_PERIOD_MS;
+    struct timespec deadline = {
+            .tv_sec = deadline_ms / 1000,
+            .tv_nsec = (deadline_ms % 1000) * 1000000,
+    };
+    return pthread_cond_timedwait(&rtos_changed, &rtos_lock, &deadline) != ETIMEDOUT;
+}
+
+static void *host_rtos_task_thread(void *arg) {
+    current_task = arg;
+    current_task->code(current_task->arg);
+    return NULL;
+}
+
+static void *host_rtos_timer_thread(void *arg) {
+    pthread_mutex_lock(&rtos_lock);
+    for (;;) {
+        TickType_t now = xTaskGetTickCount();
+        struct host_timer *due = NULL;
+        TickType_t wait = portMAX_DELAY;
+        for (struct host_timer *timer = timers; timer != NULL; timer = timer->next) {
+            if (!timer->active) {
+                continue;
+            }
+            if ((int32_t) (timer->expiry - now) <= 0) {
+                due = timer;
+                break;
+            }
+            if (timer->expiry - now < wait) {
+                wait = timer->expiry - now;
+            }
+        }
+
+        if (due == NULL) {
+            host_rtos_wait(wait);
+            continue;
+        }
+        due->active = due->auto_reload;
+        due->expiry = now + due->period;
+        pthread_mutex_unlock(&rtos_lock);
+        due->callback(due);
+        pthread_mutex_lock(&rtos_lock);
+    }
+    return NULL;
+}
+
+static BaseType_t host_rtos_timer_start(TimerHandle_t timer, TickType_t period) {
+    pthread_mutex_lock(&rtos_lock);
+    timer->period = period;
+    timer->active = true;
+    timer->expiry = xTaskGetTickCount() + period;
+    if (!timer_thread_started) {
+        timer_thread_started = pthread_create(&timer_thread, NULL, host_rtos_timer_thread, NULL) == 0;
+    }
+    pthread_cond_broadcast(&rtos_changed);
+    pthread_mutex_unlock(&rtos_lock);
+    return timer_thread_started ? pdPASS : pdFAIL;
+}
+
+//MARK: ESP-IDF stand-ins
+int64_t esp_timer_get_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//MARK: FreeRTOS stand-ins
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t) (host_rtos_now_ms() / portTICK_PERIOD_MS);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *created_task) {
+    pthread_once(&rtos_once, host_rtos_init);
+    struct host_task *task = calloc(1, sizeof(struct host_task));
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    task->code = task_code;
+    task->arg = arg;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, host_rtos_task_thread, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+    if (created_task != NULL) {
+        *created_task = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    // Only self deletion, which is all the components do
+    if (task == NULL || task == current_task) {
+        pthread_exit(NULL);
+    }
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    if (current_task == NULL) {
+        // Threads the tool started itself, e.g. main
+        current_task = calloc(1, sizeof(struct host_task));
+    }
+    return current_task;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_once(&rtos_once, host_rtos_init);
+    pthread_mutex_lock(&rtos_lock);
+    task->notifications++;
+    pthread_cond_broadcast(&rtos_changed);
+    pthread_mutex_unlock(&rtos_lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait) {
+    pthread_once(&rtos_once, host_rtos_init);
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    pthread_mutex_lock(&rtos_lock);
+    while (task->notifications == 0 && host_rtos_wait(ticks_to_wait)) {
+    }
+    uint32_t value = task->notifications;
+    if (value > 0) {
+        task->notifications = clear_count_on_exit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&rtos_lock);
+    return value;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    struct host_semaphore *semaphore = malloc(sizeof(struct host_semaphore));
+    if (semaphore != NULL) {
+        pthread_mutex_init(&semaphore->mutex, NULL);
+    }
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+    if (ticks_to_wait == portMAX_DELAY) {
+        return pthread_mutex_lock(&semaphore->mutex) == 0 ? pdTRUE : pdFALSE;
+    }
+    return pthread_mutex_trylock(&semaphore->mutex) == 0 ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return pthread_mutex_unlock(&semaphore->mutex) == 0 ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    pthread_mutex_destroy(&semaphore->mutex);
+    free(semaphore);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    pthread_once(&rtos_once, host_rtos_init);
+    struct host_queue *queue = calloc(1, sizeof(struct host_queue));
+    if (queue == NULL) {
+        return NULL;
+    }
+    queue->items = malloc(length * item_size);
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+    pthread_mutex_lock(&rtos_lock);
+    while (queue->count == queue->length && ticks_to_wait > 0 && host_rtos_wait(ticks_to_wait)) {
+    }
+    BaseType_t sent = queue->count < queue->length;
+    if (sent) {
+        size_t tail = (queue->head + queue->count) % queue->length;
+        memcpy(&queue->items[tail * queue->item_size], item, queue->item_size);
+        queue->count++;
+        pthread_cond_broadcast(&rtos_changed);
+    }
+    pthread_mutex_unlock(&rtos_lock);
+    return sent ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait) {
+    pthread_mutex_lock(&rtos_lock);
+    while (queue->count == 0 && ticks_to_wait > 0 && host_rtos_wait(ticks_to_wait)) {
+    }
+    BaseType_t received = queue->count > 0;
+    if (received) {
+        memcpy(item, &queue->items[queue->head * queue->item_size], queue->item_size);
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        pthread_cond_broadcast(&rtos_changed);
+    }
+    pthread_mutex_unlock(&rtos_lock);
+    return received ? pdTRUE : pdFALSE;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    free(queue->items);
+    free(queue);
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t auto_reload, void *timer_id,
+                           TimerCallbackFunction_t callback) {
+    pthread_once(&rtos_once, host_rtos_init);
+    struct host_timer *timer = calloc(1, sizeof(struct host_timer));
+    if (timer == NULL) {
+        return NULL;
+    }
+    timer->callback = callback;
+    timer->period = period;
+    timer->auto_reload = auto_reload;
+
+    pthread_mutex_lock(&rtos_lock);
+    timer->next = timers;
+    timers = timer;
+    pthread_mutex_unlock(&rtos_lock);
+    return timer;
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer) {
+    pthread_mutex_lock(&rtos_lock);
+    BaseType_t active = timer->active;
+    pthread_mutex_unlock(&rtos_lock);
+    return active ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks_to_wait) {
+    return host_rtos_timer_start(timer, period);
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t ticks_to_wait) {
+    return host_rtos_timer_start(timer, timer->period);
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks_to_wait) {
+    pthread_mutex_lock(&rtos_lock);
+    timer->active = false;
+    pthread_mutex_unlock(&rtos_lock);
+    return pdPASS;
+}
+
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t ticks_to_wait) {
+    // Stays on the list, the service thread may still be in its callback
+    return xTimerStop(timer, ticks_to_wait);
+}
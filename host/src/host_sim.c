@@ -0,0 +1,508 @@
+//
+// Deterministic host runtime behind the ESP-IDF/FreeRTOS stand-ins in this directory.
+//
+// ISRs, esp_timer callbacks and the notified task never run at the same time. The task lives
+// on its own thread so its blocking loop works unchanged, but it only runs while the caller of
+// host_sim_advance()/host_sim_set_level() waits for it to block again. Everything therefore
+// happens in simulated time and a replay gives the same result on every run.
+//
+
+//MARK: Import common headers
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "driver/pcnt.h"
+#include "soc/gpio_reg.h"
+#include "host_sim.h"
+
+//MARK: Macros and constants
+#define HOST_SIM_MAX_TIMERS 16
+#define HOST_SIM_MATRIX_MAX_LINES 8
+
+//MARK: Types
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    bool active;
+    int64_t alarm;
+    uint64_t period;
+};
+
+struct host_task {
+    pthread_t thread;
+    TaskFunction_t code;
+    void *arg;
+    bool running;
+    uint32_t value;
+    int64_t notified_at;
+};
+
+typedef struct {
+    int level[GPIO_NUM_MAX];
+    gpio_int_type_t intr_type[GPIO_NUM_MAX];
+    gpio_isr_t isr[GPIO_NUM_MAX];
+    void *isr_arg[GPIO_NUM_MAX];
+    bool edge[GPIO_NUM_MAX];
+} gpio_state_t;
+
+typedef struct {
+    bool configured;
+    bool counting;
+    int pin_a;
+    int pin_b;
+    uint8_t state;
+    int16_t count;
+} pcnt_state_t;
+
+typedef struct {
+    gpio_num_t rows[HOST_SIM_MATRIX_MAX_LINES];
+    gpio_num_t cols[HOST_SIM_MATRIX_MAX_LINES];
+    uint8_t row_count;
+    uint8_t col_count;
+    uint64_t pressed;       // Bit row * col_count + col
+} matrix_state_t;
+
+typedef struct {
+    int64_t now;
+    int64_t task_latency_us;
+    gpio_state_t gpio;
+    pcnt_state_t pcnt;
+    matrix_state_t matrix;
+    struct esp_timer timers[HOST_SIM_MAX_TIMERS];
+    size_t timer_count;
+    struct host_task task;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    host_sim_stats_t stats;
+} host_sim_t;
+
+//MARK: Global variables
+volatile uint32_t host_gpio_in_reg[2];
+
+static host_sim_t sim = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+};
+
+// Same quadrature table as the button encoder, the PCNT unit below counts x4
+static const int8_t quadrature_table[16] = {
+        0, -1, 1, 0,
+        1, 0, 0, -1,
+        -1, 0, 0, 1,
+        0, 1, -1, 0,
+};
+
+//MARK: Private functions
+static void host_sim_update_registers(void) {
+    uint32_t in[2] = {0, 0};
+    for (int pin = 0; pin < GPIO_NUM_MAX; pin++) {
+        if (sim.gpio.level[pin]) {
+            in[pin / 32] |= 1u << (pin % 32);
+        }
+    }
+    host_gpio_in_reg[0] = in[0];
+    host_gpio_in_reg[1] = in[1];
+}
+
+static void host_sim_pcnt_update(void) {
+    pcnt_state_t *pcnt = &sim.pcnt;
+    if (!pcnt->configured) {
+        return;
+    }
+    uint8_t state = (sim.gpio.level[pcnt->pin_a] ? 2 : 0) | (sim.gpio.level[pcnt->pin_b] ? 1 : 0);
+    if (pcnt->counting) {
+        pcnt->count += quadrature_table[(pcnt->state << 2) | state];
+    }
+    pcnt->state = state;
+}
+
+static void host_sim_set_pin(int pin, int level) {
+    level = level ? 1 : 0;
+    if (sim.gpio.level[pin] != level) {
+        gpio_int_type_t type = sim.gpio.intr_type[pin];
+        if (type == GPIO_INTR_ANYEDGE ||
+            (type == GPIO_INTR_POSEDGE && level) ||
+            (type == GPIO_INTR_NEGEDGE && !level)) {
+            sim.gpio.edge[pin] = true;
+        }
+    }
+    sim.gpio.level[pin] = level;
+}
+
+/**
+ * Give every matrix column the level its pull-up and the pressed keys on driven rows make.
+ */
+static void host_sim_matrix_update(void) {
+    matrix_state_t *matrix = &sim.matrix;
+    for (int col = 0; col < matrix->col_count; col++) {
+        int level = 1;
+        for (int row = 0; row < matrix->row_count; row++) {
+            if ((matrix->pressed & (1ULL << (row * matrix->col_count + col))) && !sim.gpio.level[matrix->rows[row]]) {
+                level = 0;
+            }
+        }
+        host_sim_set_pin(matrix->cols[col], level);
+    }
+}
+
+static void host_sim_drive(int pin, int level) {
+    host_sim_set_pin(pin, level);
+    host_sim_matrix_update();
+    host_sim_update_registers();
+    host_sim_pcnt_update();
+}
+
+static bool host_sim_interrupt_pending(int pin) {
+    if (sim.gpio.isr[pin] == NULL) {
+        return false;
+    }
+    switch (sim.gpio.intr_type[pin]) {
+        case GPIO_INTR_LOW_LEVEL:
+            return !sim.gpio.level[pin];
+        case GPIO_INTR_HIGH_LEVEL:
+            return sim.gpio.level[pin];
+        case GPIO_INTR_DISABLE:
+            return false;
+        default:
+            return sim.gpio.edge[pin];
+    }
+}
+
+static bool host_sim_task_ready(void) {
+    return sim.task.code != NULL && sim.task.value != 0 &&
+           sim.now >= sim.task.notified_at + sim.task_latency_us;
+}
+
+/**
+ * Hand the CPU to the task and wait until it blocks in xTaskNotifyWait again.
+ */
+static void host_sim_run_task(void) {
+    pthread_mutex_lock(&sim.lock);
+    sim.task.running = true;
+    pthread_cond_broadcast(&sim.changed);
+    while (sim.task.running) {
+        pthread_cond_wait(&sim.changed, &sim.lock);
+    }
+    pthread_mutex_unlock(&sim.lock);
+}
+
+/**
+ * Serve level interrupts and latched edges, then the task, until nothing is left to run at
+ * the current time. Level interrupts keep firing while active, as they do on the chip.
+ */
+static void host_sim_service(void) {
+    bool again = true;
+    while (again) {
+        again = false;
+        for (int pin = 0; pin < GPIO_NUM_MAX; pin++) {
+            if (host_sim_interrupt_pending(pin)) {
+                sim.gpio.edge[pin] = false;
+                sim.stats.isr_calls++;
+                sim.gpio.isr[pin](sim.gpio.isr_arg[pin]);
+                again = true;
+            }
+        }
+        if (!again && host_sim_task_ready()) {
+            int64_t delay = sim.now - sim.task.notified_at;
+            if (delay > sim.stats.worst_task_delay_us) {
+                sim.stats.worst_task_delay_us = delay;
+            }
+            sim.stats.task_runs++;
+            host_sim_run_task();
+            again = true;
+        }
+    }
+}
+
+static void *host_sim_task_thread(void *arg) {
+    pthread_mutex_lock(&sim.lock);
+    while (!sim.task.running) {
+        pthread_cond_wait(&sim.changed, &sim.lock);
+    }
+    pthread_mutex_unlock(&sim.lock);
+    sim.task.code(sim.task.arg);
+    return NULL;
+}
+
+static void host_sim_notify(uint32_t value) {
+    if (sim.task.value == 0) {
+        sim.task.notified_at = sim.now;
+    }
+    sim.task.value |= value;
+}
+
+//MARK: Implementation of the public functions
+void host_sim_set_task_latency(int64_t latency_us) {
+    sim.task_latency_us = latency_us;
+}
+
+void host_sim_set_level(gpio_num_t gpio_num, int level) {
+    host_sim_drive(gpio_num, level);
+    host_sim_service();
+}
+
+void host_sim_set_matrix(const gpio_num_t *rows, uint8_t row_count, const gpio_num_t *cols, uint8_t col_count) {
+    matrix_state_t *matrix = &sim.matrix;
+    row_count = row_count < HOST_SIM_MATRIX_MAX_LINES ? row_count : HOST_SIM_MATRIX_MAX_LINES;
+    col_count = col_count < HOST_SIM_MATRIX_MAX_LINES ? col_count : HOST_SIM_MATRIX_MAX_LINES;
+    memcpy(matrix->rows, rows, row_count * sizeof(gpio_num_t));
+    memcpy(matrix->cols, cols, col_count * sizeof(gpio_num_t));
+    matrix->row_count = row_count;
+    matrix->col_count = col_count;
+    matrix->pressed = 0;
+}
+
+void host_sim_set_key(int key, bool pressed) {
+    if (pressed) {
+        sim.matrix.pressed |= 1ULL << key;
+    } else {
+        sim.matrix.pressed &= ~(1ULL << key);
+    }
+    host_sim_matrix_update();
+    host_sim_update_registers();
+    host_sim_service();
+}
+
+void host_sim_advance(int64_t until_us) {
+    for (;;) {
+        struct esp_timer *next = NULL;
+        for (size_t i = 0; i < sim.timer_count; i++) {
+            struct esp_timer *timer = &sim.timers[i];
+            if (timer->active && timer->alarm <= until_us && (next == NULL || timer->alarm < next->alarm)) {
+                next = timer;
+            }
+        }
+        int64_t task_at = sim.task.value != 0 ? sim.task.notified_at + sim.task_latency_us : INT64_MAX;
+        if (task_at <= until_us && (next == NULL || task_at < next->alarm)) {
+            sim.now = task_at > sim.now ? task_at : sim.now;
+            host_sim_service();
+            continue;
+        }
+        if (next == NULL) {
+            break;
+        }
+
+        sim.now = next->alarm > sim.now ? next->alarm : sim.now;
+        if (next->period != 0) {
+            next->alarm += next->period;
+        } else {
+            next->active = false;
+        }
+        sim.stats.timer_callbacks++;
+        next->callback(next->arg);
+        host_sim_service();
+    }
+    if (until_us > sim.now) {
+        sim.now = until_us;
+    }
+    host_sim_service();
+}
+
+int64_t host_sim_now(void) {
+    return sim.now;
+}
+
+void host_sim_get_stats(host_sim_stats_t *stats) {
+    *stats = sim.stats;
+}
+
+//MARK: ESP-IDF stand-ins
+esp_err_t esp_sleep_enable_gpio_wakeup(void) {
+    return ESP_OK;
+}
+
+void esp_rom_delay_us(uint32_t us) {
+}
+
+esp_err_t gpio_config(const gpio_config_t *config) {
+    for (int pin = 0; pin < GPIO_NUM_MAX; pin++) {
+        if (config->pin_bit_mask & (1ULL << pin)) {
+            sim.gpio.intr_type[pin] = config->intr_type;
+            if (config->pull_up_en) {
+                host_sim_drive(pin, 1);
+            } else if (config->pull_down_en) {
+                host_sim_drive(pin, 0);
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void *args) {
+    sim.gpio.isr[gpio_num] = isr_handler;
+    sim.gpio.isr_arg[gpio_num] = args;
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t gpio_num) {
+    sim.gpio.isr[gpio_num] = NULL;
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type) {
+    sim.gpio.intr_type[gpio_num] = intr_type;
+    sim.gpio.edge[gpio_num] = false;
+    return ESP_OK;
+}
+
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type) {
+    return ESP_OK;
+}
+
+esp_err_t gpio_wakeup_disable(gpio_num_t gpio_num) {
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num) {
+    return sim.gpio.level[gpio_num];
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level) {
+    host_sim_drive(gpio_num, (int) level);
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_config(const pcnt_config_t *pcnt_config) {
+    if (pcnt_config->channel == PCNT_CHANNEL_0) {
+        sim.pcnt.configured = true;
+        sim.pcnt.pin_a = pcnt_config->pulse_gpio_num;
+        sim.pcnt.pin_b = pcnt_config->ctrl_gpio_num;
+        host_sim_pcnt_update();
+    }
+    return ESP_OK;
+}
+
+esp_err_t pcnt_get_counter_value(pcnt_unit_t pcnt_unit, int16_t *count) {
+    *count = sim.pcnt.count;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_counter_pause(pcnt_unit_t pcnt_unit) {
+    sim.pcnt.counting = false;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_counter_resume(pcnt_unit_t pcnt_unit) {
+    sim.pcnt.counting = true;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_counter_clear(pcnt_unit_t pcnt_unit) {
+    sim.pcnt.count = 0;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_set_filter_value(pcnt_unit_t unit, uint16_t filter_val) {
+    return ESP_OK;
+}
+
+esp_err_t pcnt_filter_enable(pcnt_unit_t unit) {
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle) {
+    if (sim.timer_count == HOST_SIM_MAX_TIMERS) {
+        return ESP_ERR_NO_MEM;
+    }
+    struct esp_timer *timer = &sim.timers[sim.timer_count++];
+    memset(timer, 0, sizeof(struct esp_timer));
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    if (timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->alarm = sim.now + (int64_t) timeout_us;
+    timer->period = 0;
+    timer->active = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    if (timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->alarm = sim.now + (int64_t) period;
+    timer->period = period;
+    timer->active = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    if (!timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->active = false;
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void) {
+    return sim.now;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *created_task) {
+    if (sim.task.code != NULL) {
+        return pdFAIL;
+    }
+    sim.task.code = task_code;
+    sim.task.arg = arg;
+    if (pthread_create(&sim.task.thread, NULL, host_sim_task_thread, NULL) != 0) {
+        sim.task.code = NULL;
+        return pdFAIL;
+    }
+    if (created_task != NULL) {
+        *created_task = &sim.task;
+    }
+
+    // A new task runs straight away until it first blocks
+    host_sim_run_task();
+    return pdPASS;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action) {
+    host_sim_notify(value);
+    return pdPASS;
+}
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action,
+                              BaseType_t *higher_priority_task_woken) {
+    host_sim_notify(value);
+    if (higher_priority_task_woken != NULL) {
+        *higher_priority_task_woken = pdTRUE;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t bits_to_clear_on_entry, uint32_t bits_to_clear_on_exit,
+                           uint32_t *notification_value, TickType_t ticks_to_wait) {
+    pthread_mutex_lock(&sim.lock);
+    sim.task.running = false;
+    pthread_cond_broadcast(&sim.changed);
+    while (!sim.task.running) {
+        pthread_cond_wait(&sim.changed, &sim.lock);
+    }
+    if (notification_value != NULL) {
+        *notification_value = sim.task.value;
+    }
+    sim.task.value &= ~bits_to_clear_on_exit;
+    pthread_mutex_unlock(&sim.lock);
+    return pdTRUE;
+}
@@ -0,0 +1,502 @@
+//
+// Runs typical components/data_storage workloads against the host NVS and prints what each one
+// costs in flash operations.
+//
+// Every scenario starts from an erased partition. Only what happens after its setup is counted,
+// up to and including the final flush. Latencies are rough ESP32 figures unless overridden;
+// they only add up to busy_ms unless -s makes the NVS really wait them out.
+//
+// Reads made by a scenario are checked against what it wrote, and after the counting stops the
+// component is restarted and everything is read back from the NVS once more. The batch recovery
+// scenario cuts the power at each step of a batch commit and checks the values after a reboot.
+// Exit code 1 on any failed scenario or on data that does not match.
+//
+
+//MARK: Import common headers
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "data_storage.h"
+#include "host_nvs.h"
+
+//MARK: Macros and constants
+#define BENCH_COUNT_DEFAULT 100
+#define BENCH_READ_LATENCY_US 20
+#define BENCH_WRITE_LATENCY_US 60
+#define BENCH_ERASE_LATENCY_US 30000
+#define BENCH_NAMESPACE DATA_STORAGE_DEFAULT_NAMESPACE
+#define BENCH_CONFIG_SIZE 92        // sizeof(config_record_t) in main.c
+#define BENCH_STREAM_SIZE 4096
+#define BENCH_BLOB_MAX 128
+#define BENCH_BATCH_OPERATIONS 6    // .batch set, three values, .batch erase and commit
+
+//MARK: Types
+typedef struct {
+    const char *name;
+    esp_err_t (*run)(uint32_t count);
+    void (*check)(uint32_t count);  // After a restart, NULL when there is nothing left to read back
+} scenario_t;
+
+//MARK: Global variables
+static struct timespec bench_started;
+static const char *bench_scenario;
+static uint32_t mismatches;
+static const char *const bench_group_keys[] = {"interval", "latency", "timeout"};
+
+//MARK: Private functions
+/**
+ * Start counting: everything the scenario set up so far is flushed and left out.
+ */
+static esp_err_t bench_begin(void) {
+    esp_err_t err = data_storage_flush();
+    host_nvs_reset_stats();
+    data_storage_reset_stats();
+    clock_gettime(CLOCK_MONOTONIC, &bench_started);
+    return err;
+}
+
+static void bench_fill(uint8_t *data, size_t length, uint32_t seed) {
+    for (size_t i = 0; i < length; i++) {
+        data[i] = (uint8_t) (seed * 31 + i);
+    }
+}
+
+static void bench_expect(bool same, const char *key, const char *what) {
+    if (!same) {
+        fprintf(stderr, "%s: %s %s\n", bench_scenario, key, what);
+        mismatches++;
+    }
+}
+
+static void bench_expect_blob(const char *key, const uint8_t *data, size_t length, uint32_t seed) {
+    uint8_t expected[BENCH_BLOB_MAX];
+    bench_fill(expected, length, seed);
+    bench_expect(memcmp(data, expected, length) == 0, key, "read back differs from what was written");
+}
+
+static void bench_check_blob(const char *key, size_t length, uint32_t seed) {
+    uint8_t data[BENCH_BLOB_MAX];
+    size_t read_length = sizeof(data);
+    esp_err_t err = data_storage_read_into(BENCH_NAMESPACE, key, data, &read_length);
+    bench_expect(err == ESP_OK, key, esp_err_to_name(err));
+    bench_expect(err != ESP_OK || read_length == length, key, "read back with a different length");
+    if (err == ESP_OK && read_length == length) {
+        bench_expect_blob(key, data, length, seed);
+    }
+}
+
+static void bench_check_i32(const char *key, int32_t expected) {
+    int32_t value = 0;
+    esp_err_t err = data_storage_read_i32(BENCH_NAMESPACE, key, &value);
+    bench_expect(err == ESP_OK, key, esp_err_to_name(err));
+    bench_expect(err != ESP_OK || value == expected, key, "read back differs from what was written");
+}
+
+static esp_err_t scenario_config_boot(uint32_t count) {
+    uint8_t record[BENCH_CONFIG_SIZE];
+    bench_fill(record, sizeof(record), 1);
+    esp_err_t err = data_storage_write(BENCH_NAMESPACE, "config", record, sizeof(record));
+
+    // What main.c does on every boot: pin, read and write back the same record
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        err = data_storage_deinit();
+        if (err == ESP_OK) {
+            err = data_storage_init();
+        }
+        if (i == 0 && err == ESP_OK) {
+            err = bench_begin();
+        }
+        if (err == ESP_OK) {
+            err = data_storage_pin(BENCH_NAMESPACE, "config");
+        }
+        size_t length = sizeof(record);
+        if (err == ESP_OK) {
+            err = data_storage_read_into(BENCH_NAMESPACE, "config", record, &length);
+        }
+        if (err == ESP_OK) {
+            bench_expect(length == sizeof(record), "config", "read back with a different length");
+            bench_expect_blob("config", record, sizeof(record), 1);
+            err = data_storage_write(BENCH_NAMESPACE, "config", record, length);
+        }
+    }
+    return err;
+}
+
+static void check_config_boot(uint32_t count) {
+    bench_check_blob("config", BENCH_CONFIG_SIZE, 1);
+}
+
+static esp_err_t scenario_same_blob(uint32_t count) {
+    uint8_t data[32];
+    bench_fill(data, sizeof(data), 2);
+    esp_err_t err = data_storage_write(BENCH_NAMESPACE, "same", data, sizeof(data));
+    if (err == ESP_OK) {
+        err = bench_begin();
+    }
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        err = data_storage_write(BENCH_NAMESPACE, "same", data, sizeof(data));
+    }
+    return err;
+}
+
+static void check_same_blob(uint32_t count) {
+    bench_check_blob("same", 32, 2);
+}
+
+static esp_err_t scenario_counter(uint32_t count) {
+    esp_err_t err = bench_begin();
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        err = data_storage_write_i32(BENCH_NAMESPACE, "counter", i);
+    }
+    return err;
+}
+
+static void check_counter(uint32_t count) {
+    bench_check_i32("counter", count - 1);
+}
+
+// Write-through is a flush after every write: a zero commit delay only hands the flush to the
+// storage worker, which may merge several writes into one commit
+static esp_err_t bench_write_i32_through(const char *key, int32_t value) {
+    esp_err_t err = data_storage_write_i32(BENCH_NAMESPACE, key, value);
+    return err == ESP_OK ? data_storage_flush() : err;
+}
+
+static esp_err_t scenario_counter_through(uint32_t count) {
+    esp_err_t err = bench_begin();
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        err = bench_write_i32_through("counter", i);
+    }
+    return err;
+}
+
+static esp_err_t scenario_blob_through(uint32_t count) {
+    uint8_t data[64];
+    esp_err_t err = bench_begin();
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        bench_fill(data, sizeof(data), i);
+        err = data_storage_write(BENCH_NAMESPACE, "blob", data, sizeof(data));
+        err = err == ESP_OK ? data_storage_flush() : err;
+    }
+    return err;
+}
+
+static void check_blob_through(uint32_t count) {
+    bench_check_blob("blob", 64, count - 1);
+}
+
+// A setting spread over three keys, e.g. pairing data with its connection parameters
+static esp_err_t scenario_group_through(uint32_t count) {
+    esp_err_t err = bench_begin();
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        for (size_t k = 0; k < 3 && err == ESP_OK; k++) {
+            err = bench_write_i32_through(bench_group_keys[k], i);
+        }
+    }
+    return err;
+}
+
+static esp_err_t bench_group_batch(int32_t value, bool atomic) {
+    data_storage_batch_t batch;
+    esp_err_t err = atomic ? data_storage_batch_begin(&batch, BENCH_NAMESPACE)
+                           : data_storage_batch_begin_unlogged(&batch, BENCH_NAMESPACE);
+    for (size_t k = 0; k < 3; k++) {
+        data_storage_batch_set_i32(&batch, bench_group_keys[k], value);
+    }
+    return err == ESP_OK ? data_storage_batch_commit(&batch) : err;
+}
+
+static esp_err_t scenario_group_batch(uint32_t count) {
+    esp_err_t err = bench_begin();
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        err = bench_group_batch(i, true);
+    }
+    return err;
+}
+
+static esp_err_t scenario_group_unlogged(uint32_t count) {
+    esp_err_t err = bench_begin();
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        err = bench_group_batch(i, false);
+    }
+    return err;
+}
+
+static void check_group(uint32_t count) {
+    for (size_t k = 0; k < 3; k++) {
+        bench_check_i32(bench_group_keys[k], count - 1);
+    }
+}
+
+/**
+ * Cut the power at each step of a batch commit in turn and reboot. The three values must come
+ * back all old or all new, and new whenever the commit reported success.
+ */
+static esp_err_t scenario_batch_recovery(uint32_t count) {
+    int32_t expected = -1;
+    esp_err_t err = bench_group_batch(expected, true);
+    if (err == ESP_OK) {
+        err = bench_begin();
+    }
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        host_nvs_power_cut(i % (BENCH_BATCH_OPERATIONS + 1));
+        esp_err_t commit_err = bench_group_batch(i, true);
+        // Nothing of the cut short commit survives in RAM
+        data_storage_deinit();
+        host_nvs_power_restore();
+        err = data_storage_init();
+
+        int32_t values[3] = {0};
+        for (size_t k = 0; k < 3 && err == ESP_OK; k++) {
+            err = data_storage_read_i32(BENCH_NAMESPACE, bench_group_keys[k], &values[k]);
+        }
+        if (err != ESP_OK) {
+            break;
+        }
+        bool old = values[0] == expected && values[1] == expected && values[2] == expected;
+        bool new = values[0] == (int32_t) i && values[1] == (int32_t) i && values[2] == (int32_t) i;
+        bench_expect(old || new, "batch", "partly applied after a power cut");
+        bench_expect(new || commit_err != ESP_OK, "batch", "lost after a successful commit");
+        expected = new ? (int32_t) i : expected;
+
+        uint8_t log[DATA_STORAGE_BATCH_BYTES_MAX];
+        size_t length = sizeof(log);
+        bench_expect(data_storage_read_into(BENCH_NAMESPACE, ".batch", log, &length) == ESP_ERR_NVS_NOT_FOUND,
+                     ".batch", "left behind after recovery");
+    }
+    return err;
+}
+
+static esp_err_t bench_stream_write(uint32_t seed) {
+    static uint8_t data[BENCH_STREAM_SIZE];
+    data_storage_stream_t stream;
+    bench_fill(data, sizeof(data), seed);
+    esp_err_t err = data_storage_stream_open_write(&stream, BENCH_NAMESPACE, "stream");
+    if (err == ESP_OK) {
+        err = data_storage_stream_write(&stream, data, sizeof(data));
+        esp_err_t close_err = data_storage_stream_close(&stream);
+        err = err == ESP_OK ? close_err : err;
+    }
+    return err;
+}
+
+/**
+ * Read the stream back in small pieces, as a consumer without a 4 kB buffer would.
+ */
+static esp_err_t bench_stream_read(uint32_t seed) {
+    static uint8_t expected[BENCH_STREAM_SIZE];
+    uint8_t data[64];
+    data_storage_stream_t stream;
+    size_t offset = 0;
+    size_t read_length = 0;
+    bool same = true;
+    bench_fill(expected, sizeof(expected), seed);
+    esp_err_t err = data_storage_stream_open_read(&stream, BENCH_NAMESPACE, "stream");
+    if (err != ESP_OK) {
+        return err;
+    }
+    do {
+        err = data_storage_stream_read(&stream, data, sizeof(data), &read_length);
+        if (err == ESP_OK && read_length > 0) {
+            same = same && read_length <= sizeof(expected) - offset &&
+                   memcmp(data, &expected[offset], read_length) == 0;
+            offset += read_length;
+        }
+    } while (err == ESP_OK && read_length > 0);
+    data_storage_stream_close(&stream);
+    if (err == ESP_OK) {
+        bench_expect(same && offset == sizeof(expected), "stream", "read back differs from what was written");
+    }
+    return err;
+}
+
+static esp_err_t scenario_stream_write(uint32_t count) {
+    esp_err_t err = bench_begin();
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        err = bench_stream_write(i);
+    }
+    return err;
+}
+
+static esp_err_t scenario_stream_read(uint32_t count) {
+    esp_err_t err = bench_stream_write(0);
+    if (err == ESP_OK) {
+        err = bench_begin();
+    }
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        err = bench_stream_read(0);
+    }
+    return err;
+}
+
+static void check_stream_write(uint32_t count) {
+    esp_err_t err = bench_stream_read(count - 1);
+    bench_expect(err == ESP_OK, "stream", esp_err_to_name(err));
+}
+
+static void check_stream_read(uint32_t count) {
+    esp_err_t err = bench_stream_read(0);
+    bench_expect(err == ESP_OK, "stream", esp_err_to_name(err));
+}
+
+static esp_err_t scenario_pinned_read(uint32_t count) {
+    uint8_t data[BENCH_CONFIG_SIZE];
+    bench_fill(data, sizeof(data), 3);
+    esp_err_t err = data_storage_write(BENCH_NAMESPACE, "pinned", data, sizeof(data));
+    if (err == ESP_OK) {
+        err = data_storage_pin(BENCH_NAMESPACE, "pinned");
+    }
+    if (err == ESP_OK) {
+        err = bench_begin();
+    }
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        size_t length = sizeof(data);
+        memset(data, 0, sizeof(data));
+        err = data_storage_read_into(BENCH_NAMESPACE, "pinned", data, &length);
+        if (err == ESP_OK) {
+            bench_expect(length == sizeof(data), "pinned", "read back with a different length");
+            bench_expect_blob("pinned", data, sizeof(data), 3);
+        }
+    }
+    data_storage_unpin(BENCH_NAMESPACE, "pinned");
+    return err;
+}
+
+static void check_pinned_read(uint32_t count) {
+    bench_check_blob("pinned", BENCH_CONFIG_SIZE, 3);
+}
+
+static const scenario_t scenarios[] = {
+        {"config boot", scenario_config_boot, check_config_boot},
+        {"same blob", scenario_same_blob, check_same_blob},
+        {"i32 write-back", scenario_counter, check_counter},
+        {"i32 write-through", scenario_counter_through, check_counter},
+        {"64 B write-through", scenario_blob_through, check_blob_through},
+        {"3 keys write-through", scenario_group_through, check_group},
+        {"3 keys batch", scenario_group_batch, check_group},
+        {"3 keys unlogged", scenario_group_unlogged, check_group},
+        {"batch recovery", scenario_batch_recovery, NULL},
+        {"4 kB stream write", scenario_stream_write, check_stream_write},
+        {"4 kB stream read", scenario_stream_read, check_stream_read},
+        {"pinned read", scenario_pinned_read, check_pinned_read},
+};
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n COUNT   repetitions per scenario (default %d)\n"
+            "  -p PAGES   NVS partition size in 4 kB pages (default 6)\n"
+            "  -f FILE    back the NVS with FILE instead of RAM only\n"
+            "  -r US      latency per read (default %d)\n"
+            "  -w US      latency per 32 byte entry written (default %d)\n"
+            "  -e US      latency per page erase (default %d)\n"
+            "  -s         really wait out the latencies\n"
+            "  -V         print component logs\n",
+            name, BENCH_COUNT_DEFAULT, BENCH_READ_LATENCY_US, BENCH_WRITE_LATENCY_US, BENCH_ERASE_LATENCY_US);
+}
+
+//MARK: Main
+int main(int argc, char **argv) {
+    host_nvs_config_t config = {
+            .pages = 6,
+            .read_latency_us = BENCH_READ_LATENCY_US,
+            .write_latency_us = BENCH_WRITE_LATENCY_US,
+            .erase_latency_us = BENCH_ERASE_LATENCY_US,
+    };
+    long count = BENCH_COUNT_DEFAULT;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:p:f:r:w:e:sV")) != -1) {
+        switch (option) {
+            case 'n':
+                count = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                config.pages = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                config.path = optarg;
+                break;
+            case 'r':
+                config.read_latency_us = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                config.write_latency_us = strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                config.erase_latency_us = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                config.sleep = true;
+                break;
+            case 'V':
+                host_log_verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc || count < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    host_nvs_configure(&config);
+    printf("%-20s %7s %7s %7s %8s %7s %8s %8s %9s\n",
+           "scenario", "calls", "reads", "sets", "entries", "erases", "commits", "skipped", "busy_ms");
+    int result = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        bench_scenario = scenarios[i].name;
+        esp_err_t err = nvs_flash_erase();
+        if (err == ESP_OK) {
+            err = data_storage_init();
+        }
+        if (err == ESP_OK) {
+            err = scenarios[i].run(count);
+        }
+        if (err == ESP_OK) {
+            err = data_storage_flush();
+        }
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        host_nvs_stats_t stats;
+        host_nvs_get_stats(&stats);
+        data_storage_stats_t storage_stats;
+        data_storage_get_stats(&storage_stats);
+        data_storage_deinit();
+        // Read back from the NVS itself, with nothing left in the cache
+        if (err == ESP_OK && scenarios[i].check != NULL) {
+            err = data_storage_init();
+            if (err == ESP_OK) {
+                scenarios[i].check(count);
+                data_storage_deinit();
+            }
+        }
+        nvs_flash_deinit();
+
+        if (err != ESP_OK) {
+            fprintf(stderr, "%s: %s\n", scenarios[i].name, esp_err_to_name(err));
+            result = 1;
+            continue;
+        }
+        printf("%-20s %7ld %7" PRIu32 " %7" PRIu32 " %8" PRIu32 " %7" PRIu32 " %8" PRIu32 " %8" PRIu32 " %9.1f\n",
+               scenarios[i].name, count, stats.reads, stats.sets, stats.entry_writes, stats.page_erases,
+               stats.commits, storage_stats.writes_skipped, stats.busy_us / 1000.0);
+        // Wall clock figures change from run to run, keep them off stdout so it can be diffed
+        fprintf(stderr, "%s: %.3f ms, slowest set %" PRIu32 " us, slowest commit %" PRIu32 " us\n", scenarios[i].name,
+                (finished.tv_sec - bench_started.tv_sec) * 1e3 + (finished.tv_nsec - bench_started.tv_nsec) / 1e6,
+                storage_stats.set.max_us, storage_stats.commit.max_us);
+    }
+    if (mismatches > 0) {
+        fprintf(stderr, "%" PRIu32 " mismatches\n", mismatches);
+        result = 1;
+    }
+    return result;
+}
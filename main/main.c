@@ -1,36 +1,420 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "nvs.h"
 #include "freertos/FreeRTOS.h"
 #include "main_config.h"
 #include <freertos/task.h>
 #include "ble.h"
 #include "data_storage.h"
+#include "journal.h"
+#include "counter.h"
+#include "assets.h"
+#include "peers.h"
 #include "button.h"
+#include "hid_dev.h"
 
 #define TAG "MAIN"
 
-esp_err_t keyboard_callback(gpio_num_t pin, button_event_type_t event) {
+#define KEYBOARD_BUTTON_BIT(x) (1U << (x))
+
+typedef enum {
+    KEYBOARD_BUTTON_BACK = 0,
+    KEYBOARD_BUTTON_FORWARD,
+    KEYBOARD_BUTTON_PLAY,
+    KEYBOARD_BUTTON_SPEED,
+    KEYBOARD_BUTTON_LOOP,
+    KEYBOARD_BUTTON_COUNT,
+} keyboard_button_t;
+
+// Record types in the usage journal
+typedef enum {
+    USAGE_BOOT = 1,                 // arg: esp_reset_reason_t, value: CONFIG_VERSION
+    USAGE_BUTTON_PRESS,             // arg: keyboard_button_t
+    USAGE_CONNECTED,
+    USAGE_DISCONNECTED,
+    USAGE_CONFIG_ERROR,             // value: esp_err_t
+} usage_record_t;
+
+// Lifetime totals in the counters partition
+typedef enum {
+    USAGE_COUNTER_BOOTS = 0,
+    USAGE_COUNTER_KEY_PRESSES,
+    USAGE_COUNTER_CONNECTIONS,
+} usage_counter_t;
+
+/**
+ * Button setup kept in the config record, so that one image can serve boards with a different
+ * pin map. Falls back to the main_config.h defaults when invalid.
+ */
+typedef struct {
+    uint8_t version;
+    uint8_t active_high;            // Bit per keyboard_button_t
+    uint8_t pins[KEYBOARD_BUTTON_COUNT];
+    uint32_t long_press_ms;
+    uint32_t long_long_press_ms;
+    uint32_t debounce_sample_period_us;
+    uint32_t debounce_window_us;
+    uint32_t chord_window_ms;
+    uint32_t tap_window_ms;
+    uint32_t repeat_delay_ms;
+    uint32_t repeat_interval_ms;
+} keyboard_config_t;
+
+static const keyboard_config_t keyboard_config_default = {
+        .version = CONFIG_BUTTON_STORAGE_VERSION,
+        .active_high = CONFIG_BUTTON_ACTIVE_HIGH,
+        .pins = {
+                [KEYBOARD_BUTTON_BACK] = CONFIG_BUTTON_BACK,
+                [KEYBOARD_BUTTON_FORWARD] = CONFIG_BUTTON_FORWARD,
+                [KEYBOARD_BUTTON_PLAY] = CONFIG_BUTTON_PLAY,
+                [KEYBOARD_BUTTON_SPEED] = CONFIG_BUTTON_SPEED,
+                [KEYBOARD_BUTTON_LOOP] = CONFIG_BUTTON_LOOP,
+        },
+        .long_press_ms = CONFIG_BUTTON_LONG_PRESS_DURATION,
+        .long_long_press_ms = CONFIG_BUTTON_LONG_LONG_PRESS_DURATION,
+        .debounce_sample_period_us = CONFIG_BUTTON_DEBOUNCE_SAMPLE_PERIOD_US,
+        .debounce_window_us = CONFIG_BUTTON_DEBOUNCE_WINDOW_US,
+        .chord_window_ms = CONFIG_BUTTON_CHORD_WINDOW_MS,
+        .tap_window_ms = CONFIG_BUTTON_TAP_WINDOW_MS,
+        .repeat_delay_ms = CONFIG_BUTTON_REPEAT_DELAY_MS,
+        .repeat_interval_ms = CONFIG_BUTTON_REPEAT_INTERVAL_MS,
+};
+
+/**
+ * Everything read from storage at boot, kept as one blob under CONFIG_VERSION_STORAGE_KEY so
+ * that startup costs a single flash read. Fields are only ever appended: a record written by an
+ * older firmware keeps its prefix, gets defaults for the rest and then runs config_migrations.
+ */
+typedef struct {
+    uint32_t crc;                   // esp_rom_crc32_le over everything after this field
+    uint32_t version;               // CONFIG_VERSION of the firmware that wrote the record
+    uint16_t length;                // sizeof(config_record_t) of that firmware
+    config_data_t ble;
+    keyboard_config_t keyboard;
+} config_record_t;
+
+typedef void (*config_migration_t)(config_record_t *record);
+typedef void (*config_cleanup_t)(void);
+
+typedef struct {
+    uint32_t version;
+    config_migration_t migrate;
+    config_cleanup_t cleanup;       // Once the migrated record is in flash, may be NULL
+} config_migration_step_t;
+
+static config_data_t ble_config;
+static keyboard_config_t keyboard_config;
+
+static uint64_t keyboard_pin_mask(uint32_t buttons) {
+    uint64_t mask = 0;
+    for (int i = 0; i < KEYBOARD_BUTTON_COUNT; i++) {
+        if (buttons & KEYBOARD_BUTTON_BIT(i)) {
+            mask |= BUTTON_PIN_BIT(keyboard_config.pins[i]);
+        }
+    }
+    return mask;
+}
+
+static bool keyboard_config_valid(const keyboard_config_t *config) {
+    uint64_t pins = 0;
+
+    if (config->version != CONFIG_BUTTON_STORAGE_VERSION || config->debounce_sample_period_us == 0) {
+        return false;
+    }
+    for (int i = 0; i < KEYBOARD_BUTTON_COUNT; i++) {
+        gpio_num_t pin = (gpio_num_t) config->pins[i];
+        if (!GPIO_IS_VALID_GPIO(pin) || (pins & BUTTON_PIN_BIT(pin))) {
+            return false;
+        }
+        // Active-low buttons rely on the internal pull-up, input-only pins have none
+        if (!(config->active_high & KEYBOARD_BUTTON_BIT(i)) && !GPIO_IS_VALID_OUTPUT_GPIO(pin)) {
+            return false;
+        }
+        pins |= BUTTON_PIN_BIT(pin);
+    }
+    return true;
+}
+
+/**
+ * 1.1.0 moved the button setup from its own key into the config record.
+ */
+static void config_migrate_button_key(config_record_t *record) {
+    keyboard_config_t stored;
+    size_t length = sizeof(keyboard_config_t);
+
+    esp_err_t err = data_storage_read_into(DATA_STORAGE_DEFAULT_NAMESPACE, CONFIG_BUTTON_STORAGE_KEY,
+                                           (uint8_t *) &stored, &length);
+    if (err == ESP_OK && length == sizeof(keyboard_config_t) && keyboard_config_valid(&stored)) {
+        record->keyboard = stored;
+    }
+}
+
+static void config_erase_button_key(void) {
+    esp_err_t err = data_storage_erase(DATA_STORAGE_DEFAULT_NAMESPACE, CONFIG_BUTTON_STORAGE_KEY);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot erase the old button key: %s", esp_err_to_name(err));
+    }
+}
+
+// Ascending by version; a step runs when the stored record is older than its version
+static const config_migration_step_t config_migrations[] = {
+        {CONFIG_VERSION_NUMBER(1, 1, 0), config_migrate_button_key, config_erase_button_key},
+};
+
+/**
+ * Drop what the migrations from version replaced. The record is written back lazily, so it is
+ * flushed first: a reset in between must not lose both the old and the new copy.
+ */
+static void config_migrations_cleanup(uint32_t version) {
+    bool flushed = false;
+    for (int i = 0; i < sizeof(config_migrations) / sizeof(config_migrations[0]); i++) {
+        if (version >= config_migrations[i].version || config_migrations[i].cleanup == NULL) {
+            continue;
+        }
+        if (!flushed) {
+            esp_err_t err = data_storage_flush();
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "Cannot flush the migrated config record: %s", esp_err_to_name(err));
+                return;
+            }
+            flushed = true;
+        }
+        config_migrations[i].cleanup();
+    }
+}
+
+static uint32_t config_record_crc(const config_record_t *record) {
+    return esp_rom_crc32_le(0, (const uint8_t *) &record->version, sizeof(config_record_t) - offsetof(config_record_t, version));
+}
+
+static void config_record_default(config_record_t *record) {
+    // Zeroed padding keeps the CRC stable
+    memset(record, 0, sizeof(config_record_t));
+    strcpy(record->ble.bt_device_name, BT_DEVICE_NAME);
+    record->keyboard = keyboard_config_default;
+}
+
+static esp_err_t config_save() {
+    config_record_t record;
+
+    memset(&record, 0, sizeof(config_record_t));
+    record.version = CONFIG_VERSION;
+    record.length = sizeof(config_record_t);
+    record.ble = ble_config;
+    record.keyboard = keyboard_config;
+    record.crc = config_record_crc(&record);
+    return data_storage_write(DATA_STORAGE_DEFAULT_NAMESPACE, CONFIG_VERSION_STORAGE_KEY,
+                              (const uint8_t *) &record, sizeof(config_record_t));
+}
+
+static bool config_record_check(const config_record_t *stored, size_t length) {
+    return length > offsetof(config_record_t, ble) && length == stored->length &&
+           esp_rom_crc32_le(0, (const uint8_t *) &stored->version, length - offsetof(config_record_t, version)) == stored->crc;
+}
+
+static void config_load() {
+    config_record_t stored;
+    config_record_t record;
+    size_t length = sizeof(config_record_t);
+    uint32_t version = 0;
+    bool newer = false;
+
+    // Read at boot and rewritten on every settings change, worth keeping in RAM
+    data_storage_pin(DATA_STORAGE_DEFAULT_NAMESPACE, CONFIG_VERSION_STORAGE_KEY);
+    config_record_default(&record);
+    esp_err_t err = data_storage_read_into(DATA_STORAGE_DEFAULT_NAMESPACE, CONFIG_VERSION_STORAGE_KEY,
+                                           (uint8_t *) &stored, &length);
+    bool valid = err == ESP_OK && config_record_check(&stored, length);
+    if (err == ESP_ERR_NVS_INVALID_LENGTH) {
+        // A newer firmware appended fields, check the whole record and keep the prefix known here
+        uint8_t *larger = NULL;
+        err = data_storage_read_alloc(DATA_STORAGE_DEFAULT_NAMESPACE, CONFIG_VERSION_STORAGE_KEY, &larger, &length);
+        if (err == ESP_OK) {
+            valid = config_record_check((const config_record_t *) larger, length);
+            memcpy(&stored, larger, sizeof(config_record_t));
+            free(larger);
+        }
+    }
+    if (valid) {
+        memcpy(&record, &stored, length < sizeof(config_record_t) ? length : sizeof(config_record_t));
+        version = stored.version;
+        newer = version > CONFIG_VERSION || length > sizeof(config_record_t);
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "No config record stored, creating one");
+    } else if (err == ESP_OK) {
+        ESP_LOGW(TAG, "Config record failed its check, using defaults");
+        journal_append(USAGE_CONFIG_ERROR, 0, ESP_ERR_INVALID_CRC);
+    } else {
+        ESP_LOGW(TAG, "Config record unusable (%s), using defaults", esp_err_to_name(err));
+        journal_append(USAGE_CONFIG_ERROR, 0, err);
+    }
+
+    for (int i = 0; i < sizeof(config_migrations) / sizeof(config_migrations[0]); i++) {
+        if (version < config_migrations[i].version) {
+            ESP_LOGI(TAG, "Migrating config from %06x to %06x", version, config_migrations[i].version);
+            config_migrations[i].migrate(&record);
+        }
+    }
+
+    if (!keyboard_config_valid(&record.keyboard)) {
+        record.keyboard = keyboard_config_default;
+    }
+    if (record.ble.bt_device_name[0] == '\0' || strnlen(record.ble.bt_device_name, MAX_BT_DEVICENAME_LENGTH) == MAX_BT_DEVICENAME_LENGTH) {
+        strcpy(record.ble.bt_device_name, BT_DEVICE_NAME);
+    }
+    ble_config = record.ble;
+    keyboard_config = record.keyboard;
+
+    if (newer) {
+        // Rewriting it would drop what the newer firmware added and run its migrations again
+        // after an upgrade, leave it for that firmware
+        ESP_LOGW(TAG, "Config record from newer firmware %06x, not rewriting it", version);
+        return;
+    }
+
+    // Unchanged records cost nothing here, data_storage compares before writing
+    err = config_save();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot store config record: %s", esp_err_to_name(err));
+        journal_append(USAGE_CONFIG_ERROR, 0, err);
+        return;
+    }
+    config_migrations_cleanup(version);
+}
+
+esp_err_t keyboard_callback(const button_event_t *event) {
+    if (event->type == BUTTON_DOWN) {
+        for (int i = 0; i < KEYBOARD_BUTTON_COUNT; i++) {
+            if (keyboard_config.pins[i] == event->pin) {
+                journal_append(USAGE_BUTTON_PRESS, i, 0);
+                counter_increment_async(USAGE_COUNTER_KEY_PRESSES);
+            }
+        }
+    } else if (event->type == BUTTON_ENCODER) {
+        // A consumer report has no step count, one report per interval keeps a fast spin cheap
+        uint8_t key_cmd;
+        if (button_get_state_mask() & BUTTON_PIN_BIT(keyboard_config.pins[KEYBOARD_BUTTON_PLAY])) {
+            key_cmd = event->delta > 0 ? HID_CONSUMER_FAST_FORWARD : HID_CONSUMER_REWIND;
+        } else {
+            key_cmd = event->delta > 0 ? HID_CONSUMER_VOLUME_UP : HID_CONSUMER_VOLUME_DOWN;
+        }
+        ble_hid_consumer_send_report(key_cmd, true);
+        ble_hid_consumer_send_report(key_cmd, false);
+    }
     return ESP_OK;
 }
 
+void keyboard_report_callback() {
+    // Keep flash commits out of a burst of key reports
+    data_storage_hold_commits(CONFIG_STORAGE_REPORT_HOLD_MS);
+}
+
+void keyboard_connection_callback(bool connected, const uint8_t *bda) {
+    journal_append(connected ? USAGE_CONNECTED : USAGE_DISCONNECTED, 0, 0);
+    if (connected) {
+        counter_increment_async(USAGE_COUNTER_CONNECTIONS);
+        // A host worth connecting to is worth remembering
+        peers_keep(bda);
+    }
+    if (!connected) {
+        button_repeat_stop();
+    }
+}
+
+void keyboard_scan_callback(const uint8_t *bda, const uint8_t *name, uint8_t name_length, int rssi) {
+    peers_seen(bda, name, name_length, rssi);
+}
+
 void keyboard_init() {
+    int64_t started = esp_timer_get_time();
+
+    button_pin_options_t pin_options = {
+            .active_high = keyboard_pin_mask(keyboard_config.active_high),
+    };
+    esp_err_t err = button_init_set(keyboard_pin_mask(UINT32_MAX), &pin_options);
+    if (err != ESP_OK && memcmp(&keyboard_config, &keyboard_config_default, sizeof(keyboard_config_t)) != 0) {
+        // The rest of the setup reads keyboard_config too, so it all moves to the defaults
+        ESP_LOGE(TAG, "Cannot set up the stored buttons (%s), using defaults", esp_err_to_name(err));
+        journal_append(USAGE_CONFIG_ERROR, 0, err);
+        keyboard_config = keyboard_config_default;
+        pin_options.active_high = keyboard_pin_mask(keyboard_config.active_high);
+        err = button_init_set(keyboard_pin_mask(UINT32_MAX), &pin_options);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot set up buttons: %s", esp_err_to_name(err));
+    }
+
+    button_debounce_config_t debounce_config = {
+            .sample_period_us = keyboard_config.debounce_sample_period_us,
+            .window_us = keyboard_config.debounce_window_us,
+    };
+    button_debounce_enable(&debounce_config);
+    button_set_long_press(keyboard_config.long_press_ms, keyboard_config.long_long_press_ms);
+    button_set_chord(keyboard_pin_mask(UINT32_MAX), keyboard_config.chord_window_ms);
+    button_set_multi_tap(keyboard_pin_mask(KEYBOARD_BUTTON_BIT(KEYBOARD_BUTTON_BACK) |
+                                           KEYBOARD_BUTTON_BIT(KEYBOARD_BUTTON_FORWARD) |
+                                           KEYBOARD_BUTTON_BIT(KEYBOARD_BUTTON_PLAY)),
+                         keyboard_config.tap_window_ms, CONFIG_BUTTON_TAP_EAGER);
+
+    button_repeat_config_t repeat_config = {
+            .delay_ms = keyboard_config.repeat_delay_ms,
+            .interval_ms = keyboard_config.repeat_interval_ms,
+            .min_interval_ms = CONFIG_BUTTON_REPEAT_MIN_INTERVAL_MS,
+            .accel_percent = CONFIG_BUTTON_REPEAT_ACCEL_PERCENT,
+    };
+    button_set_repeat(keyboard_config.pins[KEYBOARD_BUTTON_BACK], &repeat_config);
+    button_set_repeat(keyboard_config.pins[KEYBOARD_BUTTON_FORWARD], &repeat_config);
 
-    button_init(CONFIG_BUTTON_BACK);
-    button_init(CONFIG_BUTTON_FORWARD);
-    button_init(CONFIG_BUTTON_PLAY);
-    button_init(CONFIG_BUTTON_SPEED);
-    button_init(CONFIG_BUTTON_LOOP);
+#if CONFIG_ENCODER_ENABLED
+    button_encoder_config_t encoder_config = {
+            .pin_a = CONFIG_ENCODER_PIN_A,
+            .pin_b = CONFIG_ENCODER_PIN_B,
+            .pcnt_unit = CONFIG_ENCODER_PCNT_UNIT,
+            .steps_per_detent = CONFIG_ENCODER_STEPS_PER_DETENT,
+            .report_period_us = CONFIG_ENCODER_REPORT_PERIOD_US,
+    };
+    button_encoder_init(&encoder_config);
+#endif
 
     button_component_init(keyboard_callback);
+    ESP_LOGI(TAG, "Buttons ready in %lld us", esp_timer_get_time() - started);
 }
 
 void app_main(void)
 {
     ESP_LOGI(TAG, "%s", __func__);
 
+    ESP_ERROR_CHECK(data_storage_init());
+    // Diagnostics only, the keyboard works without the partition
+    if (journal_init() == ESP_OK) {
+        journal_append(USAGE_BOOT, esp_reset_reason(), CONFIG_VERSION);
+    }
+    uint32_t boots;
+    if (counter_init() == ESP_OK && counter_increment(USAGE_COUNTER_BOOTS) == ESP_OK &&
+        counter_get(USAGE_COUNTER_BOOTS, &boots) == ESP_OK) {
+        ESP_LOGI(TAG, "Boot %u", boots);
+    }
+    peers_init();
+    int64_t started = esp_timer_get_time();
+    config_load();
+    ESP_LOGI(TAG, "Config loaded in %lld us", esp_timer_get_time() - started);
+    const void *layout;
+    size_t layout_length;
+    if (assets_init() == ESP_OK && assets_get(ASSET_TYPE_LAYOUT, ble_config.locale, &layout, &layout_length) == ESP_OK) {
+        ESP_LOGI(TAG, "Layout for locale %u: %u bytes", ble_config.locale, layout_length);
+    }
     keyboard_init();
 
-    ble_init();
+    ble_set_connection_cb(keyboard_connection_callback);
+    ble_set_report_cb(keyboard_report_callback);
+    ble_set_scan_cb(keyboard_scan_callback);
+    ble_init(&ble_config);
     
 }
@@ -10,9 +10,14 @@
 
 // Version config
 #define CONFIG_VERSION_MAJOR 1
-#define CONFIG_VERSION_MINOR 0
+#define CONFIG_VERSION_MINOR 1
 #define CONFIG_VERSION_PATCH 0
-#define CONFIG_VERSION_STORAGE_KEY "version"
+#define CONFIG_VERSION_NUMBER(major, minor, patch) (((major) << 16) | ((minor) << 8) | (patch))
+#define CONFIG_VERSION CONFIG_VERSION_NUMBER(CONFIG_VERSION_MAJOR, CONFIG_VERSION_MINOR, CONFIG_VERSION_PATCH)
+#define CONFIG_VERSION_STORAGE_KEY "config" // Whole runtime config record, see main.c
+
+// Storage config
+#define CONFIG_STORAGE_REPORT_HOLD_MS 300 // Commits wait this long after an HID report
 
 // Buttons config
 #define CONFIG_BUTTON_LOOP GPIO_NUM_4
@@ -20,8 +25,28 @@
 #define CONFIG_BUTTON_BACK GPIO_NUM_27
 #define CONFIG_BUTTON_SPEED GPIO_NUM_26
 #define CONFIG_BUTTON_FORWARD GPIO_NUM_32
+#define CONFIG_BUTTON_ACTIVE_HIGH 0 // Bit per button in main.c keyboard_button_t order
 #define CONFIG_BUTTON_LONG_PRESS_DURATION 1500
 #define CONFIG_BUTTON_LONG_LONG_PRESS_DURATION 10000
+#define CONFIG_BUTTON_DEBOUNCE_SAMPLE_PERIOD_US 1000
+#define CONFIG_BUTTON_DEBOUNCE_WINDOW_US 5000
+#define CONFIG_BUTTON_CHORD_WINDOW_MS 50
+#define CONFIG_BUTTON_TAP_WINDOW_MS 250
+#define CONFIG_BUTTON_TAP_EAGER true
+#define CONFIG_BUTTON_REPEAT_DELAY_MS 500
+#define CONFIG_BUTTON_REPEAT_INTERVAL_MS 100
+#define CONFIG_BUTTON_REPEAT_MIN_INTERVAL_MS 30
+#define CONFIG_BUTTON_REPEAT_ACCEL_PERCENT 10
+#define CONFIG_BUTTON_STORAGE_KEY "buttons" // Before 1.1.0 only, now part of the config record
+#define CONFIG_BUTTON_STORAGE_VERSION 1
+
+// Encoder config
+#define CONFIG_ENCODER_ENABLED 0
+#define CONFIG_ENCODER_PIN_A GPIO_NUM_33
+#define CONFIG_ENCODER_PIN_B GPIO_NUM_13 // Needs a pull-up, GPIO 34..39 have none
+#define CONFIG_ENCODER_PCNT_UNIT 0
+#define CONFIG_ENCODER_STEPS_PER_DETENT 4
+#define CONFIG_ENCODER_REPORT_PERIOD_US 7500
 
 
 #endif //BLE_KEYBOARD_MAIN_CONFIG_H